@@ -1,8 +1,19 @@
 /*
  * ELF loader to load kernel in memory.
  * Extremely simple and full of flaws, but designed to work with this kernel only.
- * + first loads entire kernel file in memory at address [KERNEL_FILE_ADDR]
- * + then loads loadable segments in memory (at physical addresses)
+ * + reads the ELF and program headers only
+ * + streams each loadable segment from disk straight to its physical
+ *   address (ATA PIO, READ MULTIPLE : one interrupt-less handshake per block
+ *   of sectors rather than per sector), and zeroes its BSS part
+ * + and records their physical extent in the boot info for the kernel
+ * + loads the initrd, if any, at the top of usable memory (see
+ *   load_initrd)
+ * Only segment bytes are read : neither the rest of the file (symbols, debug
+ * information) nor a copy, and the kernel size is not bounded by a staging
+ * area.
+ * The kernel may also come as a packed image (COMPRESS=1, see
+ * tools/kernel-pack.c) : LZ4-compressed segments, read right above the
+ * kernel's final extent and decoded to their physical addresses.
  * Structure of bootable image :
  * +----------------------+
  * +          MBR         + 512 B
@@ -15,16 +26,249 @@
  * |       this file      |  |
  * |       (C code)       | .`
  * +----------------------+`
- * |      Kernel elf      | KERNEL_SIZE
+ * |      Kernel elf      | KERNEL_SIZE, up to the next sector
+ * +----------------------+
+ * |        Initrd        | INITRD_SIZE, optional (see yak/includes/initrd.h)
  * +----------------------+
  */
 
-// Where to load the file from disk (not to be confused with loaded segments,
-// whose location is defined entirely by the ELF PHT)
-#define KERNEL_FILE_ADDR 0x300000
+#include "lz4.h"
+#include "string_ops.h"
+
+// Scratch memory : ELF and program headers, then partial sectors (segments
+// that do not start or end on a sector boundary) and IDENTIFY data
+#define ELF_HEADERS_ADDR 0x300000
+#define ELF_HEADERS_SECTORS 8
+#define SECTOR_BUFFER_ADDR 0x301000
+#define SECTOR_SIZE 512
 #define PT_LOAD 0x01
 
-extern void load_sectors(int offset_disk, int count, void* addr);
+// Packed kernel image. Has to be consistent with tools/kernel-pack.c
+#define PACK_MAGIC 0x5a4b4159
+
+typedef struct {
+    unsigned int magic;
+    unsigned int segments;
+    long entry;
+} PackHeader;
+
+typedef struct {
+    long paddr;
+    long filesz; // Decoded size
+    long memsz;
+    long offset; // LZ4 block, from the start of the image
+    long size;
+} PackSegment;
+
+// Boot info handed to the kernel. Has to be consistent with second-stage.s
+// (which fills the E820 part) and yak/includes/boot.h
+#define BOOT_INFO_ADDR 0x1000
+
+typedef struct {
+    long kernel_start;
+    long kernel_end;
+    // E820 count and entries follow
+} BootInfo;
+
+// E820 entries, filled by second-stage.s
+#define BOOT_INFO_E820_COUNT (BOOT_INFO_ADDR + 0x10)
+#define BOOT_INFO_E820 (BOOT_INFO_ADDR + 0x18)
+#define E820_USABLE 1
+
+typedef struct {
+    long base;
+    long length;
+    int type;
+    int acpi;
+} E820Entry;
+
+// Boot timing : TSC at the end of each phase
+#define BOOT_INFO_TSC (BOOT_INFO_ADDR + 0xc18)
+#define BOOT_TSC_ATA 6
+#define BOOT_TSC_LOADED 7
+
+// Initrd base and size
+#define BOOT_INFO_INITRD (BOOT_INFO_ADDR + 0xc88)
+#define INITRD_ALIGN 0x200000 // Mapped with 2 MiB pages by the kernel
+// Identity mapped by second-stage.s (a whole PDPT)
+#define IDENTITY_MAP_TOP (512l << 30)
+
+void boot_tsc(int phase) {
+    unsigned int low, high;
+    asm volatile("rdtsc" : "=a" (low), "=d" (high));
+    ((long*)BOOT_INFO_TSC)[phase] = ((long)high << 32) | low;
+}
+
+/*
+ * ATA, primary bus, master drive (the boot disk under QEMU)
+ */
+#define ATA_DATA 0x1f0
+#define ATA_COUNT 0x1f2
+#define ATA_LBA_LOW 0x1f3
+#define ATA_LBA_MID 0x1f4
+#define ATA_LBA_HIGH 0x1f5
+#define ATA_DRIVE 0x1f6
+#define ATA_COMMAND 0x1f7 // Status when read
+#define ATA_ALT_STATUS 0x3f6
+
+#define ATA_STATUS_ERR (1 << 0)
+#define ATA_STATUS_DRQ (1 << 3)
+#define ATA_STATUS_DF (1 << 5)
+#define ATA_STATUS_BSY (1 << 7)
+
+#define ATA_DRIVE_MASTER 0xa0 // Bits 5 and 7 : obsolete, always set
+#define ATA_DRIVE_LBA 0x40
+
+#define ATA_READ_SECTORS 0x20
+#define ATA_READ_MULTIPLE_EXT 0x29
+#define ATA_READ_MULTIPLE 0xc4
+#define ATA_SET_MULTIPLE 0xc6
+#define ATA_IDENTIFY 0xec
+
+// IDENTIFY words
+#define ATA_ID_MAX_MULTIPLE 47 // Bits 7:0 : sectors per block, at most
+#define ATA_ID_COMMANDS 83 // Bit 10 : 48-bit LBA
+#define ATA_ID_LBA48 (1 << 10)
+
+// Sectors per command
+#define ATA_LBA28_MAX 256 // Count 0
+#define ATA_LBA48_MAX 65536 // Count 0
+
+int ata_block = 1; // Sectors per DRQ block
+int ata_lba48 = 0;
+
+void outb(short port, char value) {
+    asm volatile("outb %0, %1" : : "a" (value), "Nd" (port));
+}
+
+unsigned char inb(short port) {
+    unsigned char value;
+    asm volatile("inb %1, %0" : "=a" (value) : "Nd" (port));
+    return value;
+}
+
+void insw(short port, void* addr, long count) {
+    asm volatile("rep insw" : "+D" (addr), "+c" (count) : "d" (port) : "memory");
+}
+
+int ata_wait() {
+    /*
+     * Wait until the drive is done with the command (or the block) at hand.
+     * Returns 1 on a drive error.
+     */
+    // Status is valid 400 ns after the command : 4 reads of the alternate status
+    for (int i=0; i<4; i++)
+        inb(ATA_ALT_STATUS);
+    unsigned char status;
+    while ((status = inb(ATA_COMMAND)) & ATA_STATUS_BSY) {
+        asm volatile("pause");
+    }
+    return (status & (ATA_STATUS_ERR | ATA_STATUS_DF)) != 0;
+}
+
+int ata_wait_data() {
+    if (ata_wait() != 0)
+        return 1;
+    return (inb(ATA_COMMAND) & ATA_STATUS_DRQ) == 0;
+}
+
+void ata_init() {
+    /*
+     * Pick the largest READ MULTIPLE block the drive takes, and 48-bit
+     * commands when supported. Falls back to READ SECTORS (one sector per
+     * block) otherwise.
+     */
+    outb(ATA_DRIVE, ATA_DRIVE_MASTER);
+    outb(ATA_COUNT, 0);
+    outb(ATA_LBA_LOW, 0);
+    outb(ATA_LBA_MID, 0);
+    outb(ATA_LBA_HIGH, 0);
+    outb(ATA_COMMAND, ATA_IDENTIFY);
+    // 0 : no drive, 0xff : floating bus
+    unsigned char status = inb(ATA_COMMAND);
+    if (status == 0 || status == 0xff || ata_wait_data() != 0)
+        return;
+    unsigned short* id = (unsigned short*)SECTOR_BUFFER_ADDR;
+    insw(ATA_DATA, id, SECTOR_SIZE/2);
+
+    ata_lba48 = (id[ATA_ID_COMMANDS] & ATA_ID_LBA48) != 0;
+    int block = id[ATA_ID_MAX_MULTIPLE] & 0xff;
+    if (block <= 1)
+        return;
+    outb(ATA_DRIVE, ATA_DRIVE_MASTER);
+    outb(ATA_COUNT, block);
+    outb(ATA_COMMAND, ATA_SET_MULTIPLE);
+    if (ata_wait() == 0)
+        ata_block = block;
+}
+
+int load_sectors(long lba, long count, void* addr) {
+    /*
+     * Read [count] sectors (at most ATA_LBA48_MAX, or ATA_LBA28_MAX without
+     * 48-bit commands) from sector [lba] to [addr]. Returns 1 on a drive
+     * error.
+     */
+    outb(ATA_DRIVE, ATA_DRIVE_MASTER | ATA_DRIVE_LBA | (ata_lba48 ? 0 : (lba >> 24) & 0xf));
+    if (ata_lba48) {
+        // High bytes first
+        outb(ATA_COUNT, count >> 8);
+        outb(ATA_LBA_LOW, lba >> 24);
+        outb(ATA_LBA_MID, lba >> 32);
+        outb(ATA_LBA_HIGH, lba >> 40);
+    }
+    outb(ATA_COUNT, count);
+    outb(ATA_LBA_LOW, lba);
+    outb(ATA_LBA_MID, lba >> 8);
+    outb(ATA_LBA_HIGH, lba >> 16);
+    if (ata_block > 1)
+        outb(ATA_COMMAND, ata_lba48 ? ATA_READ_MULTIPLE_EXT : ATA_READ_MULTIPLE);
+    else
+        outb(ATA_COMMAND, ATA_READ_SECTORS);
+
+    // One handshake per block, the last one may be shorter
+    while (count > 0) {
+        long sectors = count < ata_block ? count : ata_block;
+        if (ata_wait_data() != 0)
+            return 1;
+        insw(ATA_DATA, addr, sectors * SECTOR_SIZE/2);
+        addr += sectors * SECTOR_SIZE;
+        count -= sectors;
+    }
+    return 0;
+}
+
+int load_range(long disk_sector, long offset, void* addr, long size) {
+    /*
+     * Copy [size] bytes at byte [offset] of the disk area starting at sector
+     * [disk_sector] to [addr]. Whole sectors go straight to [addr], partial
+     * ones through SECTOR_BUFFER_ADDR (nothing around [addr] is written).
+     * Returns 1 on a drive error.
+     */
+    void* buffer = (void*)SECTOR_BUFFER_ADDR;
+    long max = ata_lba48 ? ATA_LBA48_MAX : ATA_LBA28_MAX;
+
+    while (size > 0) {
+        long lba = disk_sector + offset / SECTOR_SIZE;
+        long skip = offset % SECTOR_SIZE;
+        long len;
+
+        if (skip != 0 || size < SECTOR_SIZE) {
+            if (load_sectors(lba, 1, buffer) != 0)
+                return 1;
+            len = SECTOR_SIZE - skip < size ? SECTOR_SIZE - skip : size;
+            memcpy(addr, buffer + skip, len);
+        } else {
+            long count = size / SECTOR_SIZE < max ? size / SECTOR_SIZE : max;
+            if (load_sectors(lba, count, addr) != 0)
+                return 1;
+            len = count * SECTOR_SIZE;
+        }
+        offset += len;
+        addr += len;
+        size -= len;
+    }
+    return 0;
+}
 
 typedef struct {
     unsigned char e_ident[16];
@@ -65,68 +309,183 @@ long entry_to_long(char* entry, int size) {
     return res;
 }
 
-void memcpy(void* dst_, void* src_, long sz) {
-    // 64 bit machine : can copy 8 by 8
-    long* src = (long*) src_;
-    long* dst = (long*) dst_;
-    long i;
-    for (i=0; i<sz>>3; i++) {
-        *(dst+i) = *(src+i);
-    }
-    i*=8;
-
-    // Remaining bytes : copy byte per byte
-    char* src2 = (char*) src;
-    char* dst2 = (char*) dst;
-    for (int j=0; j<sz%8; j++) {
-        *(dst2+i+j) = *(src2+i+j);
-    }
-}
-
-int load_segment(Elf64_Phdr* phdr) {
+int load_segment(Elf64_Phdr* phdr, int kernel_sector, long kernel_bytes) {
     /*
      * Loads an entire segment in memory at physical address phdr->p_p_addr
      */
-    void* offset = (void*) (KERNEL_FILE_ADDR + entry_to_long((char*)phdr->p_offset, 8));
+    long offset = entry_to_long((char*)phdr->p_offset, 8);
     void* paddr = (void*) entry_to_long((char*)phdr->p_paddr, 8);
     long memsz = entry_to_long((char*)phdr->p_memsz, 8);
     long filesz = entry_to_long((char*)phdr->p_filesz, 8);
 
     // Check that elf header is not malformed.
-    if (memsz < filesz) {
+    if (memsz < filesz || offset + filesz > kernel_bytes) {
         return 1;
     }
 
-    memcpy(paddr, offset, filesz);
+    if (load_range(kernel_sector, offset, paddr, filesz)) {
+        return 1;
+    }
+    // BSS
+    memset(paddr + filesz, 0, memsz - filesz);
     return 0;
 }
 
-void* load_kernel(int bootloader_size, int kernel_size) {
+void record_segment(BootInfo* boot_info, long start, long end) {
+    if (start < boot_info->kernel_start) {
+        boot_info->kernel_start = start;
+    }
+    if (end > boot_info->kernel_end) {
+        boot_info->kernel_end = end;
+    }
+}
+
+void* load_packed(int kernel_sector, long kernel_bytes, long headers_size, BootInfo* boot_info) {
+    /*
+     * Packed image : blocks are read right above the highest segment (free
+     * memory for the kernel), then decoded in place. Returns the entry point,
+     * or 0 on error.
+     */
+    PackHeader* header = (PackHeader*)ELF_HEADERS_ADDR;
+    PackSegment* segments = (PackSegment*)(header + 1);
+    if (sizeof(PackHeader) + header->segments * sizeof(PackSegment) > headers_size) {
+        return 0;
+    }
+
+    long staging = 0;
+    for (unsigned int i=0; i<header->segments; i++) {
+        if (segments[i].paddr + segments[i].memsz > staging) {
+            staging = segments[i].paddr + segments[i].memsz;
+        }
+    }
+    staging = (staging + 0xfff) & ~0xfffl;
+
+    for (unsigned int i=0; i<header->segments; i++) {
+        PackSegment* segment = &segments[i];
+        void* paddr = (void*)segment->paddr;
+        if (segment->memsz < segment->filesz || segment->offset + segment->size > kernel_bytes) {
+            return 0;
+        }
+        if (load_range(kernel_sector, segment->offset, (void*)staging, segment->size)) {
+            return 0;
+        }
+        if (lz4_decompress(paddr, segment->filesz, (void*)staging, segment->size) != segment->filesz) {
+            return 0;
+        }
+        // BSS
+        memset(paddr + segment->filesz, 0, segment->memsz - segment->filesz);
+        record_segment(boot_info, segment->paddr, segment->paddr + segment->memsz);
+    }
+
+    return (void*)header->entry;
+}
+
+int load_initrd(long disk_sector, long size, long kernel_end) {
+    /*
+     * Load the [size] bytes initrd from sector [disk_sector] at the top of
+     * the highest usable E820 range that holds it above the kernel,
+     * 2 MiB-aligned, and record it in the boot info. Without room for it,
+     * the kernel boots without an initrd. Returns 1 on a drive error.
+     */
+    long* initrd = (long*)BOOT_INFO_INITRD;
+    initrd[0] = 0;
+    initrd[1] = 0;
+    if (size == 0) {
+        return 0;
+    }
+
+    long count = *(long*)BOOT_INFO_E820_COUNT;
+    E820Entry* e820 = (E820Entry*)BOOT_INFO_E820;
+    long best = 0;
+    for (long i=0; i<count; i++) {
+        if (e820[i].type != E820_USABLE) {
+            continue;
+        }
+        long end = e820[i].base + e820[i].length;
+        if (end > IDENTITY_MAP_TOP) {
+            end = IDENTITY_MAP_TOP;
+        }
+        long base = (end - size) & ~(INITRD_ALIGN - 1l);
+        if (base >= e820[i].base && base >= kernel_end && base > best) {
+            best = base;
+        }
+    }
+    if (best == 0) {
+        return 0;
+    }
+
+    if (load_range(disk_sector, 0, (void*)best, size)) {
+        return 1;
+    }
+    initrd[0] = best;
+    initrd[1] = size;
+    return 0;
+}
+
+void* load_kernel(int bootloader_size, int kernel_size, long initrd_size) {
     /*
      * [bootloader_size] : size of bootloader, in sector counts (should be padded).
      * [kernel_size] : size of kernel, in sector counts.
+     * [initrd_size] : size of the initrd right after the kernel, in bytes
+     * (0 without one).
      * Loads kernel in memory :
-     * + loads binary file in memory
-     * + fetches elf header
+     * + fetches elf and program headers (or the packed image headers)
      * + loads loadable segments at specified physical addresses
+     * + loads the initrd
      * + returns entrypoint address
      * If an error occurs, returns 0.
      */
-    load_sectors(bootloader_size, kernel_size, (void*)KERNEL_FILE_ADDR);
-    Elf64_Ehdr* header = (Elf64_Ehdr*)KERNEL_FILE_ADDR;
+    string_init();
+    ata_init();
+    boot_tsc(BOOT_TSC_ATA);
+
+    long kernel_bytes = (long)kernel_size * SECTOR_SIZE;
+    long headers_size = ELF_HEADERS_SECTORS * SECTOR_SIZE;
+    if (headers_size > kernel_bytes) {
+        headers_size = kernel_bytes;
+    }
+    if (load_range(bootloader_size, 0, (void*)ELF_HEADERS_ADDR, headers_size)) {
+        return 0;
+    }
+    BootInfo* boot_info = (BootInfo*) BOOT_INFO_ADDR;
+    boot_info->kernel_start = 0x7fffffffffffffff;
+    boot_info->kernel_end = 0;
 
-    void* pht_addr = (void*)(KERNEL_FILE_ADDR + entry_to_long((char*)header->e_phoff, 8));
+    if (((PackHeader*)ELF_HEADERS_ADDR)->magic == PACK_MAGIC) {
+        void* entry = load_packed(bootloader_size, kernel_bytes, headers_size, boot_info);
+        // Once decoded : the initrd may land over the staging area
+        if (entry == 0 || load_initrd(bootloader_size + kernel_size, initrd_size, boot_info->kernel_end)) {
+            return 0;
+        }
+        boot_tsc(BOOT_TSC_LOADED);
+        return entry;
+    }
+    Elf64_Ehdr* header = (Elf64_Ehdr*)ELF_HEADERS_ADDR;
+
+    long pht_offset = entry_to_long((char*)header->e_phoff, 8);
     int ph_num = entry_to_long((char*)header->e_phnum, 2);
     int ph_entsize = entry_to_long((char*)header->e_phentsize, 2);
+    // Program headers right after the ELF header, as ld puts them
+    if (pht_offset + ph_num*ph_entsize > headers_size) {
+        return 0;
+    }
+    void* pht_addr = (void*)(ELF_HEADERS_ADDR + pht_offset);
 
     for (void* ph=pht_addr; ph<pht_addr + ph_num*ph_entsize; ph+=ph_entsize) {
         Elf64_Phdr* phdr = ph;
         if(phdr->p_type[0] == PT_LOAD) {
-            if (load_segment(phdr)) {
+            if (load_segment(phdr, bootloader_size, kernel_bytes)) {
                 return 0;
             }
+
+            long start = entry_to_long((char*)phdr->p_paddr, 8);
+            record_segment(boot_info, start, start + entry_to_long((char*)phdr->p_memsz, 8));
         }
     }
+    if (load_initrd(bootloader_size + kernel_size, initrd_size, boot_info->kernel_end)) {
+        return 0;
+    }
+    boot_tsc(BOOT_TSC_LOADED);
 
     return (void*) entry_to_long((char*)header->e_entry, 8);
 }
@@ -10,6 +10,11 @@ org 0x7c00
 ; Defined at compile time :
 ; %define BOOTLOADER_SIZE ???
 
+; Boot timing : TSC slots of the boot info (has to be consistent with
+; yak/includes/boot.h)
+%define BOOT_INFO_TSC 0x1c18
+%define BOOT_TSC_MBR 0
+
 section .mbr
     ; First initialize segment registers
     jmp 0x00:0x7c05 ; Set cs = 0
@@ -19,6 +24,12 @@ section .mbr
     mov ss, ax
     mov es, ax
 
+    mov bx, dx ; Drive number
+    rdtsc
+    mov [BOOT_INFO_TSC+BOOT_TSC_MBR*8], eax
+    mov [BOOT_INFO_TSC+BOOT_TSC_MBR*8+4], edx
+    mov dx, bx
+
     mov ah, 2 ; CHS reading
     mov al, BOOTLOADER_SIZE ; Amount of sectors to read
     mov ch, 0 ; First cylinder
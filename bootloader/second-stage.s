@@ -1,5 +1,6 @@
 ; Dual-stage bootlader that simply :
-; 0) Checks if A20 is enabled. If not, hangs forever
+; 0) Checks if A20 is enabled. If not, hangs forever. Collects the BIOS
+;    memory map (E820) for the kernel
 ; 1) Loads a naive GDT with 2 segment descriptors for code and [data,
 ; stack, extra] in ring 0. Overlapping segments : they both have:
 ;   + Base = 0
@@ -10,7 +11,7 @@
 ; 3) Sets up a 1 MB stack at first MB after BIOS memory (0x200000 growing to 0x100000)
 ; 4) Loads a level-4 paging system in memory
 ; 5) Switches to long mode
-; 6) Loads kernel (stub kernel for now)
+; 6) Loads kernel (loader.c)
 
 ; Doc :
 ; + https://wiki.osdev.org/X86-64
@@ -28,13 +29,43 @@
 ; %define LOADER_SIZE ???
 ; %define BOOTLOADER_SIZE ???
 ; %define KERNEL_SIZE ???
+; %define INITRD_SIZE ??? (0 without an initrd)
 
 ; Has to be consistent
 %define PDPT_ADDR 0x200000
 %define STACK_ADDR 0x200000
 
+; Boot info handed to the kernel (has to be consistent with loader.c and
+; yak/includes/boot.h) :
+; +0x00 kernel physical start (filled by loader.c)
+; +0x08 kernel physical end (filled by loader.c)
+; +0x10 E820 entry count
+; +0x18 E820 entries (24 bytes each)
+; +0xc18 boot timestamps
+; +0xc88 initrd base and size (filled by loader.c)
+%define BOOT_INFO_ADDR 0x1000
+%define BOOT_INFO_E820_COUNT BOOT_INFO_ADDR+0x10
+%define BOOT_INFO_E820 BOOT_INFO_ADDR+0x18
+%define E820_ENTRY_SIZE 24
+%define E820_MAX 128
+%define SMAP 0x534d4150
+
+; Boot timing : TSC at the end of each phase (indices of yak/includes/boot.h)
+%define BOOT_INFO_TSC BOOT_INFO_ADDR+0xc18
+%define BOOT_TSC_STAGE2 1
+%define BOOT_TSC_A20 2
+%define BOOT_TSC_E820 3
+%define BOOT_TSC_PROTECTED 4
+%define BOOT_TSC_LONG 5
+
+; Clobbers eax and edx
+%macro boot_tsc 1
+    rdtsc
+    mov [BOOT_INFO_TSC+%1*8], eax
+    mov [BOOT_INFO_TSC+%1*8+4], edx
+%endmacro
+
 extern load_kernel
-global load_sectors
 global _start
 
 [BITS 16]
@@ -157,6 +188,58 @@ section .boot
             ret
 
 
+    ; Fill the boot info with the BIOS memory map (INT 0x15, EAX=0xe820).
+    ; Empty entries are skipped.
+    detect_memory:
+        push bp
+        mov bp, sp
+        push di
+        push si
+        push es
+
+        xor ax, ax
+        mov es, ax
+        mov di, BOOT_INFO_E820
+        xor si, si ; Entries so far
+        xor ebx, ebx ; Continuation value, 0 for the first call
+
+        detect_memory_loop:
+            mov eax, 0xe820
+            mov edx, SMAP
+            mov ecx, E820_ENTRY_SIZE
+            ; ACPI 3 attributes : valid, in case the BIOS returns 20 bytes
+            mov dword [es:di+20], 1
+            int 0x15
+            jc detect_memory_end
+            cmp eax, SMAP
+            jne detect_memory_end
+
+            ; Skip entries of null length
+            mov eax, [es:di+8]
+            or eax, [es:di+12]
+            jz detect_memory_next
+
+            inc si
+            add di, E820_ENTRY_SIZE
+            cmp si, E820_MAX
+            jae detect_memory_end
+
+            detect_memory_next:
+                test ebx, ebx ; Last entry ?
+                jnz detect_memory_loop
+
+        detect_memory_end:
+            movzx esi, si
+            mov [BOOT_INFO_E820_COUNT], esi
+            mov dword [BOOT_INFO_E820_COUNT+4], 0
+
+            pop es
+            pop si
+            pop di
+            pop bp
+            ret
+
+
     ; Setup a GDT for code and data
     setup_gdt:
         lgdt [gdtr]
@@ -208,17 +291,38 @@ section .boot
         ; +-----------------------------------+
         ;    63  52  12   6
 
-        ; Identity-paging first 1 GiB (should be enough for now)
+        ; Identity-paging first 512 GiB (a whole PDPT) so that any RAM
+        ; reported by E820 is reachable until the kernel sets up its own
+        ; paging structure
         ; PDPT
         mov edi, PDPT_ADDR
+        xor ecx, ecx
+        setup_page_tables_pdpt:
+            ; Gigapage, not user-accessible, writeable, present
+            mov eax, ecx
+            shl eax, 30
+            or eax, 0b10000011
+            mov ebx, ecx
+            shr ebx, 2
+            mov [edi+ecx*8], eax
+            mov [edi+ecx*8+4], ebx
+            inc ecx
+            cmp ecx, 512
+            jb setup_page_tables_pdpt
+
+        ; PML4 4 KiB further, then the PDPT of the kernel image : both
+        ; start empty
+        push edi
+        add edi, 0x1000
         xor eax, eax
+        mov ecx, 2*0x1000/4
+        cld
+        rep stosd
+        pop edi
+
         xor ebx, ebx
-        ; Gigapage, not user-accessible, writeeable, present
-        mov al, 0b10000111
-        mov [edi], eax
-        mov [edi+4], ebx
 
-        ; PML4 4 KiB further
+        ; PML4
         xor eax, eax
         mov al, 0b00000011
         or eax, edi
@@ -226,6 +330,19 @@ section .boot
         mov [edi], eax
         mov [edi+4], ebx
 
+        ; Same PDPT at entry 256 (0xffff800000000000) : alias of the identity
+        ; mapping where the kernel expects its direct map of physical memory
+        mov [edi+256*8], eax
+        mov [edi+256*8+4], ebx
+
+        ; Kernel image PDPT at entry 511 : its entry 510 (0xffffffff80000000,
+        ; where the kernel is linked) maps the first GiB of physical memory
+        lea eax, [edi+0x1000]
+        or eax, 0b00000011
+        mov [edi+511*8], eax
+        mov [edi+511*8+4], ebx
+        mov dword [edi+0x1000+510*8], 0b10000011
+
         ; Set PML4 address in CR3
         mov eax, edi
         mov cr3, eax
@@ -233,73 +350,11 @@ section .boot
         ret
 
 
-    [BITS 64]
-    ; Uses ATA PIO mode
-    ; Load [rsi] sectors on disk at sector offset [rdi] on disk (1 sector = 512 MiB)
-    ; at address [rdx]
-    ; load_sectors(int offset_disk, int count, void* addr)
-    load_sectors:
-        push rbp
-        mov rbp, rsp
-        push rdx ; Save address
-
-        ; Write number of sectors to read to port 0x1f2 (sector count register)
-        mov eax, esi
-        mov dx, 0x1f2
-        out dx, eax
-
-        ; LBA addressing
-        inc dx
-        mov rax, rdi
-        out dx, al
-        inc dx
-        shr rax, 8
-        out dx, al
-        inc dx
-        shr rax, 8
-        out dx, al
-
-        ; Choose master drive (0x1f6)
-        inc dx
-        mov ax, 0x40
-        out dx, ax
-
-        ; READ SECTORS command (0x1f7)
-        inc dx
-        mov ax, 0x20
-        out dx, ax
-
-        pop rax
-        mov edi, eax ; Load address
-        xor ebx, ebx ; Written sectors so far
-
-        ; Read all sectors
-        load_sectors_loop:
-            or dl, 0x7
-            ; Wait for busy flag to be cleared
-            load_sectors_wait:
-                in al, dx
-                test al, 0x80
-                jnz load_sectors_wait
-
-            and dl, 0xf0 ; Read from data port
-            ; Load one sector (256 words)
-            mov rcx, 0x100
-            rep insw
-
-            inc ebx
-
-            cmp ebx, esi
-            jb load_sectors_loop
-
-        pop rbp
-        ret
-
-
     [BITS 16]
     ; Main procedure
     _start:
         push dx ; Save drive number
+        boot_tsc BOOT_TSC_STAGE2
 
         push str_welcome
         call print_wait_bios
@@ -307,6 +362,10 @@ section .boot
         call test_a20
         test ax, ax
         jnz loop_main
+        boot_tsc BOOT_TSC_A20
+
+        call detect_memory
+        boot_tsc BOOT_TSC_E820
 
         push str_setting_up_gdt
         call print_wait_bios
@@ -332,6 +391,7 @@ section .boot
             mov eax, 0x10
             mov ds, ax
             mov ss, ax
+            boot_tsc BOOT_TSC_PROTECTED
 
         pop dx ; Keep drive number (might need it later)
         call setup_stack
@@ -369,17 +429,20 @@ section .boot
 
         [BITS 64]
         main_64:
+        boot_tsc BOOT_TSC_LONG
         mov rdi, BOOTLOADER_SIZE
         mov rsi, KERNEL_SIZE
         shr rsi, 9
         inc rsi
+        mov rdx, INITRD_SIZE
         call load_kernel
 
         ; On failure, loops indifinetely
         test rax, rax
         jz loop_main
 
-        ; Jump to kernel entrypoint
+        ; Jump to kernel entrypoint, boot info as first argument
+        mov rdi, BOOT_INFO_ADDR
         jmp rax
 
         loop_main:
@@ -0,0 +1,52 @@
+/*
+ * Hosted build : yak/src/vm.c, kalloc.c and utils.c (with boot.c,
+ * spinlock.c and cow.c) compiled as ordinary Linux user code, to measure
+ * and test them without booting (`make hosted-bench`, `make hosted-test`).
+ *
+ * Physical memory is simulated by an anonymous mapping at PHYS_MAP_BASE,
+ * moved to the user half (see HOSTED_CFLAGS in the Makefile) : physical
+ * address pa lives at P2V(pa), as in the kernel's direct map. Page tables
+ * built by vm.c are thus real x86 tables, they are just never loaded.
+ * The privileged instructions of vm.c (CR3, CR4, INVLPG, INVPCID, EFER) are
+ * replaced by the stubs of shim.c, which only count their calls.
+ *
+ * Physical memory map of the arena :
+ * +---------------------------+ <-- HOSTED_MEMORY
+ * |                           |
+ * |  Frames handed out by     |
+ * |  kalloc                   |
+ * |                           |
+ * +---------------------------+
+ * |  kalloc bitmaps           |
+ * +---------------------------+ <-- HOSTED_KERNEL_END
+ * |  "Kernel image" (unused)  |
+ * +---------------------------+ <-- 0
+ */
+
+#define HOSTED_MEMORY (1l << 30)
+#define HOSTED_KERNEL_END 0x200000
+
+/*
+ * Calls to the privileged instruction stubs
+ */
+typedef struct HostedStats {
+    long cr3_loads;
+    long invlpgs;
+    long invpcids;
+} HostedStats;
+
+extern HostedStats hosted_stats;
+/*
+ * Frames taken from kalloc_zeroed and not given back (page tables). The
+ * hosted binaries are linked with --wrap=kalloc_zeroed,--wrap=kfree_zeroed.
+ */
+extern long hosted_tables;
+
+/*
+ * Map the arena and give it to kinit. Returns 1 if it cannot be mapped.
+ */
+int hosted_init();
+/*
+ * CLOCK_MONOTONIC, in nanoseconds
+ */
+long hosted_ns();
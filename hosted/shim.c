@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "boot.h"
+#include "cpu.h"
+#include "demand.h"
+#include "kalloc.h"
+#include "kvm.h"
+#include "vm.h"
+#include "hosted.h"
+
+/*
+ * What the kernel files expect from the rest of the kernel
+ */
+int cpu_features = CPU_PDPE1GB | CPU_NX | CPU_INVPCID;
+long tsc_hz;
+
+int cpu_id() {
+    return 0;
+}
+
+void uart_init() {
+}
+
+void uart_write(void* buffer, long size) {
+    fwrite(buffer, 1, size, stdout);
+}
+
+// cow.c : no demand-zero regions, no page faults
+FaultStats fault_stats[MAX_CPUS];
+
+long get_cr2() {
+    return 0;
+}
+
+int demand_clone(void* pml4, void* clone) {
+    return 0;
+}
+
+void demand_destroy(void* pml4) {
+}
+
+/*
+ * Privileged instructions (see vm.c). CR3 is remembered so that
+ * tlb_batch_flush can tell whether the page table it changed is loaded.
+ */
+HostedStats hosted_stats;
+long hosted_cr3;
+
+void set_cr3(void* addr) {
+    hosted_cr3 = (long)addr;
+    hosted_stats.cr3_loads++;
+}
+
+long get_cr3() {
+    return hosted_cr3;
+}
+
+void set_cr4_bits(long bits) {
+}
+
+void invlpg(void* va) {
+    hosted_stats.invlpgs++;
+}
+
+void invpcid(long type, long pcid, void* va) {
+    hosted_stats.invpcids++;
+}
+
+void enable_efer_nxe() {
+}
+
+/*
+ * Page table accounting (see hosted.h)
+ */
+long hosted_tables;
+
+void* __real_kalloc_zeroed();
+int __real_kfree_zeroed(void* addr);
+
+void* __wrap_kalloc_zeroed() {
+    void* table = __real_kalloc_zeroed();
+    if (table != 0)
+        hosted_tables++;
+    return table;
+}
+
+int __wrap_kfree_zeroed(void* addr) {
+    int ret = __real_kfree_zeroed(addr);
+    if (ret == 0)
+        hosted_tables--;
+    return ret;
+}
+
+int hosted_init() {
+    /*
+     * Reserve the arena without committing it : frames only cost host
+     * memory once written
+     */
+    void* arena = mmap(P2V(0), HOSTED_MEMORY, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if (arena != P2V(0)) {
+        perror("hosted_init : cannot map the arena at PHYS_MAP_BASE");
+        return 1;
+    }
+
+    // What the bootloader would have found
+    boot_info.kernel_start = 0;
+    boot_info.kernel_end = HOSTED_KERNEL_END;
+    boot_info.e820_count = 1;
+    boot_info.e820[0].base = 0;
+    boot_info.e820[0].length = HOSTED_MEMORY;
+    boot_info.e820[0].type = E820_USABLE;
+    kinit(&boot_info);
+    return 0;
+}
+
+long hosted_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000l + ts.tv_nsec;
+}
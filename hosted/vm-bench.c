@@ -0,0 +1,143 @@
+/*
+ * Hosted benchmarks of the memory management code (see hosted.h).
+ * Usage : vm-bench
+ * + vmmap / vmunmap : mappings per second by size and alignment, and the
+ *   page tables each mapping costs
+ * + kalloc / kfree and friends : allocation and free pairs per second
+ */
+
+#include <stdio.h>
+#include "kalloc.h"
+#include "kvm.h"
+#include "vm.h"
+#include "hosted.h"
+
+// Mappings per round, each in its own 2 GiB slot (no table is shared)
+#define MAP_BATCH 64
+#define MAP_SLOT (2l << 30)
+#define MAP_BASE (1l << 40)
+#define MIN_NS 200000000l // Each case runs at least this long
+
+#define ALLOC_BATCH 4096
+
+void* pml4;
+void* batch[ALLOC_BATCH];
+
+void bench_map(long size, long offset) {
+    /*
+     * Rounds of MAP_BATCH mappings of [size] bytes, [offset] bytes past a
+     * 1 GiB boundary (physical addresses alike, so that large leaves fit
+     * when the alignment allows it), then MAP_BATCH unmappings
+     */
+    long map_ns = 0, unmap_ns = 0, rounds = 0;
+    long tables = 0;
+
+    while (map_ns + unmap_ns < MIN_NS || rounds < 3) {
+        long before = hosted_tables;
+        long start = hosted_ns();
+        for (long i=0; i<MAP_BATCH; i++) {
+            long va = MAP_BASE + i * MAP_SLOT + offset;
+            if (vmmap(pml4, (void*)va, (void*)(i * MAP_SLOT + offset), size,
+                      PTE_READWRITE, PTE_SUPERVISOR, PTE_XD) != 0) {
+                fprintf(stderr, "vmmap failed (size %ld, offset %ld)\n", size, offset);
+                return;
+            }
+        }
+        long mapped = hosted_ns();
+        // PDPTs are never freed (see update_level) : only count the last round
+        tables = hosted_tables - before;
+        for (long i=0; i<MAP_BATCH; i++)
+            vmunmap(pml4, (void*)(MAP_BASE + i * MAP_SLOT + offset), size);
+        long end = hosted_ns();
+
+        map_ns += mapped - start;
+        unmap_ns += end - mapped;
+        rounds++;
+    }
+
+    long maps = rounds * MAP_BATCH;
+    printf("%10ld KiB %10ld KiB %14.0f %14.0f %10.2f\n",
+           size >> 10, offset >> 10,
+           maps * 1e9 / map_ns, maps * 1e9 / unmap_ns,
+           (double)tables / MAP_BATCH);
+}
+
+void report_alloc(const char* name, long pairs, long ns) {
+    printf("%-28s %14.0f %10.1f\n", name, pairs * 1e9 / ns, (double)ns / pairs);
+}
+
+void bench_kalloc() {
+    // Hot path : the frame goes back to the per-CPU magazine
+    long pairs = 0;
+    long start = hosted_ns();
+    while (hosted_ns() - start < MIN_NS) {
+        for (int i=0; i<ALLOC_BATCH; i++)
+            kfree(kalloc());
+        pairs += ALLOC_BATCH;
+    }
+    report_alloc("kalloc / kfree", pairs, hosted_ns() - start);
+
+    // Batches : magazines go through the depot and the buddy allocator
+    pairs = 0;
+    start = hosted_ns();
+    while (hosted_ns() - start < MIN_NS) {
+        for (int i=0; i<ALLOC_BATCH; i++)
+            batch[i] = kalloc();
+        for (int i=0; i<ALLOC_BATCH; i++)
+            kfree(batch[i]);
+        pairs += ALLOC_BATCH;
+    }
+    report_alloc("kalloc x4096 / kfree x4096", pairs, hosted_ns() - start);
+
+    pairs = 0;
+    start = hosted_ns();
+    while (hosted_ns() - start < MIN_NS) {
+        for (int i=0; i<ALLOC_BATCH; i++)
+            kfree_zeroed(kalloc_zeroed());
+        pairs += ALLOC_BATCH;
+    }
+    report_alloc("kalloc_zeroed / kfree_zeroed", pairs, hosted_ns() - start);
+
+    int orders[] = { 0, 4, MEGAPAGE_ORDER };
+    for (int o=0; o<3; o++) {
+        char name[32];
+        snprintf(name, sizeof(name), "kalloc_pages(%d) x256", orders[o]);
+        pairs = 0;
+        start = hosted_ns();
+        while (hosted_ns() - start < MIN_NS) {
+            for (int i=0; i<256; i++)
+                batch[i] = kalloc_pages(orders[o]);
+            for (int i=0; i<256; i++)
+                kfree_pages(batch[i], orders[o]);
+            pairs += 256;
+        }
+        report_alloc(name, pairs, hosted_ns() - start);
+    }
+}
+
+int main() {
+    if (hosted_init() != 0)
+        return 1;
+    pml4 = kalloc_zeroed();
+    // As if the page table was loaded : flushes go through invlpg
+    set_cr3((void*)V2P(pml4));
+
+    long sizes[] = { 4l << 10, 64l << 10, 2l << 20, 64l << 20, 1l << 30 };
+    long offsets[] = { 0, 4l << 10, 2l << 20 };
+
+    printf("%14s %14s %14s %14s %10s\n", "size", "offset", "maps/s", "unmaps/s", "tables");
+    for (int s=0; s<5; s++) {
+        for (int o=0; o<3; o++) {
+            // Skip offsets that map the same leaves as offset 0
+            if (offsets[o] >= sizes[s] || (offsets[o] > PAGE_SIZE && sizes[s] < GIGAPAGE_SIZE))
+                continue;
+            bench_map(sizes[s], offsets[o]);
+        }
+    }
+    printf("%ld invlpg, %ld CR3 loads, %ld invpcid\n\n",
+           hosted_stats.invlpgs, hosted_stats.cr3_loads, hosted_stats.invpcids);
+
+    printf("%-28s %14s %10s\n", "allocator", "pairs/s", "ns/pair");
+    bench_kalloc();
+    return 0;
+}
@@ -0,0 +1,365 @@
+/*
+ * Randomized differential test of vm.c (see hosted.h).
+ * Usage : vm-test [seed] [operations]
+ * Random vmmap / vmunmap / vmprotect calls over an 8 GiB window are applied
+ * both to a page table and to a model holding the expected leaf of every
+ * 4 KiB page. Ranges come in three classes (small, 2 MiB-aligned and
+ * 1 GiB-aligned), so that large leaves get created, split and merged around.
+ * After each call, the pages it touched are translated by a reference walk
+ * (written against the architecture, not against vm.c) and compared with the
+ * model. Every CHECK_INTERVAL calls, the whole window is compared, and the
+ * page tables reachable from the PML4 are counted against the ones vm.c
+ * allocated (leaks, or empty tables left behind).
+ * Then, pages shared with a clone (cow.c) are protected and unmapped in one
+ * address space and read back through the other, and address spaces with
+ * 1 GiB leaves must fail to clone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "cow.h"
+#include "kalloc.h"
+#include "kvm.h"
+#include "vm.h"
+#include "hosted.h"
+
+// Across the boundary between PML4 entries 0 and 1
+#define WINDOW_BASE (508l << 30)
+#define WINDOW_SIZE (8l << 30)
+#define WINDOW_PAGES (WINDOW_SIZE / PAGE_SIZE)
+#define MAX_PA (1l << 40)
+
+#define CLONE_PAGES 100 // More than a TlbBatch holds
+
+#define CHECK_INTERVAL 1000
+#define DEFAULT_OPERATIONS 10000
+
+/*
+ * Expected translation of each page of the window : physical address | P |
+ * RW | US | XD, 0 if not mapped
+ */
+long model[WINDOW_PAGES];
+
+void* pml4;
+unsigned long rng_state;
+long operations;
+
+unsigned long rng() {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ul;
+}
+
+long translate(long va) {
+    /*
+     * Reference walk : the model entry of the page at [va], or -1 if the
+     * tables are malformed. RW and US have to be allowed at every level, XD
+     * at any level forbids execution.
+     */
+    long* table = pml4;
+    long allowed = ENTRY_RW | ENTRY_US;
+    long xd = 0;
+
+    for (int level=3; level>=0; level--) {
+        int shift = PTE_SHIFT + 9 * level;
+        long entry = table[(va >> shift) & (ENTRIES_PER_TABLE - 1)];
+        if ((entry & ENTRY_P) == 0)
+            return 0;
+        allowed &= entry;
+        xd |= entry & ENTRY_XD;
+
+        if (level == 0 || (entry & ENTRY_PS)) {
+            long span = 1l << shift;
+            long base = entry & ENTRY_ADDR_MASK;
+            if (level == 3)
+                return -1; // PS is reserved in a PML4E
+            if (level > 0) {
+                // Below the leaf size, only the PAT bit may be set
+                if (base & (span - 1) & ~ENTRY_PAT_LARGE)
+                    return -1;
+                base &= ~(span - 1);
+            }
+            return (base + (va & (span - 1) & ~(PAGE_SIZE - 1))) | ENTRY_P | allowed | xd;
+        }
+
+        long next = entry & ENTRY_ADDR_MASK;
+        if (next >= HOSTED_MEMORY)
+            return -1;
+        table = P2V(next);
+    }
+    return -1;
+}
+
+int check_page(long page) {
+    long va = WINDOW_BASE + page * PAGE_SIZE;
+    long actual = translate(va);
+    if (actual == model[page])
+        return 0;
+    fprintf(stderr, "operation %ld : page %#lx translates to %#lx, expected %#lx\n",
+            operations, va, actual, model[page]);
+    return 1;
+}
+
+int check_range(long first, long count) {
+    // The pages of the range, and the ones right around it
+    for (long page=first-1; page<=first+count; page++) {
+        if (page >= 0 && page < WINDOW_PAGES && check_page(page) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+long count_tables(long* table, int level, long* empty) {
+    /*
+     * Tables reachable from [table] (included). Empty tables below the
+     * PDPTs are counted in [empty] : vm.c frees them.
+     */
+    long count = 1;
+    int used = 0;
+    for (int i=0; i<ENTRIES_PER_TABLE; i++) {
+        if (table[i] & ENTRY_P)
+            used = 1;
+        if ((table[i] & ENTRY_P) && level > 0 && (table[i] & ENTRY_PS) == 0)
+            count += count_tables(P2V(table[i] & ENTRY_ADDR_MASK), level - 1, empty);
+    }
+    if (!used && level < 2)
+        (*empty)++;
+    return count;
+}
+
+int check_all() {
+    for (long page=0; page<WINDOW_PAGES; page++) {
+        if (check_page(page) != 0)
+            return 1;
+    }
+    long empty = 0;
+    long reachable = count_tables(pml4, 3, &empty);
+    if (reachable != hosted_tables || empty != 0) {
+        fprintf(stderr, "operation %ld : %ld tables allocated, %ld reachable, %ld empty\n",
+                operations, hosted_tables, reachable, empty);
+        return 1;
+    }
+    return 0;
+}
+
+void random_range(long* first, long* count, long* align) {
+    /*
+     * Pages [first] -> [first] + [count] of the window, and the alignment
+     * (in pages) of the physical addresses that go with them
+     */
+    long r = rng() % 10;
+    if (r < 6) {
+        // Small : up to 64 pages, sometimes up to 1024
+        *count = 1 + rng() % (rng() % 4 ? 64 : 1024);
+        *first = rng() % (WINDOW_PAGES - *count + 1);
+        *align = 1;
+    } else if (r < 9) {
+        // Megapage-aligned, sometimes with a 4 KiB tail on either side
+        long per = MEGAPAGE_SIZE / PAGE_SIZE;
+        *count = (1 + rng() % 8) * per;
+        *first = (rng() % (WINDOW_PAGES / per - 10)) * per;
+        if (rng() % 4 == 0)
+            *count += rng() % per;
+        if (rng() % 4 == 0 && *first > 0) {
+            long head = rng() % per;
+            *first -= head;
+            *count += head;
+        }
+        *align = per;
+    } else {
+        long per = GIGAPAGE_SIZE / PAGE_SIZE;
+        *count = (1 + rng() % 2) * per;
+        *first = (rng() % (WINDOW_PAGES / per - 1)) * per;
+        *align = per;
+    }
+}
+
+int step() {
+    long first, count, align;
+    random_range(&first, &count, &align);
+    void* va = (void*)(WINDOW_BASE + first * PAGE_SIZE);
+    long size = count * PAGE_SIZE;
+    char rw = rng() % 2, us = rng() % 2;
+    long xd = rng() % 2;
+    long flags = ENTRY_P | ((long)rw << 1) | ((long)us << 2) | (xd << 63);
+
+    long r = rng() % 10;
+    if (r < 5) {
+        // Same offset as [va] from the physical alignment
+        long pa = (rng() % (MAX_PA / (align * PAGE_SIZE))) * align * PAGE_SIZE
+            + (first % align) * PAGE_SIZE;
+        int expected = 0;
+        for (long i=0; i<count; i++) {
+            if (model[first + i] != 0)
+                expected = -1;
+        }
+        int ret = vmmap(pml4, va, (void*)pa, size, rw, us, xd);
+        if (ret != expected) {
+            fprintf(stderr, "operation %ld : vmmap(%p, %#lx, %#lx) returned %d, expected %d\n",
+                    operations, va, pa, size, ret, expected);
+            return 1;
+        }
+        if (ret == 0) {
+            for (long i=0; i<count; i++)
+                model[first + i] = (pa + i * PAGE_SIZE) | flags;
+        }
+    } else if (r < 8) {
+        if (vmunmap(pml4, va, size) != 0) {
+            fprintf(stderr, "operation %ld : vmunmap(%p, %#lx) failed\n", operations, va, size);
+            return 1;
+        }
+        for (long i=0; i<count; i++)
+            model[first + i] = 0;
+    } else {
+        if (vmprotect(pml4, va, size, rw, us, xd) != 0) {
+            fprintf(stderr, "operation %ld : vmprotect(%p, %#lx) failed\n", operations, va, size);
+            return 1;
+        }
+        for (long i=0; i<count; i++) {
+            if (model[first + i] != 0)
+                model[first + i] = (model[first + i] & ENTRY_ADDR_MASK) | flags;
+        }
+    }
+    return check_range(first, count);
+}
+
+long clone_word(long page, long i) {
+    return (page << 32) | i;
+}
+
+int clone_test() {
+    /*
+     * Populate CLONE_PAGES pages and clone the address space. vmprotect
+     * keeps them shared in the parent (ENTRY_COW or ENTRY_SHARED), in
+     * either order. Then they are unmapped (vmunmap_free) in the parent : the
+     * clone still sees them unchanged, as their only owner. Everything is
+     * given back at the end.
+     */
+    long tables = hosted_tables;
+    void* parent = kalloc_zeroed();
+    for (long page=0; page<CLONE_PAGES; page++) {
+        long* frame = kalloc();
+        for (long i=0; i<PAGE_SIZE/8; i++)
+            frame[i] = clone_word(page, i);
+        void* va = (void*)(WINDOW_BASE + page * PAGE_SIZE);
+        if (vmmap(parent, va, (void*)V2P(frame), PAGE_SIZE, PTE_READWRITE, PTE_USER, 0) != 0) {
+            fprintf(stderr, "clone : vmmap(%p) failed\n", va);
+            return 1;
+        }
+    }
+
+    void* clone = address_space_clone(parent);
+    if (clone == 0) {
+        fprintf(stderr, "clone : address_space_clone failed\n");
+        return 1;
+    }
+
+    // Leaf flags expected after vmprotect, RW or not. Writeable first, then
+    // read-only, then the other way around.
+    long expected[2] = {ENTRY_SHARED, ENTRY_COW};
+    int order[4] = {1, 0, 0, 1};
+    for (int step=0; step<4; step++) {
+        int rw = order[step];
+        vmprotect(parent, (void*)WINDOW_BASE, CLONE_PAGES * PAGE_SIZE, rw, PTE_USER, 0);
+        for (long page=0; page<CLONE_PAGES; page++) {
+            void* va = (void*)(WINDOW_BASE + page * PAGE_SIZE);
+            long* entry = vmwalk(parent, va);
+            if (entry == 0 || (*entry & (ENTRY_RW | ENTRY_COW | ENTRY_SHARED)) != expected[rw]) {
+                fprintf(stderr, "clone : page %p is %#lx after vmprotect(rw=%d), step %d\n",
+                        va, entry ? *entry : 0, rw, step);
+                return 1;
+            }
+        }
+    }
+    vmunmap_free(parent, (void*)WINDOW_BASE, CLONE_PAGES * PAGE_SIZE);
+
+    for (long page=0; page<CLONE_PAGES; page++) {
+        void* va = (void*)(WINDOW_BASE + page * PAGE_SIZE);
+        long* entry = vmwalk(clone, va);
+        if (entry == 0) {
+            fprintf(stderr, "clone : page %p is not mapped in the clone\n", va);
+            return 1;
+        }
+        long* frame = P2V(*entry & ENTRY_ADDR_MASK);
+        if (kref_count(frame) != 1) {
+            fprintf(stderr, "clone : page %p has %ld owners, expected 1\n", va, kref_count(frame));
+            return 1;
+        }
+        for (long i=0; i<PAGE_SIZE/8; i++) {
+            if (frame[i] != clone_word(page, i)) {
+                fprintf(stderr, "clone : word %ld of page %p is %#lx, expected %#lx\n",
+                        i, va, frame[i], clone_word(page, i));
+                return 1;
+            }
+        }
+    }
+
+    address_space_destroy(clone);
+    address_space_destroy(parent);
+    if (hosted_tables != tables) {
+        fprintf(stderr, "clone : %ld tables left behind\n", hosted_tables - tables);
+        return 1;
+    }
+    return 0;
+}
+
+int clone_gigapage_test() {
+    // address_space_clone refuses 1 GiB user leaves (see cow.h)
+    long tables = hosted_tables;
+    void* parent = kalloc_zeroed();
+    if (vmmap(parent, (void*)WINDOW_BASE, (void*)GIGAPAGE_SIZE, GIGAPAGE_SIZE, PTE_READWRITE, PTE_USER, 0) != 0
+        || !(*vmwalk(parent, (void*)WINDOW_BASE) & ENTRY_PS)) {
+        fprintf(stderr, "clone : cannot map a 1 GiB leaf\n");
+        return 1;
+    }
+    if (address_space_clone(parent) != 0) {
+        fprintf(stderr, "clone : address space with a 1 GiB leaf cloned\n");
+        return 1;
+    }
+
+    // Not a kalloc'd block : unmapped without dropping a reference
+    vmunmap(parent, (void*)WINDOW_BASE, GIGAPAGE_SIZE);
+    address_space_destroy(parent);
+    if (hosted_tables != tables) {
+        fprintf(stderr, "clone : %ld tables left behind by a failed clone\n", hosted_tables - tables);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    unsigned long seed = argc > 1 ? strtoul(argv[1], NULL, 0) : 1;
+    long total = argc > 2 ? strtol(argv[2], NULL, 0) : DEFAULT_OPERATIONS;
+    rng_state = seed ? seed : 1;
+
+    if (hosted_init() != 0)
+        return 1;
+    pml4 = kalloc_zeroed();
+
+    for (operations=0; operations<total; operations++) {
+        if (step() != 0 || (operations % CHECK_INTERVAL == 0 && check_all() != 0)) {
+            fprintf(stderr, "vm-test : failed (seed %lu)\n", seed);
+            return 1;
+        }
+    }
+
+    // Everything goes : only the PML4 and the PDPTs are left
+    vmunmap(pml4, (void*)WINDOW_BASE, WINDOW_SIZE);
+    for (long page=0; page<WINDOW_PAGES; page++)
+        model[page] = 0;
+    if (check_all() != 0 || hosted_tables > 3) {
+        fprintf(stderr, "vm-test : failed after unmapping everything (seed %lu, %ld tables)\n",
+                seed, hosted_tables);
+        return 1;
+    }
+
+    if (clone_test() != 0 || clone_gigapage_test() != 0) {
+        fprintf(stderr, "vm-test : clone test failed\n");
+        return 1;
+    }
+
+    printf("vm-test : %ld operations, seed %lu : ok\n", total, seed);
+    return 0;
+}
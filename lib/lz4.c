@@ -0,0 +1,65 @@
+#include "lz4.h"
+#include "string_ops.h"
+
+#define LZ4_MIN_MATCH 4
+
+long lz4_length(unsigned char** src, unsigned char* end, long length) {
+    /*
+     * Nibble of 15 : the length goes on in the next bytes, up to the first
+     * one below 255. Returns -1 past [end].
+     */
+    if (length != 15)
+        return length;
+    unsigned char byte;
+    do {
+        if (*src >= end)
+            return -1;
+        byte = *(*src)++;
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+long lz4_decompress(void* dst, long dst_size, void* src, long src_size) {
+    unsigned char* in = src;
+    unsigned char* in_end = in + src_size;
+    unsigned char* out = dst;
+    unsigned char* out_end = out + dst_size;
+
+    while (in < in_end) {
+        unsigned char token = *in++;
+
+        long literals = lz4_length(&in, in_end, token >> 4);
+        if (literals < 0 || literals > in_end - in || literals > out_end - out)
+            return -1;
+        memcpy(out, in, literals);
+        in += literals;
+        out += literals;
+
+        // The last sequence only has literals
+        if (in == in_end)
+            break;
+
+        if (in_end - in < 2)
+            return -1;
+        long offset = in[0] | (in[1] << 8);
+        in += 2;
+        long length = lz4_length(&in, in_end, token & 0xf);
+        if (length < 0 || offset == 0 || offset > out - (unsigned char*)dst)
+            return -1;
+        length += LZ4_MIN_MATCH;
+        if (length > out_end - out)
+            return -1;
+
+        unsigned char* match = out - offset;
+        if (offset >= length) {
+            memcpy(out, match, length);
+            out += length;
+        } else {
+            // Overlapping : repeats the last [offset] bytes
+            for (long i=0; i<length; i++)
+                *out++ = *match++;
+        }
+    }
+    return out - (unsigned char*)dst;
+}
@@ -0,0 +1,12 @@
+/*
+ * LZ4 block decoder (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md),
+ * shared by the bootloader (compressed kernel image, see loader.c) and the
+ * kernel. Blocks are produced on the host by tools/kernel-pack.c.
+ */
+
+/*
+ * Decode the block [src] -> [src]+[src_size] to [dst], writing at most
+ * [dst_size] bytes. Returns the decoded size, or -1 if the block is
+ * malformed or does not fit.
+ */
+long lz4_decompress(void* dst, long dst_size, void* src, long src_size);
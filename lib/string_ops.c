@@ -0,0 +1,312 @@
+#include "string_ops.h"
+
+// Unaligned 64-bit word, which may alias anything
+typedef long __attribute__((may_alias, aligned(1))) unaligned_long;
+
+int string_features = 0;
+
+// Picked by string_init, for sizes that need a loop
+void (*memcpy_loop)(void*, void*, long) = memcpy_scalar;
+void (*memcpy_large)(void*, void*, long) = memcpy_scalar;
+void (*memset_loop)(void*, char, long) = memset_scalar;
+void (*memset_large)(void*, char, long) = memset_scalar;
+
+static void cpuid(unsigned int leaf, unsigned int* a, unsigned int* b, unsigned int* c, unsigned int* d) {
+    asm volatile("cpuid"
+                 : "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d)
+                 : "a" (leaf), "c" (0));
+}
+
+void string_init() {
+    unsigned int a, b, c, d;
+    unsigned int max_leaf;
+    int sse2, xsave, avx, avx2 = 0, erms = 0;
+
+    cpuid(0, &max_leaf, &b, &c, &d);
+    cpuid(1, &a, &b, &c, &d);
+    sse2 = (d >> 26) & 1;
+    xsave = (c >> 26) & 1;
+    avx = (c >> 28) & 1;
+    if (max_leaf >= 7) {
+        cpuid(7, &a, &b, &c, &d);
+        avx2 = (b >> 5) & 1;
+        erms = (b >> 9) & 1;
+    }
+
+    string_features = 0;
+
+    if (sse2) {
+        // CR0 : EM = 0, MP = 1. CR4 : OSFXSR, OSXMMEXCPT
+        asm volatile("mov %%cr0, %%rax\n\t"
+                     "and $~0x4, %%rax\n\t"
+                     "or $0x2, %%rax\n\t"
+                     "mov %%rax, %%cr0\n\t"
+                     "mov %%cr4, %%rax\n\t"
+                     "or $0x600, %%rax\n\t"
+                     "mov %%rax, %%cr4"
+                     ::: "rax");
+        string_features |= STRING_SSE2;
+        memcpy_loop = memcpy_sse2;
+        memset_loop = memset_sse2;
+    }
+
+    if (sse2 && xsave && avx && avx2) {
+        // CR4 : OSXSAVE, then XCR0 : x87, SSE and AVX states
+        asm volatile("mov %%cr4, %%rax\n\t"
+                     "or $0x40000, %%rax\n\t"
+                     "mov %%rax, %%cr4\n\t"
+                     "xor %%ecx, %%ecx\n\t"
+                     "xgetbv\n\t"
+                     "or $0x7, %%eax\n\t"
+                     "xsetbv"
+                     ::: "rax", "rcx", "rdx");
+        string_features |= STRING_AVX2;
+        memcpy_loop = memcpy_avx2;
+        memset_loop = memset_avx2;
+    }
+
+    memcpy_large = memcpy_loop;
+    memset_large = memset_loop;
+    if (erms) {
+        string_features |= STRING_ERMS;
+        memcpy_large = memcpy_erms;
+        memset_large = memset_erms;
+    }
+}
+
+void memcpy_scalar(void* dst, void* src, long sz) {
+    // 64 bit machine : can copy 8 by 8
+    long i;
+    for (i=0; i+8<=sz; i+=8) {
+        *(unaligned_long*)(dst+i) = *(unaligned_long*)(src+i);
+    }
+
+    // Remaining bytes : copy byte per byte
+    for (; i<sz; i++) {
+        *(char*)(dst+i) = *(char*)(src+i);
+    }
+}
+
+void memcpy_erms(void* dst, void* src, long sz) {
+    asm volatile("rep movsb"
+                 : "+D" (dst), "+S" (src), "+c" (sz)
+                 :
+                 : "memory");
+}
+
+void memcpy_sse2(void* dst, void* src, long sz) {
+    /*
+     * 32 bytes per iteration, then the last 16 bytes (which may overlap
+     * what was already copied)
+     */
+    long i;
+    for (i=0; i+32<=sz; i+=32) {
+        asm volatile("movdqu (%1), %%xmm0\n\t"
+                     "movdqu 16(%1), %%xmm1\n\t"
+                     "movdqu %%xmm0, (%0)\n\t"
+                     "movdqu %%xmm1, 16(%0)"
+                     :
+                     : "r" (dst+i), "r" (src+i)
+                     : "xmm0", "xmm1", "memory");
+    }
+    if (i+16 <= sz) {
+        asm volatile("movdqu (%1), %%xmm0\n\t"
+                     "movdqu %%xmm0, (%0)"
+                     :
+                     : "r" (dst+i), "r" (src+i)
+                     : "xmm0", "memory");
+    }
+    asm volatile("movdqu (%1), %%xmm0\n\t"
+                 "movdqu %%xmm0, (%0)"
+                 :
+                 : "r" (dst+sz-16), "r" (src+sz-16)
+                 : "xmm0", "memory");
+}
+
+void memcpy_avx2(void* dst, void* src, long sz) {
+    /*
+     * 64 bytes per iteration, then the last 32 bytes (which may overlap
+     * what was already copied)
+     */
+    if (sz < 32) {
+        memcpy_sse2(dst, src, sz);
+        return;
+    }
+
+    long i;
+    for (i=0; i+64<=sz; i+=64) {
+        asm volatile("vmovdqu (%1), %%ymm0\n\t"
+                     "vmovdqu 32(%1), %%ymm1\n\t"
+                     "vmovdqu %%ymm0, (%0)\n\t"
+                     "vmovdqu %%ymm1, 32(%0)"
+                     :
+                     : "r" (dst+i), "r" (src+i)
+                     : "xmm0", "xmm1", "memory");
+    }
+    if (i+32 <= sz) {
+        asm volatile("vmovdqu (%1), %%ymm0\n\t"
+                     "vmovdqu %%ymm0, (%0)"
+                     :
+                     : "r" (dst+i), "r" (src+i)
+                     : "xmm0", "memory");
+    }
+    asm volatile("vmovdqu (%1), %%ymm0\n\t"
+                 "vmovdqu %%ymm0, (%0)\n\t"
+                 "vzeroupper"
+                 :
+                 : "r" (dst+sz-32), "r" (src+sz-32)
+                 : "xmm0", "xmm1", "memory");
+}
+
+void memcpy(void* dst, void* src, long sz) {
+    if (sz < 16) {
+        memcpy_scalar(dst, src, sz);
+    } else if (sz < STRING_ERMS_THRESHOLD) {
+        memcpy_loop(dst, src, sz);
+    } else {
+        memcpy_large(dst, src, sz);
+    }
+}
+
+void memmove(void* dst, void* src, long sz) {
+    if (dst + sz <= src || src + sz <= dst) {
+        memcpy(dst, src, sz);
+        return;
+    }
+
+    /*
+     * Overlapping : copy in the direction that reads each byte before it is
+     * overwritten
+     */
+    long i;
+    if (dst < src) {
+        for (i=0; i+8<=sz; i+=8) {
+            *(unaligned_long*)(dst+i) = *(unaligned_long*)(src+i);
+        }
+        for (; i<sz; i++) {
+            *(char*)(dst+i) = *(char*)(src+i);
+        }
+    } else if (dst > src) {
+        for (i=sz; i>=8; i-=8) {
+            *(unaligned_long*)(dst+i-8) = *(unaligned_long*)(src+i-8);
+        }
+        for (; i>0; i--) {
+            *(char*)(dst+i-1) = *(char*)(src+i-1);
+        }
+    }
+}
+
+void memset_scalar(void* dst, char content, long sz) {
+    long pattern = (unsigned char)content * 0x0101010101010101l;
+    long i;
+    for (i=0; i+8<=sz; i+=8) {
+        *(unaligned_long*)(dst+i) = pattern;
+    }
+    for (; i<sz; i++) {
+        *(char*)(dst+i) = content;
+    }
+}
+
+void memset_erms(void* dst, char content, long sz) {
+    asm volatile("rep stosb"
+                 : "+D" (dst), "+c" (sz)
+                 : "a" (content)
+                 : "memory");
+}
+
+void memset_sse2(void* dst, char content, long sz) {
+    /*
+     * 16 bytes per iteration, then the last 16 bytes (which may overlap
+     * what was already set). A single asm block : the pattern must stay in
+     * xmm0 from the broadcast to the last store.
+     */
+    long pattern = (unsigned char)content * 0x0101010101010101l;
+    void* last = dst + sz - 16;
+    asm volatile("movq %2, %%xmm0\n\t"
+                 "punpcklqdq %%xmm0, %%xmm0\n"
+                 "1:\n\t"
+                 "cmp %1, %0\n\t"
+                 "ja 2f\n\t"
+                 "movdqu %%xmm0, (%0)\n\t"
+                 "add $16, %0\n\t"
+                 "jmp 1b\n"
+                 "2:\n\t"
+                 "movdqu %%xmm0, (%1)"
+                 : "+r" (dst)
+                 : "r" (last), "r" (pattern)
+                 : "xmm0", "cc", "memory");
+}
+
+void memset_avx2(void* dst, char content, long sz) {
+    // Same as memset_sse2, 32 bytes at a time
+    if (sz < 32) {
+        memset_sse2(dst, content, sz);
+        return;
+    }
+
+    long pattern = (unsigned char)content * 0x0101010101010101l;
+    void* last = dst + sz - 32;
+    asm volatile("vmovq %2, %%xmm0\n\t"
+                 "vpbroadcastq %%xmm0, %%ymm0\n"
+                 "1:\n\t"
+                 "cmp %1, %0\n\t"
+                 "ja 2f\n\t"
+                 "vmovdqu %%ymm0, (%0)\n\t"
+                 "add $32, %0\n\t"
+                 "jmp 1b\n"
+                 "2:\n\t"
+                 "vmovdqu %%ymm0, (%1)\n\t"
+                 "vzeroupper"
+                 : "+r" (dst)
+                 : "r" (last), "r" (pattern)
+                 : "xmm0", "cc", "memory");
+}
+
+void memset(void* dst, char content, long sz) {
+    if (sz < 16) {
+        memset_scalar(dst, content, sz);
+    } else if (sz < STRING_ERMS_THRESHOLD) {
+        memset_loop(dst, content, sz);
+    } else {
+        memset_large(dst, content, sz);
+    }
+}
+
+int memcmp(void* a, void* b, long sz) {
+    long i = 0;
+
+    // 16 bytes at a time : mask of equal bytes
+    if (string_features & STRING_SSE2) {
+        for (; i+16<=sz; i+=16) {
+            int equal;
+            asm volatile("movdqu (%1), %%xmm0\n\t"
+                         "movdqu (%2), %%xmm1\n\t"
+                         "pcmpeqb %%xmm1, %%xmm0\n\t"
+                         "pmovmskb %%xmm0, %0"
+                         : "=r" (equal)
+                         : "r" (a+i), "r" (b+i)
+                         : "xmm0", "xmm1");
+            if (equal != 0xffff) {
+                i += __builtin_ctz(~equal);
+                return *(unsigned char*)(a+i) - *(unsigned char*)(b+i);
+            }
+        }
+    }
+
+    for (; i+8<=sz; i+=8) {
+        long x = *(unaligned_long*)(a+i);
+        long y = *(unaligned_long*)(b+i);
+        if (x != y) {
+            // Little endian : the first differing byte is the lowest one
+            i += __builtin_ctzl(x ^ y) / 8;
+            return *(unsigned char*)(a+i) - *(unsigned char*)(b+i);
+        }
+    }
+    for (; i<sz; i++) {
+        int diff = *(unsigned char*)(a+i) - *(unsigned char*)(b+i);
+        if (diff != 0) {
+            return diff;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * Memory routines shared by the bootloader (loader.c) and the kernel.
+ *
+ * string_init probes CPUID once and picks the best implementation for the
+ * running CPU : ERMS (rep movsb / rep stosb) for large sizes, AVX2 or SSE2
+ * loops below that. It also enables SSE (and AVX through XSAVE / XCR0) in
+ * CR0 and CR4, so it must run in ring 0. Until it is called, only general
+ * purpose registers are used.
+ */
+
+#define STRING_ERMS (1 << 0)
+#define STRING_SSE2 (1 << 1)
+#define STRING_AVX2 (1 << 2)
+
+// Above this size, rep movsb / rep stosb win (when the CPU has ERMS)
+#define STRING_ERMS_THRESHOLD 2048
+
+// Features found by string_init
+extern int string_features;
+
+void string_init();
+
+void memcpy(void* dst, void* src, long sz);
+/*
+ * Same as memcpy, but [dst] and [src] may overlap
+ */
+void memmove(void* dst, void* src, long sz);
+void memset(void* dst, char content, long sz);
+/*
+ * Compare [sz] bytes : < 0, 0 or > 0 as the first differing byte (unsigned)
+ * of [a] is lower, equal or greater than the one of [b].
+ */
+int memcmp(void* a, void* b, long sz);
+
+/*
+ * Each implementation, regardless of what string_init picked (benchmarks).
+ * The SSE2 and AVX2 ones need [sz] >= 16 (resp. 32) and the CPU feature.
+ */
+void memcpy_scalar(void* dst, void* src, long sz);
+void memcpy_erms(void* dst, void* src, long sz);
+void memcpy_sse2(void* dst, void* src, long sz);
+void memcpy_avx2(void* dst, void* src, long sz);
+void memset_scalar(void* dst, char content, long sz);
+void memset_erms(void* dst, char content, long sz);
+void memset_sse2(void* dst, char content, long sz);
+void memset_avx2(void* dst, char content, long sz);
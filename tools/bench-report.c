@@ -0,0 +1,166 @@
+/*
+ * Host-side summary of the in-kernel benchmarks (see yak/includes/bench.h).
+ * Usage : bench-report [report.bin]   (standard input by default)
+ * Reads the BenchReport that `make bench` gets over COM1 and prints each
+ * benchmark as rates, converting TSC cycles with the TSC frequency the
+ * kernel measured. Exits with 1 if the disk check found errors.
+ */
+
+#include <stdio.h>
+#include "cpu.h"
+#include "bench.h"
+
+BenchReport report;
+
+int find_report(FILE* in) {
+    /*
+     * Skip to BENCH_REPORT_MAGIC (BIOS or QEMU output may come before).
+     * Returns 1 if there is none.
+     */
+    unsigned int window = 0;
+    int c;
+    while ((c = fgetc(in)) != EOF) {
+        window = (window >> 8) | ((unsigned int)c << 24);
+        if (window != BENCH_REPORT_MAGIC)
+            continue;
+        report.magic = window;
+        if (fread((char*)&report + sizeof(report.magic), sizeof(report) - sizeof(report.magic), 1, in) != 1)
+            return 1;
+        return 0;
+    }
+    return 1;
+}
+
+double per_second(long count, long cycles) {
+    return cycles > 0 ? (double)count * report.tsc_hz / cycles : 0;
+}
+
+void print_kalloc() {
+    printf("kalloc / kfree pairs\n");
+    printf("%6s %16s %16s\n", "cpus", "frames/s", "frames/s/cpu");
+    for (int i=0; i<report.ncpus; i++) {
+        BenchKallocResult* result = &report.kalloc[i];
+        double rate = per_second(result->frames, result->cycles);
+        printf("%6d %16.0f %16.0f\n", result->cpus, rate, rate / result->cpus);
+    }
+}
+
+const char* string_variants[BENCH_STRING_VARIANTS] = {"scalar", "erms", "sse2", "avx2"};
+
+void print_string_table(const char* name, int memset) {
+    // GB/s, "-" for variants the CPU does not support
+    printf("%s, GB/s\n", name);
+    printf("%10s", "size");
+    for (int v=0; v<BENCH_STRING_VARIANTS; v++)
+        printf(" %10s", string_variants[v]);
+    printf("\n");
+    for (int i=0; i<BENCH_STRING_SIZES; i++) {
+        BenchStringResult* result = &report.string[i];
+        printf("%10ld", result->size);
+        for (int v=0; v<BENCH_STRING_VARIANTS; v++) {
+            long cycles = memset ? result->memset_cycles[v] : result->memcpy_cycles[v];
+            if (cycles == 0)
+                printf(" %10s", "-");
+            else
+                printf(" %10.2f", per_second(result->bytes, cycles) / 1e9);
+        }
+        printf("\n");
+    }
+}
+
+double ns_per(long count, long cycles) {
+    return count > 0 ? (double)cycles * 1e9 / report.tsc_hz / count : 0;
+}
+
+void print_sched() {
+    // A round trip is two switches
+    BenchSwitchResult* result = &report.sched_switch;
+    printf("context switches, ns\n");
+    printf("%-24s %10.1f\n", "context_switch", ns_per(2 * result->rounds, result->switch_cycles));
+    printf("%-24s %10.1f\n", "thread_yield round trip", ns_per(result->rounds, result->yield_cycles));
+    printf("\n");
+
+    printf("spawn / join\n");
+    printf("%6s %16s %16s\n", "cpus", "threads/s", "threads/s/cpu");
+    for (int i=0; i<report.ncpus; i++) {
+        BenchSchedResult* tree = &report.sched[i];
+        double rate = per_second(tree->threads, tree->cycles);
+        printf("%6d %16.0f %16.0f\n", tree->cpus, rate, rate / tree->cpus);
+    }
+}
+
+void print_fault() {
+    // The second pass does not fault : the difference is the fault itself
+    BenchFaultResult* result = &report.fault;
+    printf("demand-zero faults, %ld pages, ns per page\n", result->pages);
+    printf("%-24s %10.1f\n", "first touch (fault)", ns_per(result->pages, result->first_touch_cycles));
+    printf("%-24s %10.1f\n", "second touch", ns_per(result->pages, result->second_touch_cycles));
+    printf("%-24s %10.1f\n", "fault", ns_per(result->pages, result->first_touch_cycles - result->second_touch_cycles));
+}
+
+void print_blk() {
+    BenchBlkCheck* check = &report.blk_check;
+    if (check->blocks == 0) {
+        printf("disk : not checked (no disk, or too small)\n");
+    } else {
+        printf("disk : %ld blocks checked through the buffer cache, %s (%ld errors)\n",
+               check->blocks, check->errors == 0 ? "ok" : "FAILED", check->errors);
+    }
+    if (report.blk[0].depth == 0)
+        return;
+
+    // "-" : refused (read-only disk, or the requests failed)
+    printf("\n");
+    printf("disk, %d requests per pattern\n", (int)report.blk[0].requests);
+    printf("%6s %16s %16s %16s\n", "depth", "4K read IOPS", "64K read MB/s", "4K write IOPS");
+    for (int i=0; i<BENCH_BLK_DEPTHS; i++) {
+        BenchBlkResult* result = &report.blk[i];
+        long cycles[3] = {result->random_read_cycles, result->sequential_read_cycles, result->random_write_cycles};
+        double rates[3] = {
+            per_second(result->requests, cycles[0]),
+            per_second(result->requests * BENCH_BLK_SEQUENTIAL_SIZE, cycles[1]) / 1e6,
+            per_second(result->requests, cycles[2])
+        };
+        printf("%6d", result->depth);
+        for (int j=0; j<3; j++) {
+            if (cycles[j] == 0)
+                printf(" %16s", "-");
+            else
+                printf(" %16.0f", rates[j]);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char** argv) {
+    FILE* in = stdin;
+    if (argc > 1 && (in = fopen(argv[1], "rb")) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    if (find_report(in) != 0) {
+        fprintf(stderr, "no benchmark report found\n");
+        return 1;
+    }
+    if (report.size != sizeof(BenchReport) || report.tsc_hz <= 0
+        || report.ncpus <= 0 || report.ncpus > MAX_CPUS) {
+        fprintf(stderr, "bad report (kernel and bench-report out of sync ?)\n");
+        return 1;
+    }
+
+    printf("%d cpus, TSC at %.3f GHz\n\n", report.ncpus, report.tsc_hz / 1e9);
+    print_kalloc();
+    printf("\n");
+    print_string_table("memcpy", 0);
+    printf("\n");
+    print_string_table("memset", 1);
+    printf("\n");
+    print_sched();
+    printf("\n");
+    print_fault();
+    printf("\n");
+    print_blk();
+    // Fails `make bench` if the disk check did
+    return report.blk_check.errors != 0;
+}
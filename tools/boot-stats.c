@@ -0,0 +1,85 @@
+/*
+ * Host-side summary of boot timings (see yak/includes/boot.h).
+ * Usage : boot-stats [reports.bin]   (standard input by default)
+ * Reads the BootReport of each run (`make bench-boot` concatenates the
+ * serial output of BOOT_RUNS boots) and prints, for each boot phase, the
+ * minimum, median and 99th percentile of its duration over all runs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "boot.h"
+
+#define MAX_RUNS 4096
+
+const char* phase_names[BOOT_TSC_COUNT] = {
+    "(mbr entry)", "mbr", "a20", "e820", "protected_mode", "long_mode",
+    "ata_init", "load_kernel", "jump_to_kernel", "early_init", "kinit",
+    "kvminit", "kmem_init", "smp_init"
+};
+
+double durations[BOOT_TSC_COUNT + 1][MAX_RUNS]; // Last row : total
+
+int find_report(FILE* in, BootReport* report) {
+    /*
+     * Skip to the next BOOT_REPORT_MAGIC (BIOS or QEMU output may come
+     * before). Returns 1 at the end of the stream.
+     */
+    unsigned int window = 0;
+    int c;
+    while ((c = fgetc(in)) != EOF) {
+        window = (window >> 8) | ((unsigned int)c << 24);
+        if (window != BOOT_REPORT_MAGIC)
+            continue;
+        report->magic = window;
+        if (fread((char*)report + sizeof(report->magic), sizeof(*report) - sizeof(report->magic), 1, in) != 1)
+            return 1;
+        return 0;
+    }
+    return 1;
+}
+
+int double_cmp(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+void print_row(const char* name, double* values, int runs) {
+    qsort(values, runs, sizeof(double), double_cmp);
+    // Nearest rank
+    int p99 = (99 * runs + 99) / 100 - 1;
+    printf("%-16s %12.1f %12.1f %12.1f\n", name, values[0], values[runs / 2], values[p99]);
+}
+
+int main(int argc, char** argv) {
+    FILE* in = stdin;
+    if (argc > 1 && (in = fopen(argv[1], "rb")) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    BootReport report;
+    int runs = 0;
+    while (runs < MAX_RUNS && find_report(in, &report) == 0) {
+        if (report.count != BOOT_TSC_COUNT || report.tsc_hz <= 0) {
+            fprintf(stderr, "run %d : bad report (kernel and boot-stats out of sync ?)\n", runs);
+            continue;
+        }
+        for (int i=1; i<BOOT_TSC_COUNT; i++)
+            durations[i][runs] = (double)(report.tsc[i] - report.tsc[i-1]) * 1e6 / report.tsc_hz;
+        durations[BOOT_TSC_COUNT][runs] = (double)(report.tsc[BOOT_TSC_COUNT-1] - report.tsc[0]) * 1e6 / report.tsc_hz;
+        runs++;
+    }
+    if (runs == 0) {
+        fprintf(stderr, "no boot report found\n");
+        return 1;
+    }
+
+    printf("%d runs, durations in us\n", runs);
+    printf("%-16s %12s %12s %12s\n", "phase", "min", "median", "p99");
+    for (int i=1; i<BOOT_TSC_COUNT; i++)
+        print_row(phase_names[i], durations[i], runs);
+    print_row("total", durations[BOOT_TSC_COUNT], runs);
+    return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * Host-side packer of the compressed kernel image (COMPRESS=1 builds).
+ * Usage : kernel-pack target/yak target/yak.lz4
+ * Keeps only the loadable segments of the kernel ELF, each one compressed
+ * as a single LZ4 block, behind a small header read by bootloader/loader.c :
+ * +----------------------+
+ * |      PackHeader      | Magic, segment count, entry point
+ * +----------------------+
+ * |    PackSegment[n]    | Physical address, sizes, block offset and size
+ * +----------------------+
+ * |      LZ4 blocks      |
+ * +----------------------+
+ * Every block is decoded again (lib/lz4.c) before the image is written.
+ */
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lz4.h"
+
+// Has to be consistent with bootloader/loader.c
+#define PACK_MAGIC 0x5a4b4159
+#define PACK_MAX_SEGMENTS 16
+
+typedef struct PackHeader {
+    unsigned int magic;
+    unsigned int segments;
+    long entry;
+} PackHeader;
+
+typedef struct PackSegment {
+    long paddr;
+    long filesz; // Decoded size
+    long memsz;
+    long offset; // LZ4 block, from the start of the image
+    long size;
+} PackSegment;
+
+#define HASH_BITS 16
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+// Block format rules : the last 5 bytes are literals, and the last match
+// starts at least 12 bytes before the end
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+
+long hash_table[1 << HASH_BITS]; // Last position of each hash
+
+unsigned int read32(unsigned char* p) {
+    unsigned int value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+unsigned int hash(unsigned int sequence) {
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+unsigned char* put_length(unsigned char* out, long length) {
+    // Continues a length nibble of 15
+    for (length -= 15; length >= 255; length -= 255)
+        *out++ = 255;
+    *out++ = length;
+    return out;
+}
+
+unsigned char* put_sequence(unsigned char* out, unsigned char* literals, long count, long offset, long length) {
+    /*
+     * [count] literals, then a match of [length] bytes [offset] bytes back
+     * (none if [length] is 0 : last sequence)
+     */
+    unsigned char* token = out++;
+    long match = length ? length - MIN_MATCH : 0;
+    *token = ((count < 15 ? count : 15) << 4) | (match < 15 ? match : 15);
+    if (count >= 15)
+        out = put_length(out, count);
+    memcpy(out, literals, count);
+    out += count;
+    if (length == 0)
+        return out;
+    *out++ = offset & 0xff;
+    *out++ = offset >> 8;
+    if (match >= 15)
+        out = put_length(out, match);
+    return out;
+}
+
+long lz4_compress(unsigned char* src, long size, unsigned char* dst) {
+    /*
+     * Greedy : the last position with the same 4-byte hash is the only
+     * candidate. [dst] holds at least size + size/255 + 16 bytes.
+     */
+    for (int i=0; i<(1 << HASH_BITS); i++)
+        hash_table[i] = -1;
+
+    unsigned char* out = dst;
+    long anchor = 0;
+    long pos = 0;
+    while (pos < size - MF_LIMIT) {
+        unsigned int sequence = read32(src + pos);
+        unsigned int h = hash(sequence);
+        long candidate = hash_table[h];
+        hash_table[h] = pos;
+        if (candidate < 0 || pos - candidate > MAX_OFFSET || read32(src + candidate) != sequence) {
+            pos++;
+            continue;
+        }
+
+        long length = MIN_MATCH;
+        while (pos + length < size - LAST_LITERALS && src[candidate + length] == src[pos + length])
+            length++;
+        while (pos > anchor && candidate > 0 && src[pos - 1] == src[candidate - 1]) {
+            pos--;
+            candidate--;
+            length++;
+        }
+
+        out = put_sequence(out, src + anchor, pos - anchor, pos - candidate, length);
+        pos += length;
+        anchor = pos;
+    }
+    out = put_sequence(out, src + anchor, size - anchor, 0, 0);
+    return out - dst;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage : %s target/yak target/yak.lz4\n", argv[0]);
+        return 1;
+    }
+
+    FILE* f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    unsigned char* elf = malloc(size);
+    fseek(f, 0, SEEK_SET);
+    if (fread(elf, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "%s : short read\n", argv[1]);
+        return 1;
+    }
+    fclose(f);
+
+    Elf64_Ehdr* ehdr = (Elf64_Ehdr*)elf;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS64) {
+        fprintf(stderr, "%s : not an ELF64 file\n", argv[1]);
+        return 1;
+    }
+    Elf64_Phdr* phdrs = (Elf64_Phdr*)(elf + ehdr->e_phoff);
+
+    PackHeader header = { PACK_MAGIC, 0, ehdr->e_entry };
+    PackSegment segments[PACK_MAX_SEGMENTS];
+    unsigned char* blocks[PACK_MAX_SEGMENTS];
+    long offset = 0;
+
+    for (int i=0; i<ehdr->e_phnum; i++) {
+        Elf64_Phdr* phdr = &phdrs[i];
+        if (phdr->p_type != PT_LOAD)
+            continue;
+        if (header.segments == PACK_MAX_SEGMENTS) {
+            fprintf(stderr, "%s : more than %d segments\n", argv[1], PACK_MAX_SEGMENTS);
+            return 1;
+        }
+
+        PackSegment* segment = &segments[header.segments];
+        unsigned char* data = elf + phdr->p_offset;
+        unsigned char* block = malloc(phdr->p_filesz + phdr->p_filesz / 255 + 16);
+        segment->paddr = phdr->p_paddr;
+        segment->filesz = phdr->p_filesz;
+        segment->memsz = phdr->p_memsz;
+        segment->size = lz4_compress(data, phdr->p_filesz, block);
+        segment->offset = offset;
+
+        unsigned char* check = malloc(phdr->p_filesz + 1);
+        if (lz4_decompress(check, phdr->p_filesz, block, segment->size) != (long)phdr->p_filesz
+            || memcmp(check, data, phdr->p_filesz) != 0) {
+            fprintf(stderr, "segment %u : LZ4 round trip failed\n", header.segments);
+            return 1;
+        }
+        free(check);
+
+        blocks[header.segments++] = block;
+        offset += segment->size;
+    }
+
+    // Block offsets start after the headers
+    long headers = sizeof(header) + header.segments * sizeof(PackSegment);
+    for (unsigned int i=0; i<header.segments; i++)
+        segments[i].offset += headers;
+
+    FILE* out = fopen(argv[2], "wb");
+    if (out == NULL) {
+        perror(argv[2]);
+        return 1;
+    }
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(segments, sizeof(PackSegment), header.segments, out);
+    long packed = 0;
+    for (unsigned int i=0; i<header.segments; i++) {
+        fwrite(blocks[i], 1, segments[i].size, out);
+        packed += segments[i].filesz;
+    }
+    fclose(out);
+
+    fprintf(stderr, "%s : %ld bytes (ELF), %ld bytes (segments), %ld bytes (packed)\n",
+            argv[2], size, packed, headers + offset);
+    return 0;
+}
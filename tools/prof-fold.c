@@ -0,0 +1,185 @@
+/*
+ * Host-side symbolizer of the profiler stream (see yak/includes/prof.h).
+ * Usage : prof-fold target/yak [prof.bin]   (standard input by default)
+ * Prints folded stacks, one line per distinct stack with its sample count :
+ *     kernel_main;kvminit;vmmap_flags 12
+ * ready for flamegraph.pl. A summary per CPU goes to standard error.
+ */
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "prof.h"
+
+typedef struct Symbol {
+    unsigned long addr;
+    unsigned long size;
+    const char* name;
+} Symbol;
+
+Symbol* symbols;
+long nsymbols;
+
+int symbol_cmp(const void* a, const void* b) {
+    const Symbol* x = a;
+    const Symbol* y = b;
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+int load_symbols(const char* path) {
+    /*
+     * Code symbols of the kernel ELF : functions, and nasm labels (no type)
+     * in executable sections
+     */
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    char* elf = malloc(size);
+    fseek(f, 0, SEEK_SET);
+    if (fread(elf, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "%s : short read\n", path);
+        return 1;
+    }
+    fclose(f);
+
+    Elf64_Ehdr* ehdr = (Elf64_Ehdr*)elf;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS64) {
+        fprintf(stderr, "%s : not an ELF64 file\n", path);
+        return 1;
+    }
+    Elf64_Shdr* sections = (Elf64_Shdr*)(elf + ehdr->e_shoff);
+    for (int i=0; i<ehdr->e_shnum; i++) {
+        if (sections[i].sh_type != SHT_SYMTAB)
+            continue;
+        Elf64_Sym* syms = (Elf64_Sym*)(elf + sections[i].sh_offset);
+        const char* strtab = elf + sections[sections[i].sh_link].sh_offset;
+        long count = sections[i].sh_size / sizeof(Elf64_Sym);
+        symbols = malloc(count * sizeof(Symbol));
+        for (long j=0; j<count; j++) {
+            int type = ELF64_ST_TYPE(syms[j].st_info);
+            int shndx = syms[j].st_shndx;
+            if (type != STT_FUNC && type != STT_NOTYPE)
+                continue;
+            if (shndx == SHN_UNDEF || shndx >= SHN_LORESERVE || !(sections[shndx].sh_flags & SHF_EXECINSTR))
+                continue;
+            if (strtab[syms[j].st_name] == 0)
+                continue;
+            symbols[nsymbols].addr = syms[j].st_value;
+            symbols[nsymbols].size = syms[j].st_size;
+            symbols[nsymbols].name = strtab + syms[j].st_name;
+            nsymbols++;
+        }
+    }
+    if (nsymbols == 0) {
+        fprintf(stderr, "%s : no symbols\n", path);
+        return 1;
+    }
+    qsort(symbols, nsymbols, sizeof(Symbol), symbol_cmp);
+    return 0;
+}
+
+const char* symbolize(unsigned long pc) {
+    // Last symbol at or below [pc]
+    long low = 0, high = nsymbols;
+    while (high - low > 1) {
+        long mid = (low + high) / 2;
+        if (symbols[mid].addr <= pc)
+            low = mid;
+        else
+            high = mid;
+    }
+    Symbol* s = &symbols[low];
+    if (pc < s->addr || (s->size != 0 && pc >= s->addr + s->size))
+        return NULL;
+    return s->name;
+}
+
+int find_header(FILE* in, ProfHeader* header) {
+    /*
+     * Skip to the next PROF_MAGIC (anything else on the serial line, e.g.
+     * BIOS output, comes before it). Returns 1 at the end of the stream.
+     */
+    unsigned int window = 0;
+    int c;
+    while ((c = fgetc(in)) != EOF) {
+        window = (window >> 8) | ((unsigned int)c << 24);
+        if (window != PROF_MAGIC)
+            continue;
+        header->magic = window;
+        if (fread((char*)header + sizeof(header->magic), sizeof(*header) - sizeof(header->magic), 1, in) != 1)
+            return 1;
+        return 0;
+    }
+    return 1;
+}
+
+int line_cmp(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage : %s target/yak [prof.bin]\n", argv[0]);
+        return 1;
+    }
+    if (load_symbols(argv[1]) != 0)
+        return 1;
+    FILE* in = stdin;
+    if (argc > 2 && (in = fopen(argv[2], "rb")) == NULL) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    char** lines = NULL;
+    long nlines = 0, capacity = 0;
+    ProfHeader header;
+
+    while (find_header(in, &header) == 0) {
+        fprintf(stderr, "cpu%u : %u samples at %ld Hz, %u dropped\n",
+                header.cpu, header.samples, header.hz, header.dropped);
+        for (unsigned int i=0; i<header.samples; i++) {
+            ProfSample sample;
+            long head = __builtin_offsetof(ProfSample, pcs);
+            if (fread(&sample, head, 1, in) != 1 || sample.depth == 0 || sample.depth > PROF_MAX_DEPTH
+                || fread(sample.pcs, sizeof(long), sample.depth, in) != sample.depth) {
+                fprintf(stderr, "cpu%u : truncated after %u samples\n", header.cpu, i);
+                break;
+            }
+
+            // Outermost frame first. Return addresses point after the call.
+            char line[PROF_MAX_DEPTH * 64];
+            int len = 0;
+            for (int j=sample.depth-1; j>=0; j--) {
+                unsigned long pc = sample.pcs[j] - (j > 0);
+                const char* name = symbolize(pc);
+                if (name != NULL)
+                    len += snprintf(line + len, sizeof(line) - len, "%s%s", len ? ";" : "", name);
+                else
+                    len += snprintf(line + len, sizeof(line) - len, "%s%#lx", len ? ";" : "", pc);
+                if (len >= (int)sizeof(line))
+                    break;
+            }
+
+            if (nlines == capacity) {
+                capacity = capacity ? capacity * 2 : 1024;
+                lines = realloc(lines, capacity * sizeof(char*));
+            }
+            lines[nlines++] = strdup(line);
+        }
+    }
+
+    qsort(lines, nlines, sizeof(char*), line_cmp);
+    for (long i=0; i<nlines; ) {
+        long j = i;
+        while (j < nlines && strcmp(lines[i], lines[j]) == 0)
+            j++;
+        printf("%s %ld\n", lines[i], j - i);
+        i = j;
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * Host-side decoder of the kernel trace stream (see yak/includes/trace.h).
+ * Usage : trace-decode [trace.bin]   (standard input by default)
+ * One line per record : time (ns since ktime_init), CPU, event, arguments.
+ * Records are printed in stream order : each CPU is in order, CPUs are
+ * interleaved by batch of drained records.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "trace.h"
+
+const char* event_names[TRACE_EVENTS] = {
+    "header", "lost", "kalloc", "kfree", "vmmap", "pt_alloc"
+};
+
+int main(int argc, char** argv) {
+    FILE* in = stdin;
+    if (argc > 1 && (in = fopen(argv[1], "rb")) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    TraceRecord record;
+    long tsc_hz = 0;
+    unsigned long tsc_base = 0;
+    long records = 0, lost = 0;
+    unsigned int next_seq[65536];
+    char seen[65536];
+    memset(seen, 0, sizeof(seen));
+
+    while (fread(&record, sizeof(record), 1, in) == 1) {
+        if (record.event == TRACE_HEADER) {
+            if (record.seq != TRACE_MAGIC) {
+                fprintf(stderr, "bad header, not a trace stream ?\n");
+                return 1;
+            }
+            tsc_hz = record.arg0;
+            tsc_base = record.arg1;
+            printf("# tsc_hz %ld\n", tsc_hz);
+            continue;
+        }
+        if (tsc_hz == 0) {
+            // Garbage before the header (e.g. BIOS output)
+            continue;
+        }
+
+        double ns = (double)(long)(record.tsc - tsc_base) * 1e9 / tsc_hz;
+        const char* name = record.event < TRACE_EVENTS ? event_names[record.event] : "?";
+        printf("%16.0f cpu%-3u %-9s %#18lx %#18lx\n", ns, record.cpu, name,
+               (unsigned long)record.arg0, (unsigned long)record.arg1);
+
+        if (record.event == TRACE_LOST) {
+            lost += record.arg0;
+            continue;
+        }
+        records++;
+        if (seen[record.cpu] && record.seq != next_seq[record.cpu])
+            fprintf(stderr, "cpu%u : records %u to %u missing\n", record.cpu, next_seq[record.cpu], record.seq - 1);
+        seen[record.cpu] = 1;
+        next_seq[record.cpu] = record.seq + 1;
+    }
+
+    fprintf(stderr, "%ld records, %ld lost\n", records, lost);
+    return 0;
+}
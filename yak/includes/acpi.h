@@ -0,0 +1,59 @@
+/*
+ * ACPI tables, read once at boot to find the processors.
+ * RSDP (found in the EBDA or the BIOS area) -> RSDT / XSDT -> MADT ("APIC")
+ *
+ * MADT :
+ * +----------------------+
+ * |     SDT header       | 36 bytes, signature "APIC"
+ * +----------------------+
+ * |   Local APIC base    | 32 bits (physical)
+ * |        Flags         | 32 bits
+ * +----------------------+
+ * |   Entries : type,    | Type 0 : processor local APIC
+ * |   length, data ...   | Type 5 : 64-bit local APIC base override
+ * +----------------------+
+ */
+
+typedef struct __attribute__((packed)) Rsdp {
+    char signature[8]; // "RSD PTR "
+    unsigned char checksum; // First 20 bytes
+    char oem[6];
+    unsigned char revision; // 0 : ACPI 1.0 (RSDT only), 2 : XSDT
+    unsigned int rsdt;
+    unsigned int length;
+    long xsdt;
+    unsigned char extended_checksum; // Whole structure
+    unsigned char reserved[3];
+} Rsdp;
+
+typedef struct __attribute__((packed)) SdtHeader {
+    char signature[4];
+    unsigned int length; // Header included
+    unsigned char revision;
+    unsigned char checksum;
+    char oem[6];
+    char oem_table[8];
+    unsigned int oem_revision;
+    unsigned int creator;
+    unsigned int creator_revision;
+} SdtHeader;
+
+#define MADT_LOCAL_APIC 0
+#define MADT_LAPIC_OVERRIDE 5
+
+#define MADT_ENABLED (1 << 0)
+#define MADT_ONLINE_CAPABLE (1 << 1)
+
+/*
+ * Processors found in the MADT, the bootstrap processor included, and the
+ * physical address of the local APIC registers
+ */
+extern int acpi_ncpus;
+extern int acpi_apic_ids[];
+extern long acpi_lapic_base;
+
+/*
+ * Parse the MADT. Returns 1 if no valid MADT was found.
+ * Tables outside of usable memory are added to the direct map.
+ */
+int acpi_init();
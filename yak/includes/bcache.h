@@ -0,0 +1,69 @@
+/*
+ * Buffer cache of disk blocks (BCACHE_BLOCK_SIZE bytes), on top of blk.h.
+ * + Lookup : hash table of BCACHE_HASH chains, by block number.
+ * + Replacement : LRU list of every buffer, most recently released first.
+ *   The victim is the least recently released buffer that is not held,
+ *   not dirty and has no request in flight. Buffers are created on demand,
+ *   up to BCACHE_BUFFERS, their data in a kalloc frame.
+ * + Read-ahead : a miss on the block right after the previous miss also
+ *   queues reads of the next BCACHE_READAHEAD blocks, nobody waits for them.
+ * + Write-back : bwrite only marks a buffer dirty. Dirty buffers go to the
+ *   disk in batches of BLK_SLOTS requests in flight, on bflush or when only
+ *   dirty buffers are left to reuse.
+ *
+ * Usage, from threads only :
+ *     Buf* b = bread(block);
+ *     ... read / modify b->data, then bwrite(b) if modified ...
+ *     brelse(b);
+ */
+
+#define BCACHE_BLOCK_SIZE 4096
+#define BCACHE_SECTORS (BCACHE_BLOCK_SIZE / BLK_SECTOR_SIZE)
+#define BCACHE_BUFFERS 1024 // 4 MiB of data
+#define BCACHE_HASH_BITS 8
+#define BCACHE_HASH (1 << BCACHE_HASH_BITS)
+#define BCACHE_READAHEAD 8
+
+// Buffer flags
+#define BUF_VALID 1 // Data read from the disk (or written since)
+#define BUF_DIRTY 2 // Data newer than the disk
+#define BUF_IO 4 // Request in flight
+
+typedef struct Buf {
+    long block;
+    volatile int flags;
+    int refs;
+    void* data;
+    struct Buf* hash_next;
+    struct Buf* lru_prev; // Released more recently
+    struct Buf* lru_next;
+    BlkRequest req;
+} Buf;
+
+typedef struct BcacheStats {
+    long hits;
+    long misses;
+    long readaheads; // Blocks read ahead
+    long writebacks; // Blocks written back
+} BcacheStats;
+
+extern BcacheStats bcache_stats;
+
+/*
+ * Buffer of [block], held and valid. Returns 0 on a read error, beyond the
+ * disk, or if every buffer is held.
+ */
+Buf* bread(long block);
+/*
+ * Mark a held buffer as modified
+ */
+void bwrite(Buf* buf);
+/*
+ * Let go of a buffer returned by bread
+ */
+void brelse(Buf* buf);
+/*
+ * Write every dirty buffer back, then the device's cache. Returns 1 if a
+ * write failed.
+ */
+int bflush();
@@ -0,0 +1,167 @@
+/*
+ * In-kernel benchmarks, built with `make bench` (-DBENCH).
+ * Each benchmark must be called by every running CPU. Results are kept in
+ * memory (they can be read with gdb, see `make debug`), and bench_report
+ * sends them over COM1 once every benchmark is done : tools/bench-report.c
+ * prints them as rates.
+ * Cycles are TSC cycles : the TSC frequency is tsc_hz (ktime.h).
+ */
+
+/*
+ * kalloc / kfree stress : for each CPU count n from 1 to ncpus, the first n
+ * CPUs repeatedly allocate a batch of frames then free it.
+ * Frames per second for n CPUs = frames * TSC frequency / cycles.
+ */
+typedef struct BenchKallocResult {
+    int cpus;
+    long frames; // kalloc + kfree pairs, all CPUs together
+    long cycles; // TSC cycles of the slowest CPU
+} BenchKallocResult;
+
+extern BenchKallocResult bench_kalloc_results[];
+
+void bench_kalloc();
+
+/*
+ * memcpy / memset throughput of each implementation (see string_ops.h), on
+ * sizes from 16 B to 2 MiB, run by CPU 0 only.
+ * GB/s = bytes * TSC frequency / cycles / 10^9.
+ * Variants are indexed by BENCH_STRING_* ; cycles are 0 when the CPU does not
+ * support the variant.
+ */
+#define BENCH_STRING_SCALAR 0
+#define BENCH_STRING_ERMS 1
+#define BENCH_STRING_SSE2 2
+#define BENCH_STRING_AVX2 3
+#define BENCH_STRING_VARIANTS 4
+#define BENCH_STRING_SIZES 18 // 16 << 0 ... 16 << 17
+
+typedef struct BenchStringResult {
+    long size;
+    long bytes; // Per variant
+    long memcpy_cycles[BENCH_STRING_VARIANTS];
+    long memset_cycles[BENCH_STRING_VARIANTS];
+} BenchStringResult;
+
+extern BenchStringResult bench_string_results[];
+
+void bench_string();
+
+/*
+ * Demand-zero faults, run by CPU 0 only : every page of a fresh region is
+ * written once (each write faults) then a second time (no fault).
+ * The difference is the end-to-end cost of a fault, exception delivery
+ * included ; fault_stats (demand.h) only covers the handler.
+ */
+typedef struct BenchFaultResult {
+    long pages;
+    long first_touch_cycles;
+    long second_touch_cycles;
+} BenchFaultResult;
+
+extern BenchFaultResult bench_fault_result;
+
+void bench_fault();
+
+/*
+ * Scheduler (see sched.h). Only starts a driver thread on CPU 0 : the
+ * results are ready once bench_sched_done is set, after every CPU entered
+ * sched_run.
+ * + Context switches, on CPU 0 alone : a raw context_switch round trip
+ *   between two contexts, and a thread_yield round trip through the
+ *   scheduler loop.
+ * + Spawn / join throughput : for each CPU count n from 1 to ncpus, a binary
+ *   tree of threads of depth BENCH_SCHED_DEPTH (2^(BENCH_SCHED_DEPTH+1) - 2
+ *   threads below the driver), each one joining its two children, with n
+ *   CPUs stealing.
+ *   Threads per second for n CPUs = threads * TSC frequency / cycles.
+ */
+#define BENCH_SCHED_DEPTH 20
+
+typedef struct BenchSwitchResult {
+    long rounds;
+    long switch_cycles;
+    long yield_cycles;
+} BenchSwitchResult;
+
+typedef struct BenchSchedResult {
+    int cpus;
+    long threads;
+    long cycles;
+} BenchSchedResult;
+
+extern BenchSwitchResult bench_switch_result;
+extern BenchSchedResult bench_sched_results[];
+extern volatile int bench_sched_done;
+
+void bench_sched();
+
+/*
+ * Disk (see blk.h), from a driver thread started on CPU 0 once bench_sched
+ * is done : the results are ready once bench_blk_done is set. Nothing is
+ * measured without a disk (`make bench` attaches $(BENCH_DISK)).
+ * For each queue depth d from 1 to BLK_SLOTS (powers of two), with d
+ * requests kept in flight, BENCH_BLK_REQUESTS requests of each pattern :
+ * + random 4 KiB reads : IOPS = requests * TSC frequency / cycles
+ * + sequential 64 KiB reads : bytes per second = requests * 64 KiB * TSC
+ *   frequency / cycles
+ * + random 4 KiB writes
+ */
+#define BENCH_BLK_DEPTHS 6
+#define BENCH_BLK_REQUESTS 4096
+#define BENCH_BLK_RANDOM_SIZE 4096
+#define BENCH_BLK_SEQUENTIAL_SIZE (64 * 1024)
+
+typedef struct BenchBlkResult {
+    int depth;
+    long requests;
+    long random_read_cycles;
+    long sequential_read_cycles;
+    long random_write_cycles; // 0 if the disk is read-only
+} BenchBlkResult;
+
+/*
+ * Before the measurements, a check of the driver and the buffer cache (see
+ * bcache.h) : BENCH_BLK_CHECK_BLOCKS blocks, half of them consecutive (read
+ * ahead), the others spread over the disk, are filled through bread /
+ * bwrite, written back with bflush, then read back both raw (blk_io) and
+ * through the cache. On a read-only disk, the cache must only give back
+ * what the disk holds.
+ */
+#define BENCH_BLK_CHECK_BLOCKS 64
+
+typedef struct BenchBlkCheck {
+    long blocks; // Blocks checked, 0 without a disk
+    long errors; // Failed calls and mismatching blocks
+} BenchBlkCheck;
+
+extern BenchBlkResult bench_blk_results[BENCH_BLK_DEPTHS];
+extern BenchBlkCheck bench_blk_check_result;
+extern volatile int bench_blk_done;
+
+void bench_blk();
+
+/*
+ * Sent over COM1 by bench_report, read by tools/bench-report.c
+ */
+#define BENCH_REPORT_MAGIC 0x48434e42
+
+typedef struct BenchReport {
+    unsigned int magic; // BENCH_REPORT_MAGIC
+    unsigned int size; // sizeof(BenchReport)
+    long tsc_hz;
+    int ncpus; // Rows of the per-CPU-count results
+    BenchKallocResult kalloc[MAX_CPUS];
+    BenchStringResult string[BENCH_STRING_SIZES];
+    BenchSwitchResult sched_switch;
+    BenchSchedResult sched[MAX_CPUS];
+    BenchFaultResult fault;
+    BenchBlkCheck blk_check;
+    BenchBlkResult blk[BENCH_BLK_DEPTHS];
+} BenchReport;
+
+/*
+ * Wait (from a thread started on CPU 0) for every benchmark, send the
+ * report, then leave QEMU through its isa-debug-exit device
+ */
+void bench_report();
@@ -0,0 +1,76 @@
+/*
+ * Block device : virtio-blk over PCI (QEMU `-drive if=virtio`), with a
+ * single request queue.
+ *
+ * Requests are asynchronous : blk_submit queues one and returns, the
+ * caller waits for it later (blk_wait), or gets its [end] callback. Up to
+ * BLK_SLOTS requests are in flight, each in its own descriptor chain :
+ * +------------------------+
+ * |  Header : type, sector | Read by the device
+ * +------------------------+
+ * |          Data          | Read (write) or written (read), absent for a flush
+ * +------------------------+
+ * |      Status byte       | Written by the device
+ * +------------------------+
+ * Once requests are done, the device raises TRAP_BLK (MSI-X) on the
+ * bootstrap processor. Like the other interrupts, it only ends an idle sleep
+ * (see sched.h) : the scheduler loop of every CPU completes the finished
+ * requests (blk_poll).
+ */
+
+#define BLK_SECTOR_SIZE 512
+#define BLK_QUEUE_SIZE 128 // Virtqueue entries, at most
+#define BLK_SLOTS 32 // Requests in flight, 3 entries each
+
+// Request types (as in virtio-blk)
+#define BLK_READ 0
+#define BLK_WRITE 1
+#define BLK_FLUSH 4 // Write back the device's cache
+
+// Request status (as in virtio-blk)
+#define BLK_OK 0
+#define BLK_IOERR 1
+#define BLK_UNSUPPORTED 2
+
+typedef struct BlkRequest {
+    int type; // BLK_READ / BLK_WRITE / BLK_FLUSH
+    int status; // Set on completion
+    long sector;
+    void* buffer; // Physically contiguous (direct map address)
+    long size; // Multiple of BLK_SECTOR_SIZE
+    // Called on completion, from a scheduler loop, instead of signaling [done]
+    void (*end)(struct BlkRequest* req);
+    void* private; // For [end]
+    Completion done;
+} BlkRequest;
+
+// Disk size in sectors, 0 without a disk
+extern long blk_sectors;
+extern int blk_read_only;
+// The device has a write cache that BLK_FLUSH writes back
+extern int blk_can_flush;
+
+/*
+ * Find and set up the disk, after kmem_init. Returns 1 if there is none or
+ * it cannot be driven (it needs the local APIC for its interrupts).
+ */
+int blk_init();
+/*
+ * Queue [req]. Returns 1 if every slot is taken (nothing is queued, retry
+ * once requests complete) or without a disk, -1 if the request is invalid
+ * (beyond the disk, bad size, write to a read-only disk).
+ */
+int blk_submit(BlkRequest* req);
+/*
+ * Wait for a request queued without [end]. From a thread only.
+ */
+void blk_wait(BlkRequest* req);
+/*
+ * Queue [req] (waiting for a free slot) and wait for it : returns its
+ * status. From a thread only.
+ */
+int blk_io(BlkRequest* req);
+/*
+ * Complete the requests the device is done with
+ */
+void blk_poll();
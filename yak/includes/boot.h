@@ -0,0 +1,99 @@
+/*
+ * Information handed over by the bootloader, at BOOT_INFO_ADDR (physical).
+ * Has to be consistent with bootloader/second-stage.s and bootloader/loader.c
+ * +----------------------+
+ * |     kernel_start     | Physical extent of the loaded segments
+ * |      kernel_end      |
+ * +----------------------+
+ * |      e820_count      |
+ * +----------------------+
+ * |    E820 entries      | As returned by INT 0x15, EAX=0xe820
+ * |         ...          | (E820_MAX slots)
+ * +----------------------+
+ * |   TSC at each phase  | Boot timing, BOOT_TSC_COUNT slots
+ * |       boundary       | (BOOT_INFO_ADDR + 0xc18)
+ * +----------------------+
+ * |     initrd_base      | Initial ramdisk loaded by loader.c (see
+ * |     initrd_size      | initrd.h), BOOT_INFO_ADDR + 0xc88
+ * +----------------------+
+ */
+
+#define BOOT_INFO_ADDR 0x1000
+#define E820_MAX 128
+
+#define E820_USABLE 1
+
+/*
+ * Boot timing : the TSC at the end of each phase, from the MBR to the end
+ * of smp_init (mbr.s, second-stage.s and loader.c stamp their own).
+ * Phase i lasts tsc[i] - tsc[i-1].
+ */
+#define BOOT_TSC_MBR 0 // MBR entry
+#define BOOT_TSC_STAGE2 1 // Second stage read by the MBR
+#define BOOT_TSC_A20 2
+#define BOOT_TSC_E820 3
+#define BOOT_TSC_PROTECTED 4 // GDT, protected mode
+#define BOOT_TSC_LONG 5 // Page tables, long mode
+#define BOOT_TSC_ATA 6 // loader.c : drive set up
+#define BOOT_TSC_LOADED 7 // loader.c : segments (and initrd) loaded
+#define BOOT_TSC_KERNEL 8 // kernel_main entry
+#define BOOT_TSC_EARLY 9 // CPU features, traps, TSC calibration, local APIC
+#define BOOT_TSC_KINIT 10
+#define BOOT_TSC_KVMINIT 11
+#define BOOT_TSC_KMEM 12 // kmem_init, kzero_refill
+#define BOOT_TSC_SMP 13 // Application processors up
+#define BOOT_TSC_COUNT 14
+
+#define BOOT_REPORT_MAGIC 0x424b4159
+
+typedef struct E820Entry {
+    long base;
+    long length;
+    int type;
+    int acpi; // ACPI 3 extended attributes
+} E820Entry;
+
+typedef struct BootInfo {
+    long kernel_start;
+    long kernel_end;
+    long e820_count;
+    E820Entry e820[E820_MAX];
+    long tsc[BOOT_TSC_COUNT];
+    long initrd_base; // Physical, 2 MiB-aligned
+    long initrd_size; // 0 without an initrd
+} BootInfo;
+
+/*
+ * Sent over COM1 by boot_report (BENCH_BOOT builds), read by
+ * tools/boot-stats.c
+ */
+typedef struct BootReport {
+    unsigned int magic; // BOOT_REPORT_MAGIC
+    unsigned int count; // BOOT_TSC_COUNT
+    long tsc_hz;
+    long tsc[BOOT_TSC_COUNT];
+} BootReport;
+
+// Copy of the boot info, made before the bootloader's memory is reclaimed
+extern BootInfo boot_info;
+
+/*
+ * Calls [f] on every page-aligned usable physical range [start] -> [end] of
+ * the E820 map lying above [min], once each : reserved ranges, the initrd
+ * and ranges already reported by a previous entry are cut out.
+ */
+void for_each_usable_range(BootInfo* info, long min, void (*f)(long start, long end));
+/*
+ * End of the highest usable physical range (page-aligned)
+ */
+long usable_top(BootInfo* info);
+
+/*
+ * Record the end of boot phase [phase] (BOOT_TSC_*) in boot_info
+ */
+void boot_tsc(int phase);
+/*
+ * Send the boot timestamps over COM1, then leave QEMU through its
+ * isa-debug-exit device (`make bench-boot`)
+ */
+void boot_report();
@@ -0,0 +1,39 @@
+/*
+ * Copy-on-write address spaces.
+ * The lower half of a PML4 (entries 0 to 255) is the user half, private to
+ * each address space. The upper half is the kernel, shared : its PML4
+ * entries point to the same tables in every address space.
+ *
+ * Cloning copies the page tables of the user half but none of the pages :
+ * writeable leaves become read-only and ENTRY_COW in both address spaces,
+ * read-only ones ENTRY_SHARED, and their frames get one more reference (see
+ * kref_get). Clone cost thus depends on the size of the page tables, not on
+ * resident memory. vmprotect turns one kind into the other (see vm.h).
+ * The first write to such a page faults : the page is copied (4 KiB only,
+ * a megapage is split first), or made writeable again if this address
+ * space is its last owner.
+ * User leaves must map frames from kalloc / kalloc_pages(MEGAPAGE_ORDER).
+ */
+
+#define USER_PML4_ENTRIES 256
+
+/*
+ * Clone the address space [pml4]. Demand-zero regions of the user half are
+ * cloned too. Returns the new PML4 (in the direct map), or 0 if no frame is
+ * left or if the user half holds 1 GiB leaves.
+ */
+void* address_space_clone(void* pml4);
+/*
+ * Drop the user half of [pml4] (pages, page tables and demand-zero regions)
+ * and free [pml4] itself. It must not be loaded on any CPU, and its PCID
+ * must be flushed before being reused.
+ */
+void address_space_destroy(void* pml4);
+
+struct TrapFrame;
+
+/*
+ * #PF handler for write accesses to present pages : returns 0 if the page
+ * was copy-on-write and is now writeable, -1 otherwise.
+ */
+int cow_fault(struct TrapFrame* frame);
@@ -0,0 +1,63 @@
+#define MAX_CPUS 64
+
+// Number of CPUs running kernel code
+extern int ncpus;
+
+/*
+ * Per-CPU data. The GS base of each CPU points to its own entry, so that
+ * fields are read with a single %gs-relative access.
+ * Entry i belongs to CPU i, the bootstrap processor being CPU 0.
+ */
+typedef struct Cpu {
+    struct Cpu* self; // Linear address of this entry
+    int id;
+    int apic_id;
+    void* stack_top;
+    volatile int online; // Set by the CPU itself once it runs kernel code
+    int profiling; // Local APIC timer taken by the profiler (see prof.h)
+} __attribute__((aligned(64))) Cpu;
+
+extern Cpu cpus[MAX_CPUS];
+
+/*
+ * Point the GS base of the running CPU to cpus[[id]]. Loading a segment
+ * register clears the GS base : to be called after trap_init / trap_load.
+ */
+void percpu_init(int id);
+/*
+ * Index of the running CPU, in [0, ncpus)
+ */
+int cpu_id();
+Cpu* this_cpu();
+
+/*
+ * CPU features, probed once by cpu_detect
+ */
+#define CPU_PDPE1GB (1 << 0) // 1 GiB pages
+#define CPU_NX (1 << 1) // Execute disable bit
+#define CPU_PGE (1 << 2) // Global pages
+#define CPU_PCID (1 << 3) // Process-context identifiers
+#define CPU_INVPCID (1 << 4) // INVPCID instruction
+#define CPU_MONITOR (1 << 5) // MONITOR / MWAIT instructions
+#define CPU_TSC_DEADLINE (1 << 6) // TSC-deadline mode of the local APIC timer
+#define CPU_INVARIANT_TSC (1 << 7) // Constant TSC rate, in every power state
+
+extern int cpu_features;
+
+void cpu_detect();
+void cpuid(unsigned int leaf, unsigned int subleaf,
+           unsigned int* a, unsigned int* b, unsigned int* c, unsigned int* d);
+
+/*
+ * Model-specific registers
+ */
+#define MSR_APIC_BASE 0x1b
+#define MSR_TSC_DEADLINE 0x6e0
+#define MSR_EFER 0xc0000080
+#define MSR_GS_BASE 0xc0000101
+
+#define EFER_LME (1 << 8) // Long mode enable
+#define EFER_NXE (1 << 11) // Execute disable bit enable
+
+long rdmsr(unsigned int msr);
+void wrmsr(unsigned int msr, long value);
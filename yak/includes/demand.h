@@ -0,0 +1,58 @@
+/*
+ * Demand-zero regions.
+ * vmmap_demand only records a region : no frame nor page table is allocated.
+ * The first access to a page of the region faults, and the #PF handler backs
+ * it with a zero-filled frame. Large reservations thus cost nothing until
+ * they are used.
+ */
+
+/*
+ * Page fault handler statistics (demand-zero and copy-on-write), per CPU.
+ * Cycles are counted from the entry of demand_fault to its return : the
+ * exception delivery and the stubs (trap.s) are not included.
+ */
+#define FAULT_LATENCY_BUCKETS 24
+
+typedef struct FaultStats {
+    long faults; // Demand-zero faults served
+    long failed; // Page faults that were not ours, or out of frames
+    long cycles; // Total for served demand-zero faults
+    long max_cycles;
+    long latency[FAULT_LATENCY_BUCKETS]; // Faults served in [2^i, 2^(i+1)) cycles
+    long cow_faults; // Copy-on-write faults served
+    long cow_copies; // Of which a page was copied
+    long cow_cycles;
+} __attribute__((aligned(64))) FaultStats;
+
+extern FaultStats fault_stats[];
+
+/*
+ * Reserve [va] -> [va]+[size] (extended to whole pages) in [pml4], with the
+ * [rw], [us] and [xd] flags of vmmap. Pages of the range must not be mapped
+ * already. Regions of the kernel half belong to the kernel PML4, and can be
+ * faulted in from any address space. Fails with -1 if the range overlaps another region or is not
+ * canonical, or if no memory is left for the region descriptor.
+ */
+int vmmap_demand(void* pml4, void* va, long size, char rw, char us, long xd);
+/*
+ * Remove the region starting at [va] (as given to vmmap_demand) : its pages
+ * are unmapped and their frames freed. Fails with -1 if there is no such
+ * region.
+ */
+int vmunmap_demand(void* pml4, void* va);
+
+/*
+ * Copy the regions of the user half of [pml4] to [clone] / drop every region
+ * of [pml4] (see cow.h). demand_clone fails with -1 if no memory is left.
+ */
+int demand_clone(void* pml4, void* clone);
+void demand_destroy(void* pml4);
+
+struct TrapFrame;
+
+/*
+ * #PF handler for absent pages : returns 0 if the fault was on a page of a
+ * demand-zero region of the current address space and it is now mapped, -1
+ * otherwise.
+ */
+int demand_fault(struct TrapFrame* frame);
@@ -0,0 +1,46 @@
+/*
+ * Initial ramdisk : an archive appended to the boot image (`make
+ * INITRD=<file>`), loaded by the bootloader at the top of usable memory,
+ * 2 MiB-aligned (see bootloader/loader.c). Its frames are never handed to
+ * kalloc nor to the direct map : it is only mapped read-only at INITRD_BASE
+ * (see kvm.h), with 2 MiB leaves, and never copied.
+ *
+ * Archive formats :
+ * + cpio "newc" (`find . | cpio -o -H newc`)
+ * + ustar (`tar --format=ustar -cf`), prefix and name fields joined
+ * initrd_init builds an index of the entries : an open-addressing hash table
+ * of their paths, pointing into the archive, so that lookups are O(1) on
+ * average. Paths are compared without leading "/" or "./" and trailing "/",
+ * and a later entry replaces an earlier one with the same path (as when
+ * extracting the archive).
+ */
+
+// Entry types, as in st_mode
+#define INITRD_S_IFMT 0170000
+#define INITRD_S_IFDIR 0040000
+#define INITRD_S_IFREG 0100000
+#define INITRD_S_IFLNK 0120000
+
+typedef struct InitrdFile {
+    void* data; // In the read-only mapping (link target for a symbolic link)
+    long size;
+    int mode; // Type (INITRD_S_IF*) and permission bits
+} InitrdFile;
+
+// Read-only mapping of the archive, 0 without an initrd
+extern void* initrd;
+extern long initrd_size;
+// Paths in the index
+extern long initrd_count;
+
+struct BootInfo;
+
+/*
+ * Map the initrd reported in [info] and index it, after kinit. Returns 1
+ * without an initrd, if it is not a valid archive, or if no frame is left.
+ */
+int initrd_init(struct BootInfo* info);
+/*
+ * Find [path] in the index. Returns 1 if there is no such entry.
+ */
+int initrd_lookup(char* path, InitrdFile* file);
@@ -1,5 +1,69 @@
 #define FRAME_SIZE 0x1000
 
-void kinit();
+/*
+ * Buddy allocator : blocks of 2^order frames, naturally aligned
+ * (a block of order o starts at a multiple of 2^o frames).
+ */
+#define MAX_ORDER 18
+#define MEGAPAGE_ORDER 9 // 2 MiB
+#define GIGAPAGE_ORDER 18 // 1 GiB
+
+struct BootInfo;
+
+/*
+ * Hand out every usable range of the E820 map above the kernel
+ */
+void kinit(struct BootInfo* info);
+/*
+ * Allocate a single frame. Returns 0 if no frame is left.
+ * Served from a per-CPU cache of frames, without locking in the common case.
+ */
 void* kalloc();
+/*
+ * Free a frame returned by kalloc. Returns 1 on invalid address.
+ * Double frees are only detected once the frame reaches the buddy allocator.
+ */
 int kfree(void* addr);
+/*
+ * Allocate 2^[order] physically contiguous frames, aligned on their size.
+ * Returns 0 if no such block is left.
+ */
+void* kalloc_pages(int order);
+/*
+ * Free a block returned by kalloc_pages([order]). Returns 1 on invalid
+ * address or order.
+ */
+int kfree_pages(void* addr, int order);
+/*
+ * Allocate a frame filled with zeros, from a pool of clean frames when
+ * possible. Returns 0 if no frame is left.
+ */
+void* kalloc_zeroed();
+/*
+ * Free a frame that the caller knows to be filled with zeros (e.g. an empty
+ * page table), so that it can be handed out again by kalloc_zeroed.
+ */
+int kfree_zeroed(void* addr);
+/*
+ * Fill the pool of clean frames of this CPU. To be called when there is
+ * nothing better to do (idle loop, boot).
+ */
+void kzero_refill();
+/*
+ * Reference counts, for frames shared between address spaces (see cow.h).
+ * A block from kalloc / kalloc_pages has a single owner : kref_get adds one,
+ * kref_put drops one and frees the block with the last one (returns 1 then).
+ * [order] is 0 for a frame, MEGAPAGE_ORDER for a block mapped by megapages.
+ */
+void kref_get(void* addr, int order);
+int kref_put(void* addr, int order);
+/*
+ * Owners of the frame at [addr] (of the whole block for a megapage block
+ * that was never split)
+ */
+long kref_count(void* addr);
+/*
+ * Count the frames of the block of [order] at [addr] one by one from now on
+ * (one of its megapage mappings is being split in 4 KiB pages)
+ */
+void kref_split(void* addr, int order);
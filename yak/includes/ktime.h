@@ -0,0 +1,57 @@
+/*
+ * Timekeeping : the TSC is the clock source, calibrated once against the
+ * PIT, and each CPU's local APIC timer gives one-shot interrupts (no
+ * periodic tick).
+ *
+ * ktime_ns is a single rdtsc plus a 64x64->128 bit multiply and a shift :
+ *     ns = ((tsc - ktime_tsc_base) * ktime_mult) >> KTIME_SHIFT
+ * It assumes the TSC runs at a constant rate (CPU_INVARIANT_TSC) and is
+ * synchronized between CPUs, which holds on current hardware and in QEMU.
+ */
+
+#define KTIME_SHIFT 32
+#define NS_PER_SEC 1000000000l
+
+extern long tsc_hz;
+extern long ktime_tsc_base; // TSC at ktime_init : ktime_ns origin
+extern unsigned long ktime_mult; // ns per TSC cycle << KTIME_SHIFT
+extern unsigned long ktime_tsc_mult; // TSC cycles per ns << KTIME_SHIFT
+
+/*
+ * Calibrate the TSC (bootstrap processor, takes about a third of a second).
+ * Before that, ktime_ns returns 0.
+ */
+void ktime_init();
+/*
+ * Nanoseconds since ktime_init
+ */
+long ktime_ns();
+long cycles_to_ns(long cycles);
+long ns_to_cycles(long ns);
+
+/*
+ * One-shot timer of the running CPU (TRAP_TIMER).
+ * Uses the TSC-deadline mode of the local APIC when available, the one-shot
+ * mode (counter calibrated against the TSC) otherwise. The profiler takes
+ * the timer over while it runs (prof.h).
+ */
+#define TIMER_NONE 0 // No local APIC
+#define TIMER_TSC_DEADLINE 1
+#define TIMER_ONESHOT 2
+
+extern int timer_mode;
+extern long lapic_timer_hz; // After the divider (TIMER_DIVIDE_16)
+
+/*
+ * Set up the local APIC timer of the running CPU, once its local APIC is
+ * enabled (bootstrap processor first)
+ */
+void timer_init();
+/*
+ * Raise TRAP_TIMER on the running CPU at [deadline] (ktime_ns), right away
+ * if it is already past, or disarm the timer if [deadline] is 0.
+ * Taken once the CPU enables interrupts : the timer only ends an idle
+ * sleep (see sched.h). In one-shot mode, far deadlines may fire early.
+ * Does nothing while the running CPU profiles.
+ */
+void timer_arm(long deadline);
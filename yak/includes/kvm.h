@@ -1,36 +1,75 @@
 /*
- * Kernel virtual memory layout :
- *             ...
- * +---------------------------+ -.
- * |      Kernel stack 1       |   `.
- * +---------------------------+    | --> Mapped in free memory
- * |      Kernel stack 0       |    |
- * +---------------------------+   ,`
- * |         Trampoline        | .`
- * +---------------------------+`<-- FREE_MEM_TOP : 0x20000000 (512 MiB)
- * |                           |
- * |       Free memory         |
- * |                           |
+ * Kernel virtual memory layout. The kernel lives in the upper half, shared by
+ * every address space (see cow.h), the lower half is left to user space.
  * +---------------------------+ <-- KERNEL_TOP (page-aligned)
  * |           .bss            | RW  `.
  * +---------------------------+       `.
  * |           .data           | RW     |
  * +---------------------------+        | --> Kernel segments loaded in memory
- * |          .rodata          | R      |
+ * |          .rodata          | R      |     (at KERNEL_BASE - KERNEL_VMA)
  * +---------------------------+       ,`
  * |           .text           | RX  .`
- * +---------------------------+ <-- KERNEL_BASE (page-aligned)
- * |         ???????           |
+ * +---------------------------+ <-- KERNEL_BASE : KERNEL_VMA + 4 MiB
+ *             ...                   (KERNEL_VMA : 0xffffffff80000000)
+ * +---------------------------+
+ * |      Kernel stack 1       | --> Backed by free frames
+ * +---------------------------+
+ * |        Guard page         | --> Not mapped
+ * +---------------------------+
+ * |      Kernel stack 0       |
  * +---------------------------+
+ * |        Guard page         |
+ * +---------------------------+ <-- KSTACK_BASE : 0xffffff0000000000
+ *             ...
+ * +---------------------------+
+ * |      Initial ramdisk      | R, 2 MiB leaves (see initrd.h)
+ * +---------------------------+ <-- INITRD_BASE : 0xfffffe0000000000
+ *             ...
+ * +---------------------------+
+ * |    Demand-zero regions    | Backed on first access (see demand.h)
+ * +---------------------------+ <-- DEMAND_BASE : 0xffffc00000000000
+ *             ...
+ * +---------------------------+ <-- PHYS_MAP_BASE + free_mem_top
+ * |                           |
+ * |  Direct map of physical   | RW, every usable E820 range, with the
+ * |          memory           | largest leaves the CPU supports
+ * |                           |
+ * +---------------------------+ <-- PHYS_MAP_BASE : 0xffff800000000000
  * Note : when entering the kernel, the bootloader gives the kernel its own
  * page table. Thus, the kernel needs to quickly set up this new mapping.
  *
- * From 0x0 to FREE_MEM_TOP : identity mapping.
- * Starting from FREE_MEM_TOP, virtual mapping.
+ * The kernel image is mapped with 4 KiB pages and per-section permissions.
+ * Any other physical frame (frame allocator data, page tables, frames from
+ * kalloc) is reached through the direct map : P2V and V2P convert between
+ * both. Firmware tables and device registers outside of usable RAM are added
+ * to the direct map on request (kvm_map_phys). The bootloader already aliases
+ * its identity mapping at PHYS_MAP_BASE and at KERNEL_VMA, so P2V is usable
+ * from the kernel entry on.
+ * Kernel stack i belongs to CPU i (the bootstrap processor runs on a stack
+ * in .bss).
  */
 
-#define KERNEL_STACK_SIZE 0x1000
-#define FREE_MEM_TOP 0x20000000 // 512 MiB
+#ifndef PHYS_MAP_BASE
+#define PHYS_MAP_BASE 0xffff800000000000l
+#endif
+#define P2V(pa) ((void*)((long)(pa) + PHYS_MAP_BASE))
+#define V2P(va) ((long)(va) - PHYS_MAP_BASE)
+
+#define DEMAND_BASE ((void*)0xffffc00000000000l)
+#define INITRD_BASE ((void*)0xfffffe0000000000l)
+#define KSTACK_BASE 0xffffff0000000000l
+#define KERNEL_VMA 0xffffffff80000000l
+// Physical address of a kernel image symbol
+#define KERNEL_V2P(va) ((long)(va) - KERNEL_VMA)
+
+// Kernel mappings are the same in every address space : global
+#define KERNEL_FLAGS(rw, xd) (ENTRY_FLAGS(rw, PTE_SUPERVISOR, xd) | ENTRY_G)
+
+// Leaves room for exception frames and their SIMD state (see trap.h)
+#define KERNEL_STACK_SIZE 0x4000
+
+extern void* PML4; // Kernel page table, in the direct map
+extern char* free_mem_top;
 
 // Set by linker
 extern char KERNEL_BASE[];
@@ -39,4 +78,22 @@ extern char RODATA_SECTION_START[];
 extern char DATA_SECTION_START[];
 extern char BSS_SECTION_START[];
 
-void kvminit();
+struct BootInfo;
+
+void kvminit(struct BootInfo* info);
+/*
+ * Paging setup of an application processor : kernel page table, PCID
+ */
+void kvminit_ap();
+/*
+ * Make sure [pa] -> [pa]+[size] is reachable through the direct map, mapping
+ * missing pages with the leaf [flags] (e.g. KERNEL_FLAGS, plus ENTRY_PCD and
+ * ENTRY_PWT for device registers). Returns P2V([pa]), or 0 if no frame is
+ * left for page tables.
+ */
+void* kvm_map_phys(long pa, long size, long flags);
+/*
+ * Map kernel stack [i] (KERNEL_STACK_SIZE bytes, below an unmapped guard
+ * page). Returns the top of the stack, or 0 if no frame is left.
+ */
+void* kvm_alloc_stack(int i);
@@ -0,0 +1,62 @@
+/*
+ * Local APIC (xAPIC mode : memory-mapped registers, 8-bit APIC IDs).
+ * Every CPU reaches its own local APIC at the same address.
+ */
+
+// Register offsets
+#define LAPIC_ID 0x20 // APIC ID in bits 31:24
+#define LAPIC_EOI 0xb0
+#define LAPIC_SVR 0xf0 // Spurious interrupt vector register
+#define LAPIC_ICR_LOW 0x300 // Interrupt command register
+#define LAPIC_ICR_HIGH 0x310 // Destination in bits 31:24
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INITIAL 0x380 // One-shot mode : writing starts the count
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3e0
+
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_SPURIOUS_VECTOR 0xff
+
+// ICR low bits
+#define ICR_INIT (5 << 8) // Delivery modes
+#define ICR_STARTUP (6 << 8)
+#define ICR_DELIVERY_PENDING (1 << 12)
+#define ICR_ASSERT (1 << 14)
+#define ICR_LEVEL (1 << 15)
+
+// LVT timer bits (vector in bits 7:0)
+#define LVT_MASKED (1 << 16)
+#define LVT_DELIVERY_NMI (4 << 8) // Vector ignored
+#define LVT_TIMER_ONESHOT (0 << 17)
+#define LVT_TIMER_PERIODIC (1 << 17)
+#define LVT_TIMER_TSC_DEADLINE (2 << 17)
+#define TIMER_DIVIDE_16 0x3
+
+extern void* lapic;
+
+/*
+ * Enable the local APIC of the bootstrap processor, at the base given by
+ * IA32_APIC_BASE (the MADT may only repeat it). Usable from the kernel entry
+ * on, through the bootloader's page table : lapic_map keeps it reachable
+ * once kvminit switched to the kernel's own.
+ */
+void lapic_init();
+/*
+ * Map the local APIC registers in the kernel page table (uncached), right
+ * after kvminit. Returns 1 if no frame is left : lapic is then 0.
+ */
+int lapic_map();
+/*
+ * Enable the local APIC of the running CPU (application processors, once
+ * lapic_init ran on the bootstrap processor)
+ */
+void lapic_enable();
+
+unsigned int lapic_read(int reg);
+void lapic_write(int reg, unsigned int value);
+int lapic_id();
+/*
+ * Send an inter-processor interrupt ([icr] : low ICR bits) to the CPU with
+ * APIC ID [apic_id], and wait for its delivery
+ */
+void lapic_send_ipi(int apic_id, unsigned int icr);
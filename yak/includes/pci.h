@@ -0,0 +1,113 @@
+/*
+ * PCI configuration space, through the legacy I/O ports (configuration
+ * mechanism #1) : the address of a 32-bit register is written to
+ * PCI_CONFIG_ADDRESS, then the register is read / written at
+ * PCI_CONFIG_DATA.
+ * +--------+----------+-----+--------+----------+--------+
+ * | Enable | Reserved | Bus | Device | Function | Offset |
+ * +--------+----------+-----+--------+----------+--------+
+ *     31     30    24  23 16 15    11  10      8  7     0
+ * Only bus 0 is scanned (QEMU puts its devices there), and BARs are used
+ * as assigned by the firmware.
+ *
+ * Device interrupts are MSI-X messages, sent straight to a local APIC : a
+ * table in one of the device BARs gives, for each interrupt source, the
+ * address (which APIC) and data (which vector) of the message.
+ */
+
+#define PCI_CONFIG_ADDRESS 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+#define PCI_CONFIG_ENABLE (1u << 31)
+
+#define PCI_DEVICES 32 // Per bus
+#define PCI_FUNCTIONS 8 // Per device
+
+// Configuration space header (type 0)
+#define PCI_VENDOR_ID 0x00
+#define PCI_DEVICE_ID 0x02
+#define PCI_COMMAND 0x04
+#define PCI_STATUS 0x06
+#define PCI_BAR0 0x10 // 6 BARs of 32 bits, 64-bit ones take two
+#define PCI_CAPABILITIES 0x34
+
+#define PCI_VENDOR_NONE 0xffff
+#define PCI_COMMAND_MEMORY (1 << 1) // Respond to memory BAR accesses
+#define PCI_COMMAND_MASTER (1 << 2) // Bus mastering (DMA, MSI)
+#define PCI_COMMAND_INTX_DISABLE (1 << 10)
+#define PCI_STATUS_CAPABILITIES (1 << 4)
+
+#define PCI_BAR_IO (1 << 0)
+#define PCI_BAR_64 (2 << 1) // Memory BAR type
+#define PCI_BAR_TYPE_MASK (3 << 1)
+#define PCI_BAR_ADDR_MASK (~0xfl)
+
+// Capability list : id, next, then the capability itself
+#define PCI_CAP_ID 0
+#define PCI_CAP_NEXT 1
+#define PCI_CAP_VENDOR 0x09
+#define PCI_CAP_MSIX 0x11
+
+// MSI-X capability and table
+#define MSIX_CONTROL 2 // Table size - 1 in bits 10:0
+#define MSIX_TABLE 4 // BAR index in bits 2:0, offset in that BAR above
+#define MSIX_ENABLE (1 << 15)
+#define MSIX_FUNCTION_MASK (1 << 14)
+#define MSIX_SIZE_MASK 0x7ff
+#define MSIX_BIR_MASK 0x7
+
+#define MSIX_ENTRY_SIZE 16
+#define MSIX_ENTRY_ADDR_LOW 0
+#define MSIX_ENTRY_ADDR_HIGH 4
+#define MSIX_ENTRY_DATA 8
+#define MSIX_ENTRY_CONTROL 12
+#define MSIX_ENTRY_MASKED 1
+
+// Message address : fixed delivery, physical destination in bits 19:12
+#define MSI_ADDRESS_BASE 0xfee00000
+#define MSI_DESTINATION_SHIFT 12
+
+typedef struct PciDevice {
+    int bus;
+    int device;
+    int function;
+    unsigned short vendor_id;
+    unsigned short device_id;
+    void* msix_table; // Mapped by the first pci_msix_route, 0 until then
+} PciDevice;
+
+unsigned int pci_read32(PciDevice* dev, int reg);
+unsigned short pci_read16(PciDevice* dev, int reg);
+unsigned char pci_read8(PciDevice* dev, int reg);
+void pci_write32(PciDevice* dev, int reg, unsigned int value);
+void pci_write16(PciDevice* dev, int reg, unsigned short value);
+
+/*
+ * Look for a function with [vendor_id] and [device_id] on bus 0. Returns 1
+ * if there is none.
+ */
+int pci_find(unsigned short vendor_id, unsigned short device_id, PciDevice* dev);
+/*
+ * Offset of the first capability with [id] after the one at [from] (0 : from
+ * the start of the list), 0 if there is none
+ */
+int pci_find_capability(PciDevice* dev, int id, int from);
+/*
+ * Physical address of memory BAR [bar], 0 if it is an I/O BAR or unassigned
+ */
+long pci_bar(PciDevice* dev, int bar);
+/*
+ * Map [size] bytes at [offset] in memory BAR [bar] (uncached). Returns their
+ * address, or 0.
+ */
+void* pci_map_bar(PciDevice* dev, int bar, long offset, long size);
+/*
+ * Let the device access memory and raise MSIs, and disable its legacy INTx
+ * interrupt
+ */
+void pci_enable(PciDevice* dev);
+/*
+ * Route MSI-X table entry [entry] to [vector] on the CPU with APIC ID
+ * [apic_id], then enable MSI-X. Returns 1 if the device has no such entry.
+ * The table is mapped once per device : always pass the same [dev].
+ */
+int pci_msix_route(PciDevice* dev, int entry, int vector, int apic_id);
@@ -0,0 +1,28 @@
+/*
+ * Intel 8253/8254 programmable interval timer, used as a known-frequency
+ * clock before anything better is calibrated.
+ * Channel 2 is used in one-shot mode (its gate and output are wired to port
+ * 0x61 and not to an interrupt line), so that delays work with interrupts
+ * disabled.
+ */
+
+#define PIT_FREQUENCY 1193182 // Hz
+
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND 0x43
+#define PIT_PORT_B 0x61 // Bit 0 : channel 2 gate, bit 1 : speaker, bit 5 : channel 2 output
+
+// Longest delay of a single countdown (16-bit counter)
+#define PIT_MAX_TICKS 0xffff
+
+/*
+ * Busy-wait for at least [us] microseconds
+ */
+void pit_delay_us(long us);
+/*
+ * Single countdown of [ticks] (at most PIT_MAX_TICKS) : pit_countdown is
+ * pit_start then pit_wait
+ */
+void pit_countdown(unsigned int ticks);
+void pit_start(unsigned int ticks);
+void pit_wait();
@@ -0,0 +1,64 @@
+/*
+ * Sampling profiler. While a CPU profiles, its local APIC timer runs in
+ * periodic mode and delivers NMIs (the kernel mostly runs with interrupts
+ * disabled) : each NMI records the interrupted RIP, then the return
+ * addresses found by walking the frame pointer chain, in a per-CPU buffer.
+ * prof_dump writes the buffers to COM1, and tools/prof-fold.c symbolizes
+ * them against target/yak into folded stacks (flamegraph.pl input).
+ *
+ * Buffers only exist in PROFILE builds (`make profile`, which also gives
+ * -fno-omit-frame-pointer : without it, only pcs[0] is meaningful).
+ * Not to be combined with TRACE : both streams go to COM1.
+ *
+ * Stream : for each CPU with samples, a ProfHeader then [samples] records,
+ * each being a ProfSample header followed by [depth] pcs.
+ */
+
+#define PROF_MAGIC 0x504b4159
+#define PROF_HZ 10000 // Default sampling rate
+#define PROF_MAX_DEPTH 32 // pcs per sample, RIP included
+#define PROF_CPUS 8 // CPUs that may profile
+
+#ifdef PROFILE
+#define PROF_SAMPLES 2048 // Per CPU, later samples are dropped
+#else
+#define PROF_SAMPLES 0
+#endif
+
+typedef struct ProfHeader {
+    unsigned int magic;
+    unsigned int cpu;
+    unsigned int samples;
+    unsigned int dropped; // Buffer full
+    long hz;
+} ProfHeader;
+
+typedef struct ProfSample {
+    unsigned int cpu;
+    unsigned int depth;
+    // pcs[0] : interrupted RIP, then return addresses, innermost first
+    long pcs[PROF_MAX_DEPTH];
+} ProfSample;
+
+struct TrapFrame;
+
+/*
+ * Start sampling the running CPU [hz] times per second, once timer_init ran
+ * on it. Returns 1 if the profiler is not built in or the CPU cannot
+ * profile.
+ */
+int prof_start(long hz);
+/*
+ * Stop sampling the running CPU and give the timer back to timer_arm
+ */
+void prof_stop();
+/*
+ * Write the samples of every CPU to COM1, then forget them. No CPU should
+ * be profiling.
+ */
+void prof_dump();
+/*
+ * NMI handler : returns 1 if the running CPU does not profile (the NMI is
+ * not a sample)
+ */
+int prof_nmi(struct TrapFrame* frame);
@@ -0,0 +1,121 @@
+/*
+ * Kernel threads and work-stealing scheduler.
+ *
+ * Each CPU runs a scheduler loop (sched_run) on its own kernel stack, and
+ * switches to a thread, which switches back to the loop to yield, block or
+ * exit. The loop finishes the operation once the thread's registers are
+ * saved (pushing it back, registering it as a joiner, waking its joiner) :
+ * a thread is never made runnable while still running.
+ *
+ * Runnable threads sit in per-CPU Chase-Lev deques : the owner pushes and
+ * pops at the bottom (LIFO, no atomics but a fence on pop), idle CPUs steal
+ * from the top with a CAS. Threads are spawned onto the deque of the running
+ * CPU. A CPU with nothing to run nor steal sleeps with mwait on its own
+ * cache line if the CPU supports it, with hlt otherwise (woken by a
+ * TRAP_WAKEUP IPI), and with the local APIC timer armed for its first
+ * sleeping thread : there is no periodic tick.
+ * Sleeping threads stay on the CPU they went to sleep on, in a list sorted
+ * by deadline.
+ *
+ * A thread is a block of THREAD_STACK_SIZE bytes : the Thread header at its
+ * base, then the stack growing down from its top (no guard page). Blocks
+ * are cached per CPU.
+ */
+
+#define THREAD_STACK_ORDER 2
+#define THREAD_STACK_SIZE (1l << (12 + THREAD_STACK_ORDER))
+
+#define DEQUE_SIZE 256 // Power of two
+#define THREAD_CACHE_SIZE 32
+
+// Thread states, seen by the scheduler loop when the thread switches back
+#define THREAD_RUNNING 0
+#define THREAD_YIELDING 1
+#define THREAD_JOINING 2
+#define THREAD_EXITED 3
+#define THREAD_SLEEPING 4
+#define THREAD_WAITING 5
+
+typedef struct Thread {
+    void* rsp; // Saved by context_switch
+    void (*entry)(void* arg);
+    void* arg;
+    int state;
+    struct Thread* join_target; // THREAD_JOINING
+    struct Thread* volatile joiner; // Thread waiting in thread_join, or JOIN_DONE
+    long wake_at; // THREAD_SLEEPING (ktime_ns)
+    struct Completion* completion; // THREAD_WAITING
+    struct Thread* next; // In the overflow list and the thread caches
+} Thread;
+
+#define JOIN_DONE ((Thread*)1)
+
+/*
+ * One-shot event a single thread can wait for (e.g. the end of a disk
+ * request, see blk.h), signaled from a thread or from the scheduler loop.
+ * Same protocol as thread_join : the waiter only registers itself once its
+ * registers are saved, and whoever comes second makes it runnable.
+ */
+typedef struct Completion {
+    Thread* volatile waiter; // 0, the waiting thread, or COMPLETION_DONE
+} Completion;
+
+#define COMPLETION_DONE ((Thread*)1)
+
+/*
+ * CPUs allowed to steal threads : [0, sched_cpus). Others only run what is
+ * on their own deque. MAX_CPUS (all of them) by default.
+ */
+extern volatile int sched_cpus;
+
+/*
+ * Start a thread running [entry]([arg]) on this CPU's deque. Returns 0 if no
+ * frame is left.
+ * A thread is freed by thread_join, which may be called once : a thread that
+ * is never joined keeps its block.
+ */
+Thread* thread_spawn(void (*entry)(void* arg), void* arg);
+/*
+ * Wait for [thread] to exit, then free it. From a thread only.
+ */
+void thread_join(Thread* thread);
+/*
+ * Let other runnable threads run. From a thread only.
+ */
+void thread_yield();
+/*
+ * Sleep until [deadline] (ktime_ns) / for [ns] nanoseconds at least.
+ * From a thread only.
+ */
+void thread_sleep_until(long deadline);
+void thread_sleep(long ns);
+/*
+ * Arm [completion] / wait until it is signaled (from a thread only) /
+ * signal it. A completion is signaled once per arming.
+ */
+void completion_init(Completion* completion);
+void completion_wait(Completion* completion);
+void completion_done(Completion* completion);
+/*
+ * Same as returning from the entry function
+ */
+void thread_exit() __attribute__((noreturn));
+/*
+ * Running thread, 0 in the scheduler loop
+ */
+Thread* thread_current();
+/*
+ * Scheduler loop, entered by every CPU once it is done booting
+ */
+void sched_run() __attribute__((noreturn));
+
+/*
+ * Callee-saved register switch (switch.s) : save the context of the caller
+ * in *[old_rsp], and resume the one saved in [new_rsp]
+ */
+void context_switch(void** old_rsp, void* new_rsp);
+/*
+ * Initial stack pointer of a context that resumes to [start] on a stack
+ * ending at [stack_top] (16-byte aligned). [start] must not return.
+ */
+void* context_init(void* stack_top, void (*start)());
@@ -0,0 +1,43 @@
+/*
+ * Object caches (slab allocator) on top of kalloc_pages.
+ * A slab is a naturally aligned block of 2^order frames : a small header
+ * followed by objects. There is no per-object header, the slab of an object
+ * is found by masking its address.
+ * Free objects are linked through their first word, in their slab and in
+ * per-CPU lists : alloc / free are O(1), and only take the cache lock to
+ * move a batch of objects between a CPU and the slabs.
+ */
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct KmemCache KmemCache;
+
+/*
+ * Create a cache of objects of [size] bytes, aligned on [align] (a power of
+ * two, 0 for the default). Objects bigger than half a cache line are
+ * cache-line aligned. Returns 0 if no frame is left.
+ */
+KmemCache* kmem_cache_create(long size, long align);
+/*
+ * Returns 0 if no frame is left.
+ */
+void* kmem_cache_alloc(KmemCache* cache);
+void kmem_cache_free(KmemCache* cache, void* obj);
+
+/*
+ * Generic allocations, served by caches of power-of-two sizes from
+ * KMALLOC_MIN to KMALLOC_MAX bytes, naturally aligned up to a cache line.
+ * Bigger allocations should use kalloc_pages.
+ */
+#define KMALLOC_MIN 16
+#define KMALLOC_MAX 2048
+
+void kmem_init();
+/*
+ * Returns 0 if [size] is too big or if no frame is left.
+ */
+void* kmalloc(long size);
+/*
+ * Free an object returned by kmalloc.
+ */
+void kmfree(void* obj);
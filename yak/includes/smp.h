@@ -0,0 +1,58 @@
+/*
+ * Bring-up of the application processors (APs) listed in the MADT.
+ * A STARTUP IPI starts an AP in real mode at a page-aligned address of the
+ * first MiB : the trampoline (ap_boot.s) is copied there with its own page
+ * table, and switches straight to long mode.
+ * +----------------------+ 0xc000
+ * |   Boot PD (0x0b000)  | --> 2 MiB identity leaf : trampoline
+ * +----------------------+
+ * |  Boot PDPT (0x0a000) |
+ * +----------------------+
+ * |  Boot PML4 (0x09000) | --> Kernel half copied from the kernel PML4
+ * +----------------------+
+ * |   Code, GDT, data    | Started at AP_BOOT_ADDR >> 4 : 0
+ * +----------------------+ 0x8000 AP_BOOT_ADDR
+ *
+ * Each AP gets its own guard-paged kernel stack (see kvm.h) and cpus[] entry,
+ * switches to the kernel page table and joins at ap_main once the bootstrap
+ * processor is done starting all of them.
+ */
+
+#define AP_BOOT_ADDR 0x8000 // Should be consistent with ap_boot.s
+#define AP_BOOT_PML4 (AP_BOOT_ADDR + 0x1000)
+#define AP_BOOT_PDPT (AP_BOOT_ADDR + 0x2000)
+#define AP_BOOT_PD (AP_BOOT_ADDR + 0x3000)
+#define AP_BOOT_SIZE 0x4000
+
+#define AP_INIT_DELAY_US 10000
+#define AP_STARTUP_DELAY_US 200
+#define AP_ONLINE_TIMEOUT_US 100000
+
+struct Cpu;
+
+/*
+ * Filled by the bootstrap processor before each STARTUP IPI.
+ * Should be consistent with ap_boot_data (ap_boot.s)
+ */
+typedef struct ApBootData {
+    long cr0;
+    long cr3; // Boot PML4
+    long cr4; // PAE (+ PGE), CR4.PCIDE needs long mode (see kvminit_ap)
+    long efer;
+    void* stack;
+    struct Cpu* cpu; // First argument of entry
+    void (*entry)(struct Cpu* cpu);
+} ApBootData;
+
+// Set once ncpus is final
+extern volatile int smp_ready;
+
+/*
+ * Start every AP, one at a time (bring-up stops at the first one that does
+ * not answer). Runs on the bootstrap processor, after kmem_init.
+ */
+void smp_init();
+/*
+ * Kernel entry of the APs (main.c)
+ */
+void ap_main(struct Cpu* cpu);
@@ -0,0 +1,72 @@
+/*
+ * Spinlocks.
+ * + Spinlock : ticket lock. Arrivals take a ticket and wait for it to be
+ *   served : FIFO, one atomic per acquisition. Every waiter spins on the
+ *   same cache line, which each release invalidates : for short critical
+ *   sections with few waiters.
+ * + McsLock : MCS queued lock. Waiters queue up through their own McsNode
+ *   (on their stack, held until release) and each spins on its node only :
+ *   a release touches the line of the next waiter alone. For contended
+ *   locks.
+ * Interrupt handlers take no lock today (interrupts only end an idle sleep,
+ * see sched.h). The _irqsave variants disable interrupts on this CPU while
+ * the lock is held, for code that may run with interrupts enabled, and give
+ * back the previous RFLAGS.
+ *
+ * Statistics (LOCK_STATS builds, e.g. `make bench BENCH_CFLAGS=-DLOCK_STATS`) :
+ * each lock counts its acquisitions, the contended ones, the cycles spent
+ * waiting for it and the longest hold (rdtsc). A lock registers in
+ * lock_table on its first acquisition : `p *lock_table[0]@lock_count` in
+ * gdb, pointers to global locks show their name.
+ */
+
+#ifdef LOCK_STATS
+#define LOCK_TABLE_SIZE 256
+
+typedef struct LockStats {
+    long acquisitions;
+    long contended; // Acquisitions that had to wait
+    long spin_cycles; // Total, waiting
+    long max_hold_cycles;
+    long acquired_at; // While held
+    int registered;
+} LockStats;
+
+extern LockStats* lock_table[LOCK_TABLE_SIZE];
+extern int lock_count;
+#endif
+
+typedef struct Spinlock {
+    volatile unsigned int next; // Next ticket handed out
+    volatile unsigned int owner; // Ticket being served
+#ifdef LOCK_STATS
+    LockStats stats;
+#endif
+} Spinlock;
+
+typedef struct McsNode {
+    struct McsNode* volatile next; // Next waiter
+    volatile int locked; // Cleared by the previous holder
+} McsNode;
+
+typedef struct McsLock {
+    McsNode* volatile tail; // Last waiter (or holder), 0 if free
+#ifdef LOCK_STATS
+    LockStats stats;
+#endif
+} McsLock;
+
+// For locks not in zeroed memory
+void spinlock_init(Spinlock* lock);
+void acquire(Spinlock* lock);
+void release(Spinlock* lock);
+long acquire_irqsave(Spinlock* lock);
+void release_irqrestore(Spinlock* lock, long rflags);
+
+/*
+ * [node] : any McsNode, the same one for the release
+ */
+void mcs_acquire(McsLock* lock, McsNode* node);
+void mcs_release(McsLock* lock, McsNode* node);
+long mcs_acquire_irqsave(McsLock* lock, McsNode* node);
+void mcs_release_irqrestore(McsLock* lock, McsNode* node, long rflags);
@@ -0,0 +1,55 @@
+/*
+ * Binary event tracing, built with `make trace` (-DTRACE) : otherwise
+ * tracepoints compile to nothing.
+ *
+ * trace() writes a fixed-size record into the ring of the running CPU :
+ * no lock nor atomic, each ring has a single producer (its CPU) and a
+ * single consumer (the drainer thread). Records that do not fit are
+ * dropped and counted.
+ * The drainer streams the rings to COM1 (uart.h), with a TRACE_LOST record
+ * for each gap, and sleeps in between. The stream starts with a
+ * TRACE_HEADER record.
+ * Decode with tools/trace-decode.c (`make trace-decode`).
+ */
+
+#define TRACE_MAGIC 0x544b4159 // "YAKT"
+#define TRACE_RING_SIZE 8192 // Records (power of two)
+#define TRACE_RING_ORDER 6 // 256 KiB of records per CPU
+#define TRACE_DRAIN_INTERVAL_NS 1000000l // 1 ms
+
+/*
+ * Events, with their arguments
+ */
+#define TRACE_HEADER 0 // seq : TRACE_MAGIC, tsc_hz, ktime_tsc_base
+#define TRACE_LOST 1 // Records dropped on this CPU since the last one, 0
+#define TRACE_KALLOC 2 // Frame (0 : out of frames), order
+#define TRACE_KFREE 3 // Frame, order
+#define TRACE_VMMAP 4 // Virtual address, size
+#define TRACE_PT_ALLOC 5 // Table (physical), 1 if splitting a large leaf
+#define TRACE_EVENTS 6
+
+typedef struct TraceRecord {
+    unsigned long tsc;
+    unsigned short event;
+    unsigned short cpu;
+    unsigned int seq; // Per CPU, gaps are lost records
+    long arg0;
+    long arg1;
+} TraceRecord;
+
+#ifdef TRACE
+#define trace(event, arg0, arg1) trace_record(event, (long)(arg0), (long)(arg1))
+#else
+#define trace(event, arg0, arg1) do {} while (0)
+#endif
+
+void trace_record(int event, long arg0, long arg1);
+/*
+ * Allocate the rings of the ncpus CPUs (no record before) and set up the
+ * serial port. Returns 1 if no frame is left.
+ */
+int trace_init();
+/*
+ * Drainer thread (see sched.h)
+ */
+void trace_drain(void* unused);
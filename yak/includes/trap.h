@@ -0,0 +1,86 @@
+/*
+ * Exceptions.
+ * The bootloader's GDT is not mapped once kvminit is done, so the kernel
+ * loads its own, with the same selectors. The IDT has one interrupt gate per
+ * exception vector : each gate points to a stub (trap.s) that builds a
+ * TrapFrame on the stack, saves the SIMD state and calls trap_handler.
+ *
+ * Stack on entry of trap_handler :
+ * +---------------------------+
+ * |            SS             |
+ * |            RSP            |
+ * |          RFLAGS           | Pushed by the CPU
+ * |            CS             |
+ * |            RIP            |
+ * +---------------------------+
+ * |        Error code         | Pushed by the CPU or by the stub (0)
+ * |          Vector           | Pushed by the stub
+ * +---------------------------+
+ * |     RAX, RBX ... R15      | Pushed by trap_common
+ * +---------------------------+ <-- TrapFrame*
+ * |   FXSAVE / XSAVE area     |
+ * +---------------------------+
+ */
+
+#define KERNEL_CS 0x08
+#define KERNEL_DS 0x10
+
+#define TRAP_VECTORS 32 // Exceptions, through trap_handler
+#define IDT_ENTRIES 256
+
+/*
+ * Interrupts, with their own minimal stubs (trap.s) : they only run while a
+ * CPU halts with interrupts enabled (see sched.h)
+ */
+#define TRAP_WAKEUP 0xf0 // IPI waking up an idle CPU
+#define TRAP_TIMER 0xef // Local APIC timer (see ktime.h)
+#define TRAP_BLK 0xee // Disk requests done (MSI-X, see blk.h)
+
+#define TRAP_DE 0 // Divide error
+#define TRAP_DB 1 // Debug
+#define TRAP_NMI 2 // Non-maskable interrupt (profiler samples, see prof.h)
+#define TRAP_BP 3 // Breakpoint
+#define TRAP_UD 6 // Invalid opcode
+#define TRAP_NM 7 // Device not available
+#define TRAP_DF 8 // Double fault
+#define TRAP_GP 13 // General protection
+#define TRAP_PF 14 // Page fault
+#define TRAP_MF 16 // x87 floating point
+#define TRAP_XM 19 // SIMD floating point
+
+// Page fault error code
+#define PF_P (1 << 0) // Protection violation (0 : page not present)
+#define PF_W (1 << 1) // Write access
+#define PF_U (1 << 2) // User mode access
+#define PF_RSVD (1 << 3) // Reserved bit set in an entry
+#define PF_I (1 << 4) // Instruction fetch
+
+typedef struct TrapFrame {
+    long r15, r14, r13, r12, r11, r10, r9, r8;
+    long rbp, rdi, rsi, rdx, rcx, rbx, rax;
+    long vector;
+    long error;
+    long rip, cs, rflags, rsp, ss;
+} TrapFrame;
+
+/*
+ * Frame of the last unhandled exception, and its CR2, for gdb
+ */
+extern TrapFrame trap_fatal_frame;
+extern long trap_fatal_cr2;
+
+/*
+ * Load the kernel GDT and the IDT. Must run before anything may fault, and
+ * after string_init (the size of the saved SIMD state depends on it).
+ */
+void trap_init();
+/*
+ * Load the GDT and IDT built by trap_init on the running CPU (application
+ * processors)
+ */
+void trap_load();
+/*
+ * Called by the stubs. Unhandled exceptions stop the CPU.
+ */
+void trap_handler(TrapFrame* frame);
+long get_cr2();
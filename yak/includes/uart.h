@@ -0,0 +1,24 @@
+/*
+ * 16550 UART on COM1, polled (no interrupts), 115200 baud 8N1.
+ * QEMU captures its output with `-serial file:...` or `-serial stdio`.
+ */
+
+#define COM1 0x3f8
+
+// Register offsets (DLAB = 0, except for the divisor)
+#define UART_DATA 0
+#define UART_IER 1 // Interrupt enable
+#define UART_DIVISOR_LOW 0 // DLAB = 1
+#define UART_DIVISOR_HIGH 1 // DLAB = 1
+#define UART_FCR 2 // FIFO control
+#define UART_LCR 3 // Line control
+#define UART_MCR 4 // Modem control
+#define UART_LSR 5 // Line status
+
+#define UART_LCR_8N1 0x03
+#define UART_LCR_DLAB 0x80
+#define UART_LSR_THR_EMPTY 0x20
+
+void uart_init();
+void uart_putc(char c);
+void uart_write(void* buffer, long size);
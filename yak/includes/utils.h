@@ -1,5 +1,32 @@
-void memcpy(void* dst_, void* src_, long sz);
-void memset(void* dst, char content, long sz);
 int is_aligned(void* addr);
 void* align_up(void* addr);
 
+/*
+ * Read the time-stamp counter
+ */
+long rdtsc();
+
+#define RFLAGS_IF (1l << 9) // Interrupts enabled
+/*
+ * Disable interrupts on this CPU, returning the previous RFLAGS / enable
+ * them again if they were enabled in [rflags]
+ */
+long irq_save();
+void irq_restore(long rflags);
+/*
+ * I/O ports
+ */
+void outb(unsigned short port, unsigned char value);
+unsigned char inb(unsigned short port);
+void outw(unsigned short port, unsigned short value);
+void outl(unsigned short port, unsigned int value);
+unsigned int inl(unsigned short port);
+/*
+ * QEMU's isa-debug-exit device (-device isa-debug-exit,iobase=0xf4) : a
+ * byte written there ends QEMU with exit status (value << 1) | 1
+ */
+#define QEMU_EXIT_PORT 0xf4
+/*
+ * Zero a 4 KiB page with non-temporal stores (bypassing the cache)
+ */
+void zero_page_nt(void* page);
@@ -0,0 +1,151 @@
+/*
+ * Virtio over PCI (virtio 1.x "modern" interface) and split virtqueues.
+ *
+ * Vendor capabilities of the PCI function locate the configuration
+ * structures, each in a range of one of its memory BARs :
+ * + common : feature negotiation, device status, queue setup
+ * + notify : one doorbell per queue, at queue_notify_off * multiplier
+ * + ISR : interrupt status (legacy INTx only, unused with MSI-X)
+ * + device : device-specific configuration (e.g. virtio-blk capacity)
+ *
+ * Split virtqueue of [size] entries, 3 areas in guest memory :
+ * + descriptor table : buffers (physical address, length, flags), chained
+ *   through [next]
+ * + available ring (driver -> device) : heads of the chains to process,
+ *   published by incrementing idx
+ * + used ring (device -> driver) : heads of the processed chains, with the
+ *   number of bytes written
+ * The device is only notified when it asks for it (used flags), and
+ * interrupts the driver once something lands in the used ring.
+ */
+
+#define VIRTIO_VENDOR_ID 0x1af4
+
+// Capability types (cfg_type)
+#define VIRTIO_PCI_CAP_COMMON 1
+#define VIRTIO_PCI_CAP_NOTIFY 2
+#define VIRTIO_PCI_CAP_ISR 3
+#define VIRTIO_PCI_CAP_DEVICE 4
+
+// Device status bits
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER 2
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_FEATURES_OK 8
+#define VIRTIO_STATUS_FAILED 128
+
+#define VIRTIO_F_VERSION_1 (1l << 32)
+#define VIRTIO_MSI_NO_VECTOR 0xffff
+
+typedef struct __attribute__((packed)) VirtioPciCap {
+    unsigned char cap_vndr; // PCI_CAP_VENDOR
+    unsigned char cap_next;
+    unsigned char cap_len;
+    unsigned char cfg_type; // VIRTIO_PCI_CAP_*
+    unsigned char bar;
+    unsigned char id;
+    unsigned char padding[2];
+    unsigned int offset; // In the BAR
+    unsigned int length;
+} VirtioPciCap;
+
+#define VIRTIO_NOTIFY_MULTIPLIER 16 // Right after the capability (notify)
+
+typedef struct VirtioCommonCfg { // Naturally aligned
+    unsigned int device_feature_select;
+    unsigned int device_feature;
+    unsigned int driver_feature_select;
+    unsigned int driver_feature;
+    unsigned short msix_config;
+    unsigned short num_queues;
+    unsigned char device_status;
+    unsigned char config_generation;
+    // Below : queue [queue_select]
+    unsigned short queue_select;
+    unsigned short queue_size;
+    unsigned short queue_msix_vector;
+    unsigned short queue_enable;
+    unsigned short queue_notify_off;
+    // 64-bit addresses, accessed as two 32-bit halves
+    unsigned int queue_desc[2];
+    unsigned int queue_driver[2]; // Available ring
+    unsigned int queue_device[2]; // Used ring
+} VirtioCommonCfg;
+
+typedef struct VirtqDesc {
+    unsigned long addr; // Physical
+    unsigned int len;
+    unsigned short flags;
+    unsigned short next;
+} VirtqDesc;
+
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2 // Written by the device
+
+typedef struct VirtqAvail {
+    unsigned short flags;
+    unsigned short idx;
+    unsigned short ring[];
+} VirtqAvail;
+
+typedef struct VirtqUsedElem {
+    unsigned int id; // Head of the chain
+    unsigned int len; // Bytes written by the device
+} VirtqUsedElem;
+
+typedef struct VirtqUsed {
+    unsigned short flags;
+    unsigned short idx;
+    VirtqUsedElem ring[];
+} VirtqUsed;
+
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
+typedef struct VirtioDevice {
+    PciDevice pci;
+    volatile VirtioCommonCfg* common;
+    void* notify;
+    unsigned int notify_multiplier;
+    void* device_config;
+    unsigned long features; // Negotiated
+} VirtioDevice;
+
+typedef struct Virtq {
+    int size; // Power of two
+    VirtqDesc* desc;
+    volatile VirtqAvail* avail;
+    volatile VirtqUsed* used;
+    volatile unsigned short* doorbell;
+    unsigned short last_used; // Next used entry to look at
+    int index;
+} Virtq;
+
+/*
+ * Map the configuration structures of [pci], reset the device and
+ * negotiate features : VIRTIO_F_VERSION_1, plus those of [wanted] the
+ * device offers. Returns 1 if the device is unusable.
+ */
+int virtio_init(VirtioDevice* dev, PciDevice* pci, unsigned long wanted);
+/*
+ * Set up queue [index] with at most [max_size] entries in a single frame,
+ * its interrupts going to MSI-X entry [msix_entry]. Returns 1 on failure.
+ */
+int virtq_init(VirtioDevice* dev, Virtq* q, int index, int max_size, int msix_entry);
+/*
+ * Let the device run, once its queues are set up
+ */
+void virtio_ready(VirtioDevice* dev);
+/*
+ * Mark the device broken (e.g. after a failed setup step)
+ */
+void virtio_fail(VirtioDevice* dev);
+/*
+ * Offer the chain starting at descriptor [head] to the device, and notify
+ * it unless it asked not to be
+ */
+void virtq_push(Virtq* q, int head);
+/*
+ * Head of the next chain the device is done with (and the bytes it wrote
+ * in [len]), -1 if there is none
+ */
+int virtq_pop(Virtq* q, unsigned int* len);
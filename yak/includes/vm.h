@@ -46,31 +46,194 @@ typedef long TBA; // Table Base Address
 #define PTE_READONLY 0
 #define PTE_READWRITE 1
 
-#define PTE_USER 0
-#define PTE_SUPERVISOR  1
+// U/S = 1 makes the page reachable from ring 3
+#define PTE_USER 1
+#define PTE_SUPERVISOR 0
 
 // Execute disable
 #define PTE_XD 1
 #define PTE_EXECUTABLE 0
 
+/*
+ * Entry bits. An entry is built as a whole 64-bit word :
+ * (physical address & ENTRY_ADDR_MASK) | flags.
+ * All of these are constants so that flag combinations fold at compile time.
+ */
+#define ENTRY_P (1l << 0) // Present
+#define ENTRY_RW (1l << 1) // Writeable
+#define ENTRY_US (1l << 2) // User accessible
+#define ENTRY_PWT (1l << 3) // Page-level write-through
+#define ENTRY_PCD (1l << 4) // Page-level cache disable
+#define ENTRY_A (1l << 5) // Accessed
+#define ENTRY_D (1l << 6) // Dirty (leaves only)
+#define ENTRY_PS (1l << 7) // Page size (PDE / PDPTE leaves)
+#define ENTRY_PAT (1l << 7) // PAT index (PTE only)
+#define ENTRY_G (1l << 8) // Global (leaves only)
+#define ENTRY_PAT_LARGE (1l << 12) // PAT index (PDE / PDPTE leaves)
+#define ENTRY_COW (1l << 9) // Available to software : copy on write (see cow.h)
+#define ENTRY_SHARED (1l << 10) // Available to software : shared, read-only (see cow.h)
+#define ENTRY_XD (1l << 63) // Execute disable
+#define ENTRY_ADDR_MASK 0x000ffffffffff000l
+
+// Flags from the [rw], [us] and [xd] arguments of the functions below
+#define ENTRY_FLAGS(rw, us, xd) \
+    (ENTRY_P | ((long)(rw) << 1) | ((long)(us) << 2) | ((long)(xd) << 63))
+// Turn 4 KiB page flags into 2 MiB / 1 GiB leaf flags (PAT moves to bit 12)
+#define ENTRY_LARGE_FLAGS(flags) \
+    (((flags) & ~ENTRY_PAT) | (((flags) & ENTRY_PAT) << 5) | ENTRY_PS)
+#define MAKE_ENTRY(pa, flags) (((long)(pa) & ENTRY_ADDR_MASK) | (flags))
+
+// Bits of a virtual address translated by each level
+#define PML4E_SHIFT 39
+#define PDPTE_SHIFT 30
+#define PDE_SHIFT 21
+#define PTE_SHIFT 12
+#define ENTRIES_PER_TABLE 512
+
 #define TABLE_SIZE (1 << 12)
 #define PAGE_SIZE (1 << 12)
 #define MEGAPAGE_SIZE (1 << 21)
 #define GIGAPAGE_SIZE (1 << 30)
 
+/*
+ * Set according to CPU features before mapping anything :
+ * + whether 1 GiB leaves may be used
+ * + bits allowed in leaves (XD is reserved without NX support)
+ */
+extern int vm_gigapages;
+extern long vm_entry_mask;
+/*
+ * Set once CR4.PGE / CR4.PCIDE are enabled (see kvminit)
+ */
+extern int vm_global;
+extern int vm_pcid;
+
+#define CR3_NOFLUSH (1l << 63) // Keep the TLB entries of the new PCID
+#define CR4_PAE (1l << 5)
+#define CR4_PGE (1l << 7)
+#define CR4_PCIDE (1l << 17)
+#define PCID_KERNEL 0
+
+struct Spinlock;
+
+/*
+ * Held by every page-table update (see vm.c for the lock order)
+ */
+extern struct Spinlock vm_lock;
+
+/*
+ * TLB invalidations collected by one vmunmap / vmprotect call.
+ * Up to TLB_BATCH_MAX leaves are flushed with one invlpg each, above that
+ * the whole TLB is flushed. Emptied page tables (and with [free_frames],
+ * the frames behind unmapped 4 KiB leaves) are only given back to kalloc
+ * after the flush. Frames may still be mapped by a clone (see cow.h) : they
+ * are queued in [frames], never written to, and a full queue is flushed
+ * right away.
+ */
+#define TLB_BATCH_MAX 32
+
+typedef struct TlbBatch {
+    void* pml4;
+    long count; // Changed leaves (may exceed TLB_BATCH_MAX)
+    long global; // ENTRY_G if a global leaf changed
+    void* pages[TLB_BATCH_MAX];
+    long* tables; // Unlinked tables, linked through their first entry
+    int free_frames;
+    int frame_count;
+    void* frames[TLB_BATCH_MAX];
+} TlbBatch;
+
+void tlb_batch_init(TlbBatch* batch, void* pml4);
+void tlb_batch_add(TlbBatch* batch, void* va, long global);
+void tlb_batch_free_table(TlbBatch* batch, long* table);
+void tlb_batch_free_frame(TlbBatch* batch, void* frame);
+void tlb_batch_flush(TlbBatch* batch);
+
 /*
  * Maps virtual address range from [va] to [va]+[size]
  * to physical address range [pa] -> [pa]+[size].
- * [pml4] is the pml4 address as pointed by CR3.
+ * [pml4] is the address of the PML4 in the direct map (see kvm.h).
  * [rw], [us] and [xd] are the R/W U/S and XD flags of page entries in x86.
- * If this virtual address range is already mapped,
- * fails and returns -1.
+ * The range is extended to whole pages, and mapped with 1 GiB / 2 MiB leaves
+ * wherever [va], [pa] and [size] allow it.
+ * If any page of this virtual address range is already mapped (or if we run
+ * out of frames for page tables), the pages mapped so far are removed and
+ * fails with -1.
  */
 int vmmap(void* pml4, void* va, void* pa, long size, char rw, char us, long xd);
 /*
- * Set CR3 register to setup new page table
+ * Same as vmmap, but leaves are written with [flags] (ENTRY_* bits, as for a
+ * 4 KiB PTE, ENTRY_P included) so that G, PAT, PCD, PWT, A and D can be set.
+ */
+int vmmap_flags(void* pml4, void* va, void* pa, long size, long flags);
+/*
+ * Removes the mappings of [va] -> [va]+[size] (extended to whole pages).
+ * Large leaves crossing the bounds are split, and page tables left empty
+ * are freed. Unmapped ranges are ignored.
+ * Fails with -1 on a non-canonical range, or if we run out of frames to
+ * split a leaf (pages before it are unmapped).
+ */
+int vmunmap(void* pml4, void* va, long size);
+/*
+ * Same as vmunmap, and drops a reference on the frames of the unmapped
+ * 4 KiB pages (kref_put, for pages backed by kalloc'd frames).
+ */
+int vmunmap_free(void* pml4, void* va, long size);
+/*
+ * Sets the R/W, U/S and XD flags of every page mapped in [va] -> [va]+[size]
+ * (extended to whole pages). Same splitting and failures as vmunmap.
+ * Leaves shared with a clone (ENTRY_COW or ENTRY_SHARED, see cow.h) stay
+ * read-only : made writeable, they become ENTRY_COW, and the next write
+ * fault copies them. Made read-only, they become ENTRY_SHARED, so that
+ * write faults are rejected.
+ */
+int vmprotect(void* pml4, void* va, long size, char rw, char us, long xd);
+/*
+ * Returns the leaf entry (4 KiB, 2 MiB or 1 GiB) mapping [va], or 0 if [va]
+ * is not mapped.
+ */
+long* vmwalk(void* pml4, void* va);
+/*
+ * Page table walking helpers, for code that builds its own walk (see cow.c).
+ * [entry] is a PML4E, PDPTE or PDE.
+ */
+int is_intermediate_entry(void* entry);
+// Next table of an intermediate [entry], in the direct map
+void* get_next_tba(void* entry);
+long get_va_table_index(void* va, long shift);
+/*
+ * Replace the 2 MiB / 1 GiB leaf [entry] (spanning 1 << [shift] bytes) by a
+ * table of 512 leaves one level down with the same flags. The TLB is not
+ * flushed. Returns the new table, or 0 if no frame is left.
+ */
+long* split_leaf(long* entry, long shift);
+/*
+ * Write [count] consecutive PTEs at [pt], the first one being [entry] and
+ * the following ones mapping the next physical pages.
+ */
+void fill_PTEs(long* pt, long entry, long count);
+/*
+ * Set CR3 register to setup new page table ([addr] is physical)
  */
 void set_cr3(void* addr);
+/*
+ * Switch to the page table at [addr] (physical). With PCID, TLB entries
+ * tagged with [pcid] are kept : a recycled PCID must be flushed first with
+ * tlb_flush_pcid.
+ */
+void load_cr3(void* addr, long pcid);
+long get_cr3();
+void set_cr4_bits(long bits);
+void invlpg(void* va);
+// [type] : INVPCID_* (see vm.c)
+void invpcid(long type, long pcid, void* va);
+/*
+ * Flush the non-global entries of the current PCID / everything / every
+ * entry tagged with [pcid]
+ */
+void tlb_flush_local();
+void tlb_flush_global();
+void tlb_flush_pcid(long pcid);
 /*
  * Set NXE bit of the EFER register to 1 (enable XD feature)
  */
@@ -0,0 +1,110 @@
+#include "acpi.h"
+#include "cpu.h"
+#include "kvm.h"
+#include "string_ops.h"
+#include "vm.h"
+
+#define EBDA_SEGMENT_PTR 0x40e // BIOS data area : segment of the EBDA
+#define BIOS_AREA_START 0xe0000
+#define BIOS_AREA_END 0x100000
+
+int acpi_ncpus;
+int acpi_apic_ids[MAX_CPUS];
+long acpi_lapic_base;
+
+#define ACPI_FLAGS KERNEL_FLAGS(PTE_READONLY, PTE_XD)
+
+int acpi_checksum(void* start, long size) {
+    unsigned char sum = 0;
+    for (long i=0; i<size; i++)
+        sum += ((unsigned char*)start)[i];
+    return sum;
+}
+
+Rsdp* rsdp_scan(long start, long end) {
+    /*
+     * The RSDP lies on a 16-byte boundary
+     */
+    void* area = kvm_map_phys(start, end-start, ACPI_FLAGS);
+    if (area == 0)
+        return 0;
+    for (long offset=0; offset+sizeof(Rsdp)<=end-start; offset+=16) {
+        Rsdp* rsdp = area + offset;
+        if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0 && acpi_checksum(rsdp, 20) == 0)
+            return rsdp;
+    }
+    return 0;
+}
+
+Rsdp* find_rsdp() {
+    // First KiB of the EBDA, then the BIOS read-only area
+    unsigned short* ebda_segment = kvm_map_phys(EBDA_SEGMENT_PTR, 2, ACPI_FLAGS);
+    if (ebda_segment != 0 && *ebda_segment != 0) {
+        long ebda = (long)*ebda_segment << 4;
+        Rsdp* rsdp = rsdp_scan(ebda, ebda + 0x400);
+        if (rsdp != 0)
+            return rsdp;
+    }
+    return rsdp_scan(BIOS_AREA_START, BIOS_AREA_END);
+}
+
+SdtHeader* map_table(long pa) {
+    /*
+     * Map the header first to learn the size of the table, then check it
+     */
+    SdtHeader* table = kvm_map_phys(pa, sizeof(SdtHeader), ACPI_FLAGS);
+    if (table == 0 || kvm_map_phys(pa, table->length, ACPI_FLAGS) == 0)
+        return 0;
+    if (acpi_checksum(table, table->length) != 0)
+        return 0;
+    return table;
+}
+
+SdtHeader* find_table(Rsdp* rsdp, char* signature) {
+    // XSDT entries are 64-bit, RSDT entries 32-bit
+    int xsdt = rsdp->revision >= 2 && rsdp->xsdt != 0;
+    int entry_size = xsdt ? 8 : 4;
+    SdtHeader* root = map_table(xsdt ? rsdp->xsdt : rsdp->rsdt);
+    if (root == 0)
+        return 0;
+
+    int count = (root->length - sizeof(SdtHeader)) / entry_size;
+    void* entries = (void*)root + sizeof(SdtHeader);
+    for (int i=0; i<count; i++) {
+        long pa = xsdt ? *(long*)(entries + i*8) : *(unsigned int*)(entries + i*4);
+        SdtHeader* table = map_table(pa);
+        if (table != 0 && memcmp(table->signature, signature, 4) == 0)
+            return table;
+    }
+    return 0;
+}
+
+int acpi_init() {
+    Rsdp* rsdp = find_rsdp();
+    if (rsdp == 0)
+        return 1;
+    SdtHeader* madt = find_table(rsdp, "APIC");
+    if (madt == 0)
+        return 1;
+
+    acpi_ncpus = 0;
+    acpi_lapic_base = *(unsigned int*)((void*)madt + sizeof(SdtHeader));
+
+    // Entries : type (1 byte), length (1 byte), data
+    void* end = (void*)madt + madt->length;
+    for (unsigned char* entry = (void*)madt + sizeof(SdtHeader) + 8;
+         (void*)entry + 2 <= end && entry[1] >= 2;
+         entry += entry[1]) {
+        if (entry[0] == MADT_LOCAL_APIC) {
+            // ACPI processor UID, APIC ID, flags (32 bits)
+            unsigned int flags = *(unsigned int*)(entry + 4);
+            if (!(flags & (MADT_ENABLED | MADT_ONLINE_CAPABLE)) || acpi_ncpus == MAX_CPUS)
+                continue;
+            acpi_apic_ids[acpi_ncpus++] = entry[3];
+        } else if (entry[0] == MADT_LAPIC_OVERRIDE) {
+            // Reserved (16 bits), base (64 bits)
+            acpi_lapic_base = *(long*)(entry + 4);
+        }
+    }
+    return acpi_ncpus == 0;
+}
@@ -0,0 +1,77 @@
+; Application processor trampoline (see smp.h)
+; Copied to AP_BOOT_ADDR by the bootstrap processor, which fills ap_boot_data
+; before each STARTUP IPI. The AP starts here in real mode, with CS:IP =
+; (AP_BOOT_ADDR >> 4):0. Never runs in place : kept in .rodata.
+
+AP_BOOT_ADDR equ 0x8000 ; Should be consistent with smp.h
+
+; Address of a label once copied
+%define AP_ADDR(label) (label - ap_boot_start + AP_BOOT_ADDR)
+
+global ap_boot_start
+global ap_boot_data
+global ap_boot_end
+
+section .rodata
+
+bits 16
+ap_boot_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [AP_ADDR(ap_boot_gdtr)]
+
+    ; Straight from real mode to long mode : CR4.PAE, boot PML4, EFER.LME,
+    ; then CR0.PG and CR0.PE at once
+    mov eax, [AP_ADDR(ap_boot_data.cr4)]
+    mov cr4, eax
+    mov eax, [AP_ADDR(ap_boot_data.cr3)]
+    mov cr3, eax
+    mov ecx, 0xc0000080 ; EFER
+    mov eax, [AP_ADDR(ap_boot_data.efer)]
+    xor edx, edx
+    wrmsr
+    mov eax, [AP_ADDR(ap_boot_data.cr0)]
+    mov cr0, eax
+    jmp dword 0x08:AP_ADDR(ap_boot_64)
+
+bits 64
+ap_boot_64:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    xor ax, ax
+    mov fs, ax
+    mov gs, ax
+
+    ; ap_main(cpu), on the kernel stack of this AP
+    mov rsp, [AP_ADDR(ap_boot_data.stack)]
+    mov rdi, [AP_ADDR(ap_boot_data.cpu)]
+    mov rax, [AP_ADDR(ap_boot_data.entry)]
+    push 0 ; No return address
+    xor rbp, rbp
+    jmp rax
+
+align 8
+ap_boot_gdt:
+    dq 0 ; Null segment descriptor
+    dq 0x00af9a000000ffff ; 0x08 : code, L=1 D=0
+    dq 0x00cf92000000ffff ; 0x10 : data, writeable
+ap_boot_gdtr:
+    dw ap_boot_gdtr - ap_boot_gdt - 1
+    dd AP_ADDR(ap_boot_gdt)
+
+; Should be consistent with ApBootData (smp.h)
+align 8
+ap_boot_data:
+    .cr0: dq 0
+    .cr3: dq 0
+    .cr4: dq 0
+    .efer: dq 0
+    .stack: dq 0
+    .cpu: dq 0
+    .entry: dq 0
+
+ap_boot_end:
@@ -0,0 +1,297 @@
+#include "kalloc.h"
+#include "sched.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "blk.h"
+#include "bcache.h"
+
+/*
+ * Everything below is protected by bcache_lock, but the data of held
+ * buffers. The lock is never held across a request.
+ */
+Buf* bcache_hash[BCACHE_HASH];
+Buf* lru_head;
+Buf* lru_tail;
+long bcache_count;
+long bcache_next_miss = -1; // Block right after the last miss
+Spinlock bcache_lock;
+
+BcacheStats bcache_stats;
+
+Buf** bcache_bucket(long block) {
+    // Fibonacci hashing : consecutive blocks spread over the buckets
+    return &bcache_hash[((unsigned long)block * 0x9e3779b97f4a7c15ul) >> (64 - BCACHE_HASH_BITS)];
+}
+
+Buf* bcache_lookup(long block) {
+    for (Buf* buf=*bcache_bucket(block); buf!=0; buf=buf->hash_next) {
+        if (buf->block == block)
+            return buf;
+    }
+    return 0;
+}
+
+void hash_remove(Buf* buf) {
+    for (Buf** prev=bcache_bucket(buf->block); *prev!=0; prev=&(*prev)->hash_next) {
+        if (*prev == buf) {
+            *prev = buf->hash_next;
+            break;
+        }
+    }
+    buf->block = -1;
+}
+
+void lru_remove(Buf* buf) {
+    if (buf->lru_prev != 0)
+        buf->lru_prev->lru_next = buf->lru_next;
+    else
+        lru_head = buf->lru_next;
+    if (buf->lru_next != 0)
+        buf->lru_next->lru_prev = buf->lru_prev;
+    else
+        lru_tail = buf->lru_prev;
+}
+
+void lru_push(Buf* buf) {
+    buf->lru_prev = 0;
+    buf->lru_next = lru_head;
+    if (lru_head != 0)
+        lru_head->lru_prev = buf;
+    else
+        lru_tail = buf;
+    lru_head = buf;
+}
+
+Buf* bcache_new() {
+    Buf* buf = kmalloc(sizeof(Buf));
+    void* data = kalloc();
+    if (buf == 0 || data == 0) {
+        if (buf != 0)
+            kmfree(buf);
+        if (data != 0)
+            kfree(data);
+        return 0;
+    }
+    buf->data = data;
+    buf->block = -1;
+    bcache_count++;
+    lru_push(buf);
+    return buf;
+}
+
+Buf* bcache_claim(long block, int refs) {
+    /*
+     * Take a buffer for [block] (not cached), with a read to be queued
+     * (BUF_IO). Returns 0 if every buffer is held, dirty or busy.
+     */
+    Buf* buf = 0;
+    if (bcache_count < BCACHE_BUFFERS)
+        buf = bcache_new();
+    for (Buf* b=lru_tail; b!=0 && buf==0; b=b->lru_prev) {
+        if (b->refs == 0 && !(b->flags & (BUF_DIRTY | BUF_IO)))
+            buf = b;
+    }
+    if (buf == 0)
+        return 0;
+
+    if (buf->block >= 0)
+        hash_remove(buf);
+    buf->block = block;
+    buf->flags = BUF_IO;
+    buf->refs = refs;
+    Buf** bucket = bcache_bucket(block);
+    buf->hash_next = *bucket;
+    *bucket = buf;
+    lru_remove(buf);
+    lru_push(buf);
+    return buf;
+}
+
+void bcache_request(Buf* buf, int type) {
+    BlkRequest* req = &buf->req;
+    req->type = type;
+    req->sector = buf->block * BCACHE_SECTORS;
+    req->buffer = buf->data;
+    req->size = BCACHE_BLOCK_SIZE;
+    req->end = 0;
+    req->private = buf;
+}
+
+void bcache_read_done(Buf* buf, int status) {
+    // A failed read leaves the cache : the next bread tries again
+    acquire(&bcache_lock);
+    if (status == BLK_OK) {
+        buf->flags = BUF_VALID;
+    } else {
+        hash_remove(buf);
+        buf->flags = 0;
+    }
+    release(&bcache_lock);
+}
+
+void bcache_readahead_end(BlkRequest* req) {
+    bcache_read_done(req->private, req->status);
+}
+
+void bcache_readahead(long block) {
+    for (long b=block; b<block+BCACHE_READAHEAD && (b+1)*BCACHE_SECTORS<=blk_sectors; b++) {
+        acquire(&bcache_lock);
+        Buf* buf = 0;
+        if (bcache_lookup(b) == 0) {
+            buf = bcache_claim(b, 0);
+            if (buf == 0) {
+                release(&bcache_lock);
+                return;
+            }
+            bcache_stats.readaheads++;
+        }
+        release(&bcache_lock);
+        if (buf == 0)
+            continue;
+
+        bcache_request(buf, BLK_READ);
+        buf->req.end = bcache_readahead_end;
+        // No slot left : not worth waiting for
+        if (blk_submit(&buf->req) != 0) {
+            bcache_read_done(buf, BLK_IOERR);
+            return;
+        }
+    }
+}
+
+long bcache_writeback() {
+    /*
+     * Write the dirty buffers back, least recently released first, BLK_SLOTS
+     * requests at a time. Buffers written to while their request is in
+     * flight stay dirty. Returns the number of blocks written, -1 if a write
+     * failed.
+     */
+    Buf* batch[BLK_SLOTS];
+    long written = 0;
+
+    while (1) {
+        int n = 0;
+        acquire(&bcache_lock);
+        for (Buf* buf=lru_tail; buf!=0 && n<BLK_SLOTS; buf=buf->lru_prev) {
+            if ((buf->flags & (BUF_DIRTY | BUF_IO)) == BUF_DIRTY) {
+                buf->flags = (buf->flags & ~BUF_DIRTY) | BUF_IO;
+                buf->refs++;
+                batch[n++] = buf;
+            }
+        }
+        release(&bcache_lock);
+        if (n == 0)
+            return written;
+
+        int queued[BLK_SLOTS];
+        for (int i=0; i<n; i++) {
+            bcache_request(batch[i], BLK_WRITE);
+            while ((queued[i] = blk_submit(&batch[i]->req)) == 1)
+                thread_yield();
+        }
+
+        int failed = 0;
+        for (int i=0; i<n; i++) {
+            int status = BLK_IOERR;
+            if (queued[i] == 0) {
+                blk_wait(&batch[i]->req);
+                status = batch[i]->req.status;
+            }
+            acquire(&bcache_lock);
+            batch[i]->flags &= ~BUF_IO;
+            if (status != BLK_OK) {
+                batch[i]->flags |= BUF_DIRTY;
+                failed = 1;
+            }
+            bcache_stats.writebacks++;
+            release(&bcache_lock);
+            brelse(batch[i]);
+        }
+        if (failed)
+            return -1;
+        written += n;
+    }
+}
+
+Buf* bread(long block) {
+    if (blk_sectors == 0 || block < 0 || (block+1)*BCACHE_SECTORS > blk_sectors)
+        return 0;
+
+    Buf* buf;
+    int sequential;
+    while (1) {
+        acquire(&bcache_lock);
+        buf = bcache_lookup(block);
+        if (buf != 0) {
+            buf->refs++;
+            bcache_stats.hits++;
+            release(&bcache_lock);
+            // Being read by someone else, or read ahead
+            while ((buf->flags & (BUF_VALID | BUF_IO)) == BUF_IO)
+                thread_yield();
+            if (buf->flags & BUF_VALID)
+                return buf;
+            brelse(buf);
+            return 0;
+        }
+
+        buf = bcache_claim(block, 1);
+        if (buf != 0) {
+            bcache_stats.misses++;
+            sequential = block == bcache_next_miss;
+            bcache_next_miss = block + 1;
+            release(&bcache_lock);
+            break;
+        }
+        release(&bcache_lock);
+        // Only dirty buffers to reuse
+        if (bcache_writeback() <= 0)
+            return 0;
+    }
+
+    // Our block first, then the next ones
+    bcache_request(buf, BLK_READ);
+    int queued;
+    while ((queued = blk_submit(&buf->req)) == 1)
+        thread_yield();
+    if (sequential)
+        bcache_readahead(block + 1);
+
+    int status = BLK_IOERR;
+    if (queued == 0) {
+        blk_wait(&buf->req);
+        status = buf->req.status;
+    }
+    bcache_read_done(buf, status);
+    if (status != BLK_OK) {
+        brelse(buf);
+        return 0;
+    }
+    return buf;
+}
+
+void bwrite(Buf* buf) {
+    acquire(&bcache_lock);
+    buf->flags |= BUF_DIRTY;
+    release(&bcache_lock);
+}
+
+void brelse(Buf* buf) {
+    acquire(&bcache_lock);
+    if (--buf->refs == 0) {
+        lru_remove(buf);
+        lru_push(buf);
+    }
+    release(&bcache_lock);
+}
+
+int bflush() {
+    int ret = bcache_writeback() < 0;
+    if (blk_can_flush) {
+        BlkRequest req;
+        req.type = BLK_FLUSH;
+        if (blk_io(&req) != BLK_OK)
+            ret = 1;
+    }
+    return ret;
+}
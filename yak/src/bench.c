@@ -0,0 +1,408 @@
+#include "cpu.h"
+#include "bench.h"
+#include "string_ops.h"
+#include "utils.h"
+#include "demand.h"
+#include "kalloc.h"
+#include "ktime.h"
+#include "kvm.h"
+#include "sched.h"
+#include "blk.h"
+#include "bcache.h"
+#include "uart.h"
+#include "vm.h"
+
+#define BENCH_KALLOC_BATCH 64
+#define BENCH_KALLOC_ROUNDS 4096
+#define BENCH_STRING_BYTES (16l << 20) // Per size and variant
+#define BENCH_FAULT_PAGES 4096
+#define BENCH_SWITCH_ROUNDS 1000000
+
+BenchKallocResult bench_kalloc_results[MAX_CPUS];
+BenchStringResult bench_string_results[BENCH_STRING_SIZES];
+BenchFaultResult bench_fault_result;
+BenchSwitchResult bench_switch_result;
+BenchSchedResult bench_sched_results[MAX_CPUS];
+volatile int bench_sched_done;
+BenchBlkResult bench_blk_results[BENCH_BLK_DEPTHS];
+BenchBlkCheck bench_blk_check_result;
+volatile int bench_blk_done;
+BenchReport bench_report_data;
+
+void* bench_frames[MAX_CPUS][BENCH_KALLOC_BATCH];
+long bench_cycles[MAX_CPUS];
+
+volatile int barrier_count;
+volatile int barrier_generation;
+
+void bench_barrier() {
+    /*
+     * Wait for every running CPU
+     */
+    int generation = barrier_generation;
+    if (__atomic_add_fetch(&barrier_count, 1, __ATOMIC_ACQ_REL) == ncpus) {
+        barrier_count = 0;
+        __atomic_store_n(&barrier_generation, generation+1, __ATOMIC_RELEASE);
+    } else {
+        while (barrier_generation == generation) {
+            asm volatile("pause");
+        }
+    }
+}
+
+void bench_kalloc() {
+    int cpu = cpu_id();
+    void** frames = bench_frames[cpu];
+
+    for (int n=1; n<=ncpus; n++) {
+        bench_barrier();
+
+        if (cpu < n) {
+            long start = rdtsc();
+            for (int round=0; round<BENCH_KALLOC_ROUNDS; round++) {
+                for (int i=0; i<BENCH_KALLOC_BATCH; i++) {
+                    frames[i] = kalloc();
+                }
+                for (int i=0; i<BENCH_KALLOC_BATCH; i++) {
+                    kfree(frames[i]);
+                }
+            }
+            bench_cycles[cpu] = rdtsc() - start;
+        }
+
+        bench_barrier();
+
+        if (cpu == 0) {
+            BenchKallocResult* result = &bench_kalloc_results[n-1];
+            result->cpus = n;
+            result->frames = (long)n * BENCH_KALLOC_ROUNDS * BENCH_KALLOC_BATCH;
+            result->cycles = 0;
+            for (int i=0; i<n; i++) {
+                if (bench_cycles[i] > result->cycles) {
+                    result->cycles = bench_cycles[i];
+                }
+            }
+        }
+    }
+}
+
+void bench_string() {
+    void (*copies[])(void*, void*, long) = {
+        memcpy_scalar, memcpy_erms, memcpy_sse2, memcpy_avx2
+    };
+    void (*sets[])(void*, char, long) = {
+        memset_scalar, memset_erms, memset_sse2, memset_avx2
+    };
+    int supported[] = {
+        1,
+        string_features & STRING_ERMS,
+        string_features & STRING_SSE2,
+        string_features & STRING_AVX2
+    };
+
+    if (cpu_id() != 0) {
+        bench_barrier();
+        return;
+    }
+
+    void* src = kalloc_pages(MEGAPAGE_ORDER);
+    void* dst = kalloc_pages(MEGAPAGE_ORDER);
+
+    for (int i=0; i<BENCH_STRING_SIZES && src != 0 && dst != 0; i++) {
+        BenchStringResult* result = &bench_string_results[i];
+        long size = 16l << i;
+        long iterations = BENCH_STRING_BYTES / size;
+        result->size = size;
+        result->bytes = iterations * size;
+
+        for (int v=0; v<BENCH_STRING_VARIANTS; v++) {
+            result->memcpy_cycles[v] = 0;
+            result->memset_cycles[v] = 0;
+            if (!supported[v]) {
+                continue;
+            }
+
+            long start = rdtsc();
+            for (long j=0; j<iterations; j++) {
+                copies[v](dst, src, size);
+            }
+            result->memcpy_cycles[v] = rdtsc() - start;
+
+            start = rdtsc();
+            for (long j=0; j<iterations; j++) {
+                sets[v](dst, j, size);
+            }
+            result->memset_cycles[v] = rdtsc() - start;
+        }
+    }
+
+    if (src != 0) {
+        kfree_pages(src, MEGAPAGE_ORDER);
+    }
+    if (dst != 0) {
+        kfree_pages(dst, MEGAPAGE_ORDER);
+    }
+    bench_barrier();
+}
+
+void bench_fault() {
+    if (cpu_id() == 0) {
+        BenchFaultResult* result = &bench_fault_result;
+        volatile char* region = DEMAND_BASE;
+        result->pages = BENCH_FAULT_PAGES;
+
+        if (vmmap_demand(PML4, DEMAND_BASE, BENCH_FAULT_PAGES * PAGE_SIZE, PTE_READWRITE, PTE_SUPERVISOR, PTE_XD) == 0) {
+            long start = rdtsc();
+            for (long i=0; i<BENCH_FAULT_PAGES; i++)
+                region[i * PAGE_SIZE] = 1;
+            result->first_touch_cycles = rdtsc() - start;
+
+            start = rdtsc();
+            for (long i=0; i<BENCH_FAULT_PAGES; i++)
+                region[i * PAGE_SIZE] = 2;
+            result->second_touch_cycles = rdtsc() - start;
+
+            vmunmap_demand(PML4, DEMAND_BASE);
+        }
+    }
+
+    bench_barrier();
+}
+
+void* bench_main_rsp;
+void* bench_helper_rsp;
+
+void bench_switch_helper() {
+    while (1)
+        context_switch(&bench_helper_rsp, bench_main_rsp);
+}
+
+void bench_tree(void* arg) {
+    long depth = (long)arg;
+    if (depth == 0)
+        return;
+
+    Thread* left = thread_spawn(bench_tree, (void*)(depth-1));
+    Thread* right = thread_spawn(bench_tree, (void*)(depth-1));
+    // Out of frames : do the work here
+    if (left == 0)
+        bench_tree((void*)(depth-1));
+    else
+        thread_join(left);
+    if (right == 0)
+        bench_tree((void*)(depth-1));
+    else
+        thread_join(right);
+}
+
+void bench_sched_driver(void* unused) {
+    BenchSwitchResult* result = &bench_switch_result;
+    result->rounds = BENCH_SWITCH_ROUNDS;
+
+    void* stack = kalloc_pages(THREAD_STACK_ORDER);
+    if (stack != 0) {
+        bench_helper_rsp = context_init(stack + THREAD_STACK_SIZE, bench_switch_helper);
+        long start = rdtsc();
+        for (long i=0; i<BENCH_SWITCH_ROUNDS; i++)
+            context_switch(&bench_main_rsp, bench_helper_rsp);
+        result->switch_cycles = rdtsc() - start;
+        kfree_pages(stack, THREAD_STACK_ORDER);
+    }
+
+    long start = rdtsc();
+    for (long i=0; i<BENCH_SWITCH_ROUNDS; i++)
+        thread_yield();
+    result->yield_cycles = rdtsc() - start;
+
+    for (int n=1; n<=ncpus; n++) {
+        BenchSchedResult* tree = &bench_sched_results[n-1];
+        sched_cpus = n;
+
+        start = rdtsc();
+        bench_tree((void*)(long)BENCH_SCHED_DEPTH);
+        tree->cycles = rdtsc() - start;
+        tree->cpus = n;
+        tree->threads = (2l << BENCH_SCHED_DEPTH) - 2;
+    }
+
+    sched_cpus = MAX_CPUS;
+    bench_sched_done = 1;
+}
+
+void bench_sched() {
+    // Other CPUs may not steal the driver before sched_cpus is set
+    if (cpu_id() == 0) {
+        sched_cpus = 1;
+        thread_spawn(bench_sched_driver, 0);
+    }
+    bench_barrier();
+}
+
+BlkRequest bench_blk_requests[BLK_SLOTS];
+
+long bench_blk_run(void* buffers, int depth, int type, long size, int random) {
+    /*
+     * Cycles for BENCH_BLK_REQUESTS requests of [size] bytes, [depth] of them
+     * in flight, 0 if they are refused. Request i % depth reuses slice i %
+     * depth of [buffers].
+     */
+    long sectors = size / BLK_SECTOR_SIZE;
+    long positions = blk_sectors / sectors;
+    unsigned long seed = 0x2545f4914f6cdd1d;
+    long issued = 0;
+    int failed = 0;
+
+    long start = rdtsc();
+    for (long done=0; done<BENCH_BLK_REQUESTS; done++) {
+        // Keep [depth] requests in flight, then wait for the oldest
+        while (issued < BENCH_BLK_REQUESTS && issued < done + depth && !failed) {
+            BlkRequest* req = &bench_blk_requests[issued % depth];
+            long position = issued;
+            if (random) {
+                seed ^= seed << 13;
+                seed ^= seed >> 7;
+                seed ^= seed << 17;
+                position = seed;
+            }
+            req->type = type;
+            req->sector = (position % positions) * sectors;
+            req->buffer = buffers + (issued % depth) * size;
+            req->size = size;
+            req->end = 0;
+            if (blk_submit(req) != 0)
+                failed = 1;
+            else
+                issued++;
+        }
+        if (done == issued)
+            break;
+        blk_wait(&bench_blk_requests[done % depth]);
+    }
+    long cycles = rdtsc() - start;
+    return failed ? 0 : cycles;
+}
+
+long bench_blk_check_block(int i) {
+    long blocks = blk_sectors / BCACHE_SECTORS;
+    long half = BENCH_BLK_CHECK_BLOCKS / 2;
+    if (i < half)
+        return i;
+    return half + (i - half) * ((blocks - half) / half);
+}
+
+long bench_blk_check_word(long block, long i) {
+    return (block * 0x9e3779b97f4a7c15l) ^ i;
+}
+
+int bench_blk_compare(Buf* buf, void* raw) {
+    /*
+     * 0 if [buf] holds what the disk holds ([raw]) and, on a writeable
+     * disk, what bench_blk_check wrote
+     */
+    long* words = buf->data;
+    if (memcmp(words, raw, BCACHE_BLOCK_SIZE) != 0)
+        return 1;
+    for (long i=0; i<BCACHE_BLOCK_SIZE/8 && !blk_read_only; i++) {
+        if (words[i] != bench_blk_check_word(buf->block, i))
+            return 1;
+    }
+    return 0;
+}
+
+void bench_blk_check(void* raw) {
+    BenchBlkCheck* result = &bench_blk_check_result;
+    if (blk_sectors / BCACHE_SECTORS < 2 * BENCH_BLK_CHECK_BLOCKS)
+        return;
+
+    for (int i=0; i<BENCH_BLK_CHECK_BLOCKS && !blk_read_only; i++) {
+        Buf* buf = bread(bench_blk_check_block(i));
+        if (buf == 0) {
+            result->errors++;
+            continue;
+        }
+        long* words = buf->data;
+        for (long j=0; j<BCACHE_BLOCK_SIZE/8; j++)
+            words[j] = bench_blk_check_word(buf->block, j);
+        bwrite(buf);
+        brelse(buf);
+    }
+    if (!blk_read_only && bflush() != 0)
+        result->errors++;
+
+    for (int i=0; i<BENCH_BLK_CHECK_BLOCKS; i++) {
+        long block = bench_blk_check_block(i);
+        BlkRequest req;
+        req.type = BLK_READ;
+        req.sector = block * BCACHE_SECTORS;
+        req.buffer = raw;
+        req.size = BCACHE_BLOCK_SIZE;
+        req.end = 0;
+        Buf* buf = bread(block);
+        if (blk_io(&req) != BLK_OK || buf == 0 || bench_blk_compare(buf, raw) != 0)
+            result->errors++;
+        if (buf != 0)
+            brelse(buf);
+        result->blocks++;
+    }
+}
+
+void bench_blk_driver(void* unused) {
+    // Alone on the disk and the CPUs
+    while (!bench_sched_done)
+        thread_sleep(1000000);
+
+    // BLK_SLOTS * 64 KiB
+    void* buffers = kalloc_pages(MEGAPAGE_ORDER);
+    if (buffers != 0 && blk_sectors != 0) {
+        bench_blk_check(buffers);
+        for (int i=0; i<BENCH_BLK_DEPTHS; i++) {
+            BenchBlkResult* result = &bench_blk_results[i];
+            int depth = 1 << i;
+            result->depth = depth;
+            result->requests = BENCH_BLK_REQUESTS;
+            result->random_read_cycles = bench_blk_run(buffers, depth, BLK_READ, BENCH_BLK_RANDOM_SIZE, 1);
+            result->sequential_read_cycles = bench_blk_run(buffers, depth, BLK_READ, BENCH_BLK_SEQUENTIAL_SIZE, 0);
+            if (!blk_read_only)
+                result->random_write_cycles = bench_blk_run(buffers, depth, BLK_WRITE, BENCH_BLK_RANDOM_SIZE, 1);
+        }
+    }
+    if (buffers != 0)
+        kfree_pages(buffers, MEGAPAGE_ORDER);
+    bench_blk_done = 1;
+}
+
+void bench_blk() {
+    if (cpu_id() == 0)
+        thread_spawn(bench_blk_driver, 0);
+    bench_barrier();
+}
+
+void bench_report_driver(void* unused) {
+    // bench_blk starts once bench_sched is done
+    while (!bench_blk_done)
+        thread_sleep(1000000);
+
+    BenchReport* report = &bench_report_data;
+    report->magic = BENCH_REPORT_MAGIC;
+    report->size = sizeof(BenchReport);
+    report->tsc_hz = tsc_hz;
+    report->ncpus = ncpus;
+    memcpy(report->kalloc, bench_kalloc_results, sizeof(report->kalloc));
+    memcpy(report->string, bench_string_results, sizeof(report->string));
+    report->sched_switch = bench_switch_result;
+    memcpy(report->sched, bench_sched_results, sizeof(report->sched));
+    report->fault = bench_fault_result;
+    report->blk_check = bench_blk_check_result;
+    memcpy(report->blk, bench_blk_results, sizeof(report->blk));
+
+    uart_init();
+    uart_write(report, sizeof(BenchReport));
+    // Exit status (value << 1) | 1
+    outb(QEMU_EXIT_PORT, 0);
+}
+
+void bench_report() {
+    if (cpu_id() == 0)
+        thread_spawn(bench_report_driver, 0);
+    bench_barrier();
+}
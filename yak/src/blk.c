@@ -0,0 +1,191 @@
+#include "kalloc.h"
+#include "kvm.h"
+#include "lapic.h"
+#include "pci.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "trap.h"
+#include "virtio.h"
+#include "blk.h"
+
+#define VIRTIO_BLK_DEVICE_ID 0x1042
+#define VIRTIO_BLK_TRANSITIONAL_ID 0x1001 // Also has the legacy interface
+
+#define VIRTIO_BLK_F_RO (1l << 5)
+#define VIRTIO_BLK_F_FLUSH (1l << 9)
+
+#define BLK_DESCS_PER_SLOT 3
+#define BLK_MSIX_ENTRY 0
+
+/*
+ * Device-visible part of a slot : slot i owns descriptors 3i (header),
+ * 3i+1 (data) and 3i+2 (status)
+ */
+struct BlkSlot {
+    unsigned int type;
+    unsigned int reserved;
+    unsigned long sector;
+    volatile unsigned char status;
+    BlkRequest* req;
+};
+
+VirtioDevice blk_dev;
+Virtq blk_queue;
+struct BlkSlot* blk_slots; // In a frame of their own
+int blk_nslots;
+unsigned long blk_free; // Bit i set : slot i is free
+Spinlock blk_lock;
+
+long blk_sectors;
+int blk_read_only;
+int blk_can_flush;
+
+long blk_read_capacity() {
+    /*
+     * 64-bit field : read as two halves, again if the device changed its
+     * configuration in between
+     */
+    volatile unsigned int* config = blk_dev.device_config;
+    unsigned char generation;
+    long capacity;
+    do {
+        generation = blk_dev.common->config_generation;
+        capacity = config[0] | ((long)config[1] << 32);
+    } while (generation != blk_dev.common->config_generation);
+    return capacity;
+}
+
+int blk_init() {
+    PciDevice pci;
+    if (lapic == 0)
+        return 1;
+    if (pci_find(VIRTIO_VENDOR_ID, VIRTIO_BLK_DEVICE_ID, &pci) != 0
+        && pci_find(VIRTIO_VENDOR_ID, VIRTIO_BLK_TRANSITIONAL_ID, &pci) != 0)
+        return 1;
+    if (virtio_init(&blk_dev, &pci, VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH) != 0)
+        return 1;
+    if (blk_dev.device_config == 0)
+        goto fail;
+
+    // Interrupts to this CPU, enabled before the queue picks its vector
+    if (pci_msix_route(&blk_dev.pci, BLK_MSIX_ENTRY, TRAP_BLK, lapic_id()) != 0)
+        goto fail;
+    if (virtq_init(&blk_dev, &blk_queue, 0, BLK_QUEUE_SIZE, BLK_MSIX_ENTRY) != 0)
+        goto fail;
+    blk_slots = kalloc_zeroed();
+    if (blk_slots == 0)
+        goto fail;
+
+    blk_nslots = blk_queue.size / BLK_DESCS_PER_SLOT;
+    if (blk_nslots > BLK_SLOTS)
+        blk_nslots = BLK_SLOTS;
+    for (int i=0; i<blk_nslots; i++) {
+        VirtqDesc* desc = &blk_queue.desc[i * BLK_DESCS_PER_SLOT];
+        desc[0].addr = V2P(&blk_slots[i]);
+        desc[0].len = __builtin_offsetof(struct BlkSlot, status);
+        desc[0].flags = VIRTQ_DESC_F_NEXT;
+        desc[1].next = i * BLK_DESCS_PER_SLOT + 2;
+        desc[2].addr = V2P(&blk_slots[i].status);
+        desc[2].len = 1;
+        desc[2].flags = VIRTQ_DESC_F_WRITE;
+    }
+    blk_free = blk_nslots == 64 ? ~0ul : (1ul << blk_nslots) - 1;
+
+    blk_read_only = (blk_dev.features & VIRTIO_BLK_F_RO) != 0;
+    blk_can_flush = (blk_dev.features & VIRTIO_BLK_F_FLUSH) != 0;
+    virtio_ready(&blk_dev);
+    blk_sectors = blk_read_capacity();
+    return 0;
+
+fail:
+    virtio_fail(&blk_dev);
+    return 1;
+}
+
+int blk_submit(BlkRequest* req) {
+    if (blk_sectors == 0)
+        return 1;
+    if (req->type == BLK_READ || req->type == BLK_WRITE) {
+        if (req->size <= 0 || req->size % BLK_SECTOR_SIZE != 0 || req->sector < 0
+            || req->sector + req->size / BLK_SECTOR_SIZE > blk_sectors
+            || (req->type == BLK_WRITE && blk_read_only))
+            return -1;
+    } else if (req->type != BLK_FLUSH || !blk_can_flush) {
+        return -1;
+    }
+
+    acquire(&blk_lock);
+    if (blk_free == 0) {
+        release(&blk_lock);
+        return 1;
+    }
+    int i = __builtin_ctzl(blk_free);
+    blk_free &= ~(1ul << i);
+
+    struct BlkSlot* slot = &blk_slots[i];
+    slot->type = req->type;
+    slot->sector = req->type == BLK_FLUSH ? 0 : req->sector;
+    slot->status = 0xff;
+    slot->req = req;
+    completion_init(&req->done);
+
+    VirtqDesc* desc = &blk_queue.desc[i * BLK_DESCS_PER_SLOT];
+    if (req->type == BLK_FLUSH) {
+        // No data : the header goes straight to the status
+        desc[0].next = i * BLK_DESCS_PER_SLOT + 2;
+    } else {
+        desc[0].next = i * BLK_DESCS_PER_SLOT + 1;
+        desc[1].addr = V2P(req->buffer);
+        desc[1].len = req->size;
+        desc[1].flags = VIRTQ_DESC_F_NEXT | (req->type == BLK_READ ? VIRTQ_DESC_F_WRITE : 0);
+    }
+    virtq_push(&blk_queue, i * BLK_DESCS_PER_SLOT);
+    release(&blk_lock);
+    return 0;
+}
+
+void blk_wait(BlkRequest* req) {
+    completion_wait(&req->done);
+}
+
+int blk_io(BlkRequest* req) {
+    req->end = 0;
+    int ret;
+    while ((ret = blk_submit(req)) == 1) {
+        if (blk_sectors == 0)
+            return BLK_IOERR;
+        // Let the requests in flight complete
+        thread_yield();
+    }
+    if (ret != 0)
+        return BLK_IOERR;
+    blk_wait(req);
+    return req->status;
+}
+
+void blk_poll() {
+    // Unlocked look first : called by every scheduler loop iteration
+    if (blk_sectors == 0 || blk_queue.last_used == blk_queue.used->idx)
+        return;
+
+    while (1) {
+        unsigned int len;
+        acquire(&blk_lock);
+        int head = virtq_pop(&blk_queue, &len);
+        if (head < 0) {
+            release(&blk_lock);
+            return;
+        }
+        int i = head / BLK_DESCS_PER_SLOT;
+        BlkRequest* req = blk_slots[i].req;
+        req->status = blk_slots[i].status;
+        blk_free |= 1ul << i;
+        release(&blk_lock);
+
+        // [req] may be gone right after this
+        if (req->end != 0)
+            req->end(req);
+        else
+            completion_done(&req->done);
+    }
+}
@@ -0,0 +1,98 @@
+#include "boot.h"
+#include "kalloc.h"
+#include "ktime.h"
+#include "string_ops.h"
+#include "uart.h"
+#include "utils.h"
+
+BootInfo boot_info;
+
+long range_start(E820Entry* entry) {
+    // Usable ranges are shrunk to whole frames
+    if (entry->type == E820_USABLE)
+        return (entry->base + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1l);
+    return entry->base & ~(FRAME_SIZE - 1l);
+}
+
+long range_end(E820Entry* entry) {
+    long end = entry->base + entry->length;
+    if (entry->type == E820_USABLE)
+        return end & ~(FRAME_SIZE - 1l);
+    return (end + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1l);
+}
+
+int is_excluded(BootInfo* info, int i, int j) {
+    /*
+     * Does entry [j] hide part of usable entry [i] ?
+     */
+    if (j == i)
+        return 0;
+    return info->e820[j].type != E820_USABLE || j < i;
+}
+
+void find_cut(long s, long e, long start, long end, long* cut_start, long* cut_end) {
+    /*
+     * Make [s] -> [e] the next range to skip from [start] if it begins
+     * lower than the current one
+     */
+    if (s < start)
+        s = start;
+    if (e > start && s < *cut_start) {
+        *cut_start = s;
+        *cut_end = e < end ? e : end;
+    }
+}
+
+void for_each_usable_range(BootInfo* info, long min, void (*f)(long start, long end)) {
+    for (int i=0; i<info->e820_count; i++) {
+        if (info->e820[i].type != E820_USABLE)
+            continue;
+
+        long start = range_start(&info->e820[i]);
+        long end = range_end(&info->e820[i]);
+        if (start < min)
+            start = min;
+
+        /*
+         * Walk from left to right : report the part before the lowest
+         * excluded range overlapping [start, end), then skip it.
+         */
+        while (start < end) {
+            long cut_start = end;
+            long cut_end = end;
+            for (int j=0; j<info->e820_count; j++) {
+                if (is_excluded(info, i, j))
+                    find_cut(range_start(&info->e820[j]), range_end(&info->e820[j]), start, end, &cut_start, &cut_end);
+            }
+            // Only reachable through its read-only mapping (see initrd.h)
+            if (info->initrd_size != 0)
+                find_cut(info->initrd_base, (info->initrd_base + info->initrd_size + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1l), start, end, &cut_start, &cut_end);
+
+            if (cut_start > start)
+                f(start, cut_start);
+            start = cut_end;
+        }
+    }
+}
+
+long usable_top(BootInfo* info) {
+    long top = 0;
+    for (int i=0; i<info->e820_count; i++) {
+        if (info->e820[i].type == E820_USABLE && range_end(&info->e820[i]) > top)
+            top = range_end(&info->e820[i]);
+    }
+    return top;
+}
+
+void boot_tsc(int phase) {
+    boot_info.tsc[phase] = rdtsc();
+}
+
+void boot_report() {
+    BootReport report = { BOOT_REPORT_MAGIC, BOOT_TSC_COUNT, tsc_hz };
+    memcpy(report.tsc, boot_info.tsc, sizeof(report.tsc));
+    uart_init();
+    uart_write(&report, sizeof(report));
+    // Exit status (value << 1) | 1
+    outb(QEMU_EXIT_PORT, 0);
+}
@@ -0,0 +1,235 @@
+#include "cow.h"
+#include "cpu.h"
+#include "demand.h"
+#include "kalloc.h"
+#include "kvm.h"
+#include "spinlock.h"
+#include "string_ops.h"
+#include "trap.h"
+#include "utils.h"
+#include "vm.h"
+
+// Serializes clones and copy-on-write faults. Taken before vm_lock.
+Spinlock cow_lock;
+
+int leaf_order(long shift) {
+    /*
+     * Order of the block mapped by a leaf of a table whose entries span
+     * 1 << [shift] bytes
+     */
+    return shift - PTE_SHIFT;
+}
+
+void* leaf_frame(long entry, long shift) {
+    // Large leaves keep PAT in bit 12, inside ENTRY_ADDR_MASK
+    return P2V(entry & ENTRY_ADDR_MASK & ~((1l << shift) - 1));
+}
+
+void destroy_level(long* table, long shift) {
+    /*
+     * Drop every leaf below [table] (whose entries each span 1 << [shift]
+     * bytes) and free the tables below it, leaving [table] empty
+     */
+    for (int i=0; i<ENTRIES_PER_TABLE; i++) {
+        long* entry = table + i;
+        if ((*entry & ENTRY_P) == 0)
+            continue;
+
+        if (shift == PTE_SHIFT || !is_intermediate_entry(entry)) {
+            kref_put(leaf_frame(*entry, shift), leaf_order(shift));
+        } else {
+            long* child = get_next_tba(entry);
+            destroy_level(child, shift-9);
+            kfree_zeroed(child);
+        }
+        *entry = 0;
+    }
+}
+
+long* clone_level(long* table, long shift, long va, TlbBatch* batch) {
+    /*
+     * Copy [table] (mapping from [va]), sharing its leaves : writeable ones
+     * become copy-on-write on both sides, read-only ones ENTRY_SHARED.
+     * Returns 0 if no frame is left, or on a 1 GiB leaf (its block would be
+     * above MAX_ORDER for kref_get and kfree_pages).
+     */
+    long* copy = kalloc_zeroed();
+    if (copy == 0)
+        return 0;
+
+    for (int i=0; i<ENTRIES_PER_TABLE; i++) {
+        long* entry = table + i;
+        long entry_va = va + ((long)i << shift);
+        if ((*entry & ENTRY_P) == 0)
+            continue;
+
+        if (shift == PTE_SHIFT || !is_intermediate_entry(entry)) {
+            if (shift == PDPTE_SHIFT)
+                goto fail;
+            if (*entry & ENTRY_RW) {
+                *entry = (*entry & ~ENTRY_RW) | ENTRY_COW;
+                tlb_batch_add(batch, (void*)entry_va, *entry & ENTRY_G);
+            } else if (!(*entry & ENTRY_COW)) {
+                // Software bit only : no flush needed
+                *entry |= ENTRY_SHARED;
+            }
+            kref_get(leaf_frame(*entry, shift), leaf_order(shift));
+            copy[i] = *entry;
+        } else {
+            long* child = clone_level(get_next_tba(entry), shift-9, entry_va, batch);
+            if (child == 0)
+                goto fail;
+            copy[i] = MAKE_ENTRY(V2P(child), *entry & ~ENTRY_ADDR_MASK);
+        }
+    }
+
+    return copy;
+
+fail:
+    destroy_level(copy, shift);
+    kfree_zeroed(copy);
+    return 0;
+}
+
+void* address_space_clone(void* pml4) {
+    long* parent = pml4;
+    long* clone = kalloc_zeroed();
+    if (clone == 0)
+        return 0;
+
+    TlbBatch batch;
+    tlb_batch_init(&batch, pml4);
+
+    acquire(&cow_lock);
+    acquire(&vm_lock);
+    int i;
+    for (i=0; i<USER_PML4_ENTRIES; i++) {
+        if ((parent[i] & ENTRY_P) == 0)
+            continue;
+        long* pdpt = clone_level(get_next_tba(parent + i), PDPTE_SHIFT, (long)i << PML4E_SHIFT, &batch);
+        if (pdpt == 0)
+            break;
+        clone[i] = MAKE_ENTRY(V2P(pdpt), parent[i] & ~ENTRY_ADDR_MASK);
+    }
+    release(&vm_lock);
+    release(&cow_lock);
+
+    // Leaves of the parent may be cached as writeable
+    tlb_batch_flush(&batch);
+
+    if (i < USER_PML4_ENTRIES || demand_clone(pml4, clone) != 0) {
+        address_space_destroy(clone);
+        return 0;
+    }
+
+    // Kernel half : same PDPTs (they are never freed, see kvminit)
+    for (i=USER_PML4_ENTRIES; i<ENTRIES_PER_TABLE; i++)
+        clone[i] = parent[i];
+
+    return clone;
+}
+
+void address_space_destroy(void* pml4) {
+    long* table = pml4;
+
+    demand_destroy(pml4);
+
+    for (int i=0; i<USER_PML4_ENTRIES; i++) {
+        if ((table[i] & ENTRY_P) == 0)
+            continue;
+        long* pdpt = get_next_tba(table + i);
+        destroy_level(pdpt, PDPTE_SHIFT);
+        kfree_zeroed(pdpt);
+        table[i] = 0;
+    }
+
+    for (int i=USER_PML4_ENTRIES; i<ENTRIES_PER_TABLE; i++)
+        table[i] = 0;
+    kfree_zeroed(pml4);
+}
+
+int cow_fault(struct TrapFrame* frame) {
+    /*
+     * Large leaves are split down to the faulting 4 KiB page first : their
+     * block is counted frame by frame from then on (kref_split). The other
+     * pages of the split leaf keep the same (read-only) translation, so only
+     * the faulting page is invalidated.
+     */
+    long start = rdtsc();
+    FaultStats* stats = &fault_stats[cpu_id()];
+    long va = get_cr2();
+
+    // Kernel half is never copy-on-write
+    if ((frame->error & (PF_P | PF_W | PF_RSVD)) != (PF_P | PF_W) || va < 0) {
+        stats->failed++;
+        return -1;
+    }
+
+    void* page_va = (void*)(va & ~(long)(PAGE_SIZE-1));
+    long* table = P2V(get_cr3() & ENTRY_ADDR_MASK);
+    long shift = PML4E_SHIFT;
+    long* entry;
+    int ret = -1;
+    int copied = 0;
+
+    acquire(&cow_lock);
+    acquire(&vm_lock);
+
+    while (1) {
+        entry = table + get_va_table_index(page_va, shift);
+        if ((*entry & ENTRY_P) == 0)
+            goto out;
+        if (shift == PTE_SHIFT || !is_intermediate_entry(entry))
+            break;
+        table = get_next_tba(entry);
+        shift -= 9;
+    }
+
+    if ((*entry & ENTRY_COW) == 0) {
+        // Handled by another CPU in the meantime
+        if (*entry & ENTRY_RW)
+            ret = 0;
+        goto out;
+    }
+
+    while (shift != PTE_SHIFT) {
+        kref_split(leaf_frame(*entry, shift), leaf_order(shift));
+        table = split_leaf(entry, shift);
+        if (table == 0)
+            goto out;
+        shift -= 9;
+        entry = table + get_va_table_index(page_va, shift);
+    }
+
+    void* page = P2V(*entry & ENTRY_ADDR_MASK);
+    long flags = (*entry & ~ENTRY_ADDR_MASK & ~ENTRY_COW) | ENTRY_RW;
+
+    // Only other owners can drop their reference while we hold the lock
+    if (kref_count(page) == 1) {
+        *entry = MAKE_ENTRY(V2P(page), flags);
+    } else {
+        void* copy = kalloc();
+        if (copy == 0)
+            goto out;
+        memcpy(copy, page, PAGE_SIZE);
+        *entry = MAKE_ENTRY(V2P(copy), flags);
+        kref_put(page, 0);
+        copied = 1;
+    }
+    invlpg(page_va);
+    ret = 0;
+
+out:
+    release(&vm_lock);
+    release(&cow_lock);
+
+    if (ret != 0) {
+        stats->failed++;
+        return -1;
+    }
+
+    stats->cow_faults++;
+    stats->cow_copies += copied;
+    stats->cow_cycles += rdtsc() - start;
+    return 0;
+}
@@ -0,0 +1,88 @@
+#include "cpu.h"
+
+int ncpus = 1;
+int cpu_features = 0;
+
+Cpu cpus[MAX_CPUS];
+
+void percpu_init(int id) {
+    Cpu* cpu = &cpus[id];
+    cpu->self = cpu;
+    cpu->id = id;
+    wrmsr(MSR_GS_BASE, (long)cpu);
+}
+
+int cpu_id() {
+    // volatile : the result depends on the CPU running this code
+    int id;
+    asm volatile("movl %%gs:%c1, %0"
+                 : "=r" (id)
+                 : "i" (__builtin_offsetof(Cpu, id)));
+    return id;
+}
+
+Cpu* this_cpu() {
+    Cpu* cpu;
+    asm volatile("movq %%gs:%c1, %0"
+                 : "=r" (cpu)
+                 : "i" (__builtin_offsetof(Cpu, self)));
+    return cpu;
+}
+
+long rdmsr(unsigned int msr) {
+    unsigned int lo, hi;
+    asm volatile("rdmsr" : "=a" (lo), "=d" (hi) : "c" (msr));
+    return ((long)hi << 32) | lo;
+}
+
+void wrmsr(unsigned int msr, long value) {
+    asm volatile("wrmsr"
+                 :
+                 : "c" (msr), "a" ((unsigned int)value), "d" ((unsigned int)(value >> 32)));
+}
+
+void cpuid(unsigned int leaf, unsigned int subleaf,
+           unsigned int* a, unsigned int* b, unsigned int* c, unsigned int* d) {
+    asm volatile("cpuid"
+                 : "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d)
+                 : "a" (leaf), "c" (subleaf));
+}
+
+void cpu_detect() {
+    unsigned int a, b, c, d;
+    unsigned int max_basic, max_extended;
+
+    cpu_features = 0;
+
+    cpuid(0, 0, &max_basic, &b, &c, &d);
+    if (max_basic >= 1) {
+        cpuid(1, 0, &a, &b, &c, &d);
+        if ((d >> 13) & 1)
+            cpu_features |= CPU_PGE;
+        if ((c >> 17) & 1)
+            cpu_features |= CPU_PCID;
+        if ((c >> 3) & 1)
+            cpu_features |= CPU_MONITOR;
+        if ((c >> 24) & 1)
+            cpu_features |= CPU_TSC_DEADLINE;
+    }
+    if (max_basic >= 7) {
+        cpuid(7, 0, &a, &b, &c, &d);
+        if ((b >> 10) & 1)
+            cpu_features |= CPU_INVPCID;
+    }
+
+    cpuid(0x80000000, 0, &max_extended, &b, &c, &d);
+    if (max_extended >= 0x80000001) {
+        cpuid(0x80000001, 0, &a, &b, &c, &d);
+        if ((d >> 26) & 1)
+            cpu_features |= CPU_PDPE1GB;
+        if ((d >> 20) & 1)
+            cpu_features |= CPU_NX;
+    }
+    if (max_extended >= 0x80000007) {
+        cpuid(0x80000007, 0, &a, &b, &c, &d);
+        if ((d >> 8) & 1)
+            cpu_features |= CPU_INVARIANT_TSC;
+    }
+}
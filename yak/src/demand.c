@@ -0,0 +1,189 @@
+#include "cpu.h"
+#include "demand.h"
+#include "kalloc.h"
+#include "kvm.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "trap.h"
+#include "utils.h"
+#include "vm.h"
+
+typedef struct DemandRegion {
+    struct DemandRegion* next;
+    void* pml4;
+    long start;
+    long end;
+    long flags; // Leaf flags
+} DemandRegion;
+
+DemandRegion* demand_regions;
+Spinlock demand_lock;
+
+FaultStats fault_stats[MAX_CPUS];
+
+DemandRegion* find_region(void* pml4, long start, long end) {
+    /*
+     * First region of [pml4] intersecting [start] -> [end]
+     */
+    for (DemandRegion* region=demand_regions; region!=0; region=region->next) {
+        if (region->pml4 == pml4 && region->start < end && start < region->end)
+            return region;
+    }
+    return 0;
+}
+
+int vmmap_demand(void* pml4, void* va, long size, char rw, char us, long xd) {
+    long start = (long)va & ~(long)(PAGE_SIZE-1);
+    long end = (long)align_up((void*)((long)va + size));
+
+    if (size <= 0 || end <= start)
+        return -1;
+    // Checked here so that the fault handler can map any page of the region
+    long first = start >> 47;
+    long last = (end - 1) >> 47;
+    if (first != last || (first != 0 && first != -1))
+        return -1;
+
+    DemandRegion* region = kmalloc(sizeof(DemandRegion));
+    if (region == 0)
+        return -1;
+    region->pml4 = pml4;
+    region->start = start;
+    region->end = end;
+    region->flags = ENTRY_FLAGS(rw, us, xd) & vm_entry_mask;
+
+    acquire(&demand_lock);
+    if (find_region(pml4, start, end) != 0) {
+        release(&demand_lock);
+        kmfree(region);
+        return -1;
+    }
+    region->next = demand_regions;
+    demand_regions = region;
+    release(&demand_lock);
+    return 0;
+}
+
+int vmunmap_demand(void* pml4, void* va) {
+    acquire(&demand_lock);
+    DemandRegion** link = &demand_regions;
+    while (*link != 0 && ((*link)->pml4 != pml4 || (*link)->start != (long)va))
+        link = &(*link)->next;
+
+    DemandRegion* region = *link;
+    if (region == 0) {
+        release(&demand_lock);
+        return -1;
+    }
+    *link = region->next;
+    release(&demand_lock);
+
+    // Not ours anymore : pages can not be faulted in again from here
+    vmunmap_free(pml4, (void*)region->start, region->end - region->start);
+    kmfree(region);
+    return 0;
+}
+
+int demand_clone(void* pml4, void* clone) {
+    acquire(&demand_lock);
+    for (DemandRegion* region=demand_regions; region!=0; region=region->next) {
+        if (region->pml4 != pml4 || region->start < 0)
+            continue;
+
+        DemandRegion* copy = kmalloc(sizeof(DemandRegion));
+        if (copy == 0) {
+            release(&demand_lock);
+            return -1;
+        }
+        *copy = *region;
+        copy->pml4 = clone;
+        // Inserted before the regions left to visit
+        copy->next = demand_regions;
+        demand_regions = copy;
+    }
+    release(&demand_lock);
+    return 0;
+}
+
+void demand_destroy(void* pml4) {
+    acquire(&demand_lock);
+    DemandRegion** link = &demand_regions;
+    while (*link != 0) {
+        DemandRegion* region = *link;
+        if (region->pml4 == pml4) {
+            *link = region->next;
+            kmfree(region);
+        } else {
+            link = &region->next;
+        }
+    }
+    release(&demand_lock);
+}
+
+int can_access(long flags, long error) {
+    /*
+     * Is the access described by the #PF [error] code allowed by the leaf
+     * [flags] ?
+     */
+    if ((error & PF_W) && !(flags & ENTRY_RW))
+        return 0;
+    if ((error & PF_U) && !(flags & ENTRY_US))
+        return 0;
+    if ((error & PF_I) && (flags & ENTRY_XD))
+        return 0;
+    return 1;
+}
+
+void account_fault(FaultStats* stats, long cycles) {
+    stats->faults++;
+    stats->cycles += cycles;
+    if (cycles > stats->max_cycles)
+        stats->max_cycles = cycles;
+
+    int bucket = cycles > 0 ? 63 - __builtin_clzl(cycles) : 0;
+    if (bucket >= FAULT_LATENCY_BUCKETS)
+        bucket = FAULT_LATENCY_BUCKETS - 1;
+    stats->latency[bucket]++;
+}
+
+int demand_fault(struct TrapFrame* frame) {
+    /*
+     * Only faults on absent pages may be ours. The region lock is held
+     * until the page is mapped, so that two faults on the same page do not
+     * both map it.
+     */
+    long start = rdtsc();
+    FaultStats* stats = &fault_stats[cpu_id()];
+    long va = get_cr2();
+
+    if (frame->error & (PF_P | PF_RSVD)) {
+        stats->failed++;
+        return -1;
+    }
+
+    void* pml4 = va < 0 ? PML4 : P2V(get_cr3() & ENTRY_ADDR_MASK);
+    int ret = -1;
+
+    acquire(&demand_lock);
+    DemandRegion* region = find_region(pml4, va, va + 1);
+    if (region != 0 && vmwalk(pml4, (void*)va) != 0) {
+        // Mapped by another CPU in the meantime
+        ret = 0;
+    } else if (region != 0 && can_access(region->flags, frame->error)) {
+        void* page = kalloc_zeroed();
+        if (page != 0) {
+            ret = vmmap_flags(pml4, (void*)(va & ~(long)(PAGE_SIZE-1)), (void*)V2P(page), PAGE_SIZE, region->flags);
+            if (ret != 0)
+                kfree_zeroed(page);
+        }
+    }
+    release(&demand_lock);
+
+    if (ret != 0) {
+        stats->failed++;
+        return -1;
+    }
+
+    account_fault(stats, rdtsc() - start);
+    return 0;
+}
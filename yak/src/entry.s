@@ -4,8 +4,9 @@ extern kernel_main
 global _start
 
 section .text
+; rdi : boot info address, given by the bootloader (kept for kernel_main)
 _start:
     mov rsp, stack
-    add rsp, 0x1000 ; Should be consistent with C code (KERNEL_STACK_SIZE)
+    add rsp, 0x4000 ; Should be consistent with C code (KERNEL_STACK_SIZE)
     mov rbp, rsp
     call kernel_main
@@ -0,0 +1,327 @@
+#include "boot.h"
+#include "kalloc.h"
+#include "kvm.h"
+#include "string_ops.h"
+#include "vm.h"
+#include "initrd.h"
+
+// cpio "newc" : ASCII header, 8 hex digits per field
+#define CPIO_HEADER_SIZE 110
+#define CPIO_MODE 14
+#define CPIO_FILESIZE 54
+#define CPIO_NAMESIZE 94
+#define CPIO_ALIGN 4
+#define CPIO_TRAILER "TRAILER!!!"
+
+// ustar : 512-byte header blocks, octal fields
+#define TAR_BLOCK_SIZE 512
+#define TAR_NAME 0
+#define TAR_NAME_SIZE 100
+#define TAR_MODE 100
+#define TAR_SIZE 124
+#define TAR_TYPE 156
+#define TAR_LINKNAME 157
+#define TAR_MAGIC 257
+#define TAR_PREFIX 345
+#define TAR_PREFIX_SIZE 155
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+/*
+ * Index entry. The path points into the archive : [prefix] "/" [name] if
+ * there is a prefix (ustar), [name] otherwise.
+ */
+struct InitrdEntry {
+    char* prefix;
+    char* name; // 0 : free slot
+    int prefix_len;
+    int name_len;
+    unsigned int hash;
+    InitrdFile file;
+};
+
+void* initrd;
+long initrd_size;
+long initrd_count;
+
+struct InitrdEntry* initrd_table;
+long initrd_table_mask; // Slots - 1, a power of two minus one
+
+long parse_number(char* field, int len, int base) {
+    /*
+     * Unsigned number in [base] (16 or 8), up to [len] digits, after
+     * optional spaces. Stops at the first other character.
+     */
+    long value = 0;
+    int i = 0;
+    while (i < len && field[i] == ' ')
+        i++;
+    for (; i<len; i++) {
+        char c = field[i];
+        int digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            break;
+        if (digit >= base)
+            break;
+        value = value * base + digit;
+    }
+    return value;
+}
+
+int field_length(char* field, int max) {
+    int len = 0;
+    while (len < max && field[len] != 0)
+        len++;
+    return len;
+}
+
+void trim_path(char** path, int* len) {
+    // Leading "/" and "./", trailing "/"
+    while (1) {
+        if (*len >= 1 && (*path)[0] == '/') {
+            (*path)++;
+            (*len)--;
+        } else if (*len >= 2 && (*path)[0] == '.' && (*path)[1] == '/') {
+            *path += 2;
+            *len -= 2;
+        } else {
+            break;
+        }
+    }
+    if (*len == 1 && (*path)[0] == '.')
+        *len = 0;
+    while (*len > 0 && (*path)[*len - 1] == '/')
+        (*len)--;
+}
+
+int path_length(struct InitrdEntry* entry) {
+    if (entry->prefix_len == 0)
+        return entry->name_len;
+    return entry->prefix_len + 1 + entry->name_len;
+}
+
+char path_char(struct InitrdEntry* entry, int i) {
+    if (entry->prefix_len == 0)
+        return entry->name[i];
+    if (i < entry->prefix_len)
+        return entry->prefix[i];
+    if (i == entry->prefix_len)
+        return '/';
+    return entry->name[i - entry->prefix_len - 1];
+}
+
+unsigned int path_hash(struct InitrdEntry* entry) {
+    // FNV-1a
+    unsigned int hash = FNV_OFFSET;
+    int len = path_length(entry);
+    for (int i=0; i<len; i++)
+        hash = (hash ^ (unsigned char)path_char(entry, i)) * FNV_PRIME;
+    return hash;
+}
+
+int path_equal(struct InitrdEntry* a, struct InitrdEntry* b) {
+    if (a->hash != b->hash)
+        return 0;
+    if (a->prefix_len == 0 && b->prefix_len == 0)
+        return a->name_len == b->name_len && memcmp(a->name, b->name, a->name_len) == 0;
+    int len = path_length(a);
+    if (len != path_length(b))
+        return 0;
+    for (int i=0; i<len; i++) {
+        if (path_char(a, i) != path_char(b, i))
+            return 0;
+    }
+    return 1;
+}
+
+struct InitrdEntry* initrd_slot(struct InitrdEntry* key) {
+    /*
+     * Slot holding the path of [key] ([key]->hash set), or the free slot
+     * where it goes. The table is never more than half full.
+     */
+    long i = key->hash & initrd_table_mask;
+    while (initrd_table[i].name != 0 && !path_equal(&initrd_table[i], key))
+        i = (i + 1) & initrd_table_mask;
+    return &initrd_table[i];
+}
+
+int initrd_add(struct InitrdEntry* entry, int insert) {
+    /*
+     * Index [entry] if [insert], or only count it. Returns 1 if it counts
+     * (it has a path).
+     */
+    if (entry->prefix_len != 0) {
+        trim_path(&entry->prefix, &entry->prefix_len);
+        // Only trailing "/" : the name is what follows
+        while (entry->name_len > 0 && entry->name[entry->name_len - 1] == '/')
+            entry->name_len--;
+    } else {
+        trim_path(&entry->name, &entry->name_len);
+    }
+    if (path_length(entry) == 0)
+        return 0;
+    if (!insert)
+        return 1;
+
+    entry->hash = path_hash(entry);
+    struct InitrdEntry* slot = initrd_slot(entry);
+    if (slot->name == 0)
+        initrd_count++;
+    *slot = *entry;
+    return 1;
+}
+
+long parse_cpio(int insert) {
+    /*
+     * Entries of a cpio archive, up to its trailer. Returns their number,
+     * -1 if the archive is malformed.
+     */
+    long count = 0;
+    long offset = 0;
+    while (offset + CPIO_HEADER_SIZE <= initrd_size) {
+        char* header = initrd + offset;
+        if (memcmp(header, "070701", 6) != 0 && memcmp(header, "070702", 6) != 0)
+            return -1;
+        long namesize = parse_number(header + CPIO_NAMESIZE, 8, 16); // With its NUL
+        long filesize = parse_number(header + CPIO_FILESIZE, 8, 16);
+        long data = (offset + CPIO_HEADER_SIZE + namesize + CPIO_ALIGN - 1) & ~(CPIO_ALIGN - 1l);
+        if (namesize == 0 || data + filesize > initrd_size)
+            return -1;
+
+        char* name = header + CPIO_HEADER_SIZE;
+        if (namesize == sizeof(CPIO_TRAILER) && memcmp(name, CPIO_TRAILER, namesize) == 0)
+            return count;
+        struct InitrdEntry entry;
+        entry.prefix = 0;
+        entry.prefix_len = 0;
+        entry.name = name;
+        entry.name_len = field_length(name, namesize);
+        entry.file.data = initrd + data;
+        entry.file.size = filesize;
+        entry.file.mode = parse_number(header + CPIO_MODE, 8, 16);
+        count += initrd_add(&entry, insert);
+
+        offset = (data + filesize + CPIO_ALIGN - 1) & ~(CPIO_ALIGN - 1l);
+    }
+    return -1;
+}
+
+long parse_tar(int insert) {
+    /*
+     * Entries of a ustar archive, up to its first zero block (or its end).
+     * Hard links, devices and extension headers are left out. Returns their
+     * number, -1 if the archive is malformed.
+     */
+    long count = 0;
+    long offset = 0;
+    while (offset + TAR_BLOCK_SIZE <= initrd_size) {
+        char* header = initrd + offset;
+        if (header[0] == 0)
+            return count;
+        if (memcmp(header + TAR_MAGIC, "ustar", 5) != 0)
+            return -1;
+        long size = parse_number(header + TAR_SIZE, 12, 8);
+        long data = offset + TAR_BLOCK_SIZE;
+        if (data + size > initrd_size)
+            return -1;
+
+        struct InitrdEntry entry;
+        entry.prefix = header + TAR_PREFIX;
+        entry.prefix_len = field_length(entry.prefix, TAR_PREFIX_SIZE);
+        entry.name = header + TAR_NAME;
+        entry.name_len = field_length(entry.name, TAR_NAME_SIZE);
+        entry.file.data = initrd + data;
+        entry.file.size = size;
+        entry.file.mode = parse_number(header + TAR_MODE, 8, 8) & ~INITRD_S_IFMT;
+        int keep = 1;
+        switch (header[TAR_TYPE]) {
+        case 0:
+        case '0':
+            entry.file.mode |= INITRD_S_IFREG;
+            break;
+        case '5':
+            entry.file.mode |= INITRD_S_IFDIR;
+            break;
+        case '2':
+            entry.file.mode |= INITRD_S_IFLNK;
+            entry.file.data = header + TAR_LINKNAME;
+            entry.file.size = field_length(header + TAR_LINKNAME, TAR_NAME_SIZE);
+            break;
+        default:
+            keep = 0;
+        }
+        if (keep)
+            count += initrd_add(&entry, insert);
+
+        offset = data + ((size + TAR_BLOCK_SIZE - 1) & ~(TAR_BLOCK_SIZE - 1l));
+    }
+    return count;
+}
+
+long parse_archive(int insert) {
+    if (initrd_size >= 6 && memcmp(initrd, "0707", 4) == 0)
+        return parse_cpio(insert);
+    if (initrd_size >= TAR_BLOCK_SIZE && memcmp(initrd + TAR_MAGIC, "ustar", 5) == 0)
+        return parse_tar(insert);
+    return -1;
+}
+
+int initrd_init(struct BootInfo* info) {
+    if (info->initrd_size == 0)
+        return 1;
+    if (vmmap_flags(PML4, INITRD_BASE, (void*)info->initrd_base, info->initrd_size, KERNEL_FLAGS(PTE_READONLY, PTE_XD)) != 0)
+        return 1;
+    initrd = INITRD_BASE;
+    initrd_size = info->initrd_size;
+
+    // Count, then index in a table at most half full
+    long count = parse_archive(0);
+    if (count < 0)
+        goto fail;
+    long slots = 16;
+    while (slots < 2 * count)
+        slots <<= 1;
+    int order = 0;
+    while ((FRAME_SIZE << order) < slots * (long)sizeof(struct InitrdEntry))
+        order++;
+    if (order > MAX_ORDER)
+        goto fail;
+    initrd_table = kalloc_pages(order);
+    if (initrd_table == 0)
+        goto fail;
+    memset(initrd_table, 0, FRAME_SIZE << order);
+    initrd_table_mask = slots - 1;
+    parse_archive(1);
+    return 0;
+
+fail:
+    vmunmap(PML4, INITRD_BASE, info->initrd_size);
+    initrd = 0;
+    initrd_size = 0;
+    return 1;
+}
+
+int initrd_lookup(char* path, InitrdFile* file) {
+    if (initrd_table == 0)
+        return 1;
+    struct InitrdEntry key;
+    key.prefix = 0;
+    key.prefix_len = 0;
+    key.name = path;
+    key.name_len = field_length(path, 1 << 30);
+    trim_path(&key.name, &key.name_len);
+    key.hash = path_hash(&key);
+
+    struct InitrdEntry* slot = initrd_slot(&key);
+    if (slot->name == 0)
+        return 1;
+    *file = slot->file;
+    return 0;
+}
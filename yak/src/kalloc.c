@@ -1,43 +1,519 @@
-#include "kvm.h"
+#include "boot.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "string_ops.h"
+#include "trace.h"
 #include "utils.h"
 #include "kalloc.h"
+#include "kvm.h"
+
+/*
+ * Free blocks are tracked in one bitmap per order, indexed by block number
+ * (physical frame number >> order, so that block alignment is physical
+ * alignment) : bit i of order o is set iff the 2^o frames starting at frame
+ * i << o form a free block of order o.
+ * A summary bitmap per order has bit j set iff word j of the order bitmap is
+ * not null, so a free block is found with two bit scans.
+ * Free frames themselves are never written to.
+ */
+#define BITS_PER_WORD 64
+
+unsigned long* free_bitmap[MAX_ORDER+1];
+unsigned long* summary[MAX_ORDER+1];
+long summary_words[MAX_ORDER+1];
+long summary_hint[MAX_ORDER+1]; // No summary word below this one is set
+long free_blocks[MAX_ORDER+1];
+
+long first_frame; // Frames below are never handed out
+long last_frame; // Exclusive
+
+/*
+ * Frame reference counts, one word per frame (indexed like the bitmaps) :
+ * owners beyond the first one, so that frames from kalloc need no setup and
+ * the word of a free frame is always 0.
+ * A 2 MiB block mapped by megapages is counted on its first frame, until
+ * one of its mappings is split : from then on (KREF_SPLIT set on each of
+ * its frames), every frame is counted on its own and a megapage mapping
+ * holds one reference on each of them.
+ * Megapage operations take kref_lock, 4 KiB ones are atomic.
+ */
+#define KREF_SPLIT (1u << 31)
+#define KREF_COUNT_MASK (KREF_SPLIT - 1)
+
+unsigned int* frame_refs;
+Spinlock kref_lock;
 
-struct FreeFrame {
-    struct FreeFrame* next;
+/*
+ * Per-CPU frame magazines (Bonwick style) in front of the buddy allocator.
+ * Each CPU owns a loaded and a previous magazine, and serves kalloc / kfree
+ * from them without atomics. Only when both are empty (resp. full) does it
+ * take the lock, to trade a whole magazine with the depot or to refill
+ * (resp. drain) half a magazine from (resp. to) the buddy allocator.
+ * The lock protects the depot and the buddy bitmaps. Every CPU comes to it
+ * on a magazine miss and for kalloc_pages : an MCS lock, so that waiters
+ * spin on their own node.
+ * Must not be used from interrupt handlers while the same CPU is in kalloc.
+ */
+#define MAGAZINE_SIZE 62 // A magazine is 512 bytes
+
+struct Magazine {
+    struct Magazine* next; // In depot lists
+    long count;
+    void* frames[MAGAZINE_SIZE];
 };
 
-struct FreeFrame* top = 0;
+struct MagazineCpu {
+    struct Magazine* loaded;
+    struct Magazine* previous;
+} __attribute__((aligned(64))); // One cache line per CPU
+
+struct MagazineCpu magazines[MAX_CPUS];
+struct Magazine* depot_full;
+struct Magazine* depot_empty;
+McsLock kalloc_lock;
 
-void kinit() {
-    struct FreeFrame* next = 0;
-    struct FreeFrame* frame;
+int is_block_free(long block, int order) {
+    return (free_bitmap[order][block / BITS_PER_WORD] >> (block % BITS_PER_WORD)) & 1;
+}
 
-    // 8-byte pointers so we need to step by FRAME_SIZE/8
-    for(frame = (struct FreeFrame*) FREE_MEM_TOP-FRAME_SIZE;
-        frame >= (struct FreeFrame*) KERNEL_TOP;
-        frame -= (FRAME_SIZE>>3))
-    {
-        frame->next = next;
-        next = frame;
+void set_block_free(long block, int order) {
+    long word = block / BITS_PER_WORD;
+    free_bitmap[order][word] |= 1ul << (block % BITS_PER_WORD);
+    summary[order][word / BITS_PER_WORD] |= 1ul << (word % BITS_PER_WORD);
+    if (word / BITS_PER_WORD < summary_hint[order]) {
+        summary_hint[order] = word / BITS_PER_WORD;
     }
+    free_blocks[order]++;
+}
 
-    top = next;
+void set_block_used(long block, int order) {
+    long word = block / BITS_PER_WORD;
+    free_bitmap[order][word] &= ~(1ul << (block % BITS_PER_WORD));
+    if (free_bitmap[order][word] == 0) {
+        summary[order][word / BITS_PER_WORD] &= ~(1ul << (word % BITS_PER_WORD));
+    }
+    free_blocks[order]--;
 }
 
-void* kalloc() {
-    void* ret = (void*) top;
-    top = top->next;
+long find_free_block(int order) {
+    /*
+     * Lowest free block of [order] (there must be one)
+     */
+    long s = summary_hint[order];
+    while (summary[order][s] == 0) {
+        s++;
+    }
+    summary_hint[order] = s;
+
+    long word = s * BITS_PER_WORD + __builtin_ctzl(summary[order][s]);
+    return word * BITS_PER_WORD + __builtin_ctzl(free_bitmap[order][word]);
+}
+
+void add_free_range(long start, long end) {
+    /*
+     * Cut [start] -> [end] into the largest aligned blocks
+     */
+    long frame = start / FRAME_SIZE;
+    while (frame < end / FRAME_SIZE) {
+        int order = MAX_ORDER;
+        while (frame % (1l << order) != 0 || frame + (1l << order) > end / FRAME_SIZE) {
+            order--;
+        }
+        set_block_free(frame >> order, order);
+        frame += 1l << order;
+    }
+}
+
+void kinit(struct BootInfo* info) {
+    /*
+     * Bitmaps and reference counts live right after the kernel, free memory
+     * after them. Only these are cleared : boot cost is O(bitmap size), free
+     * frames are not touched.
+     * Every usable E820 range above the bitmaps is then handed out.
+     * Frames are handed out as direct map addresses (see kvm.h).
+     */
+    last_frame = usable_top(info) / FRAME_SIZE;
+
+    unsigned long* bitmaps = align_up(P2V(info->kernel_end));
+    unsigned long* metadata = bitmaps;
+    for (int order=0; order<=MAX_ORDER; order++) {
+        long words = ((last_frame >> order) + BITS_PER_WORD - 1) / BITS_PER_WORD;
+        summary_words[order] = (words + BITS_PER_WORD - 1) / BITS_PER_WORD;
+        free_bitmap[order] = metadata;
+        metadata += words;
+        summary[order] = metadata;
+        metadata += summary_words[order];
+        summary_hint[order] = summary_words[order];
+        free_blocks[order] = 0;
+    }
+    frame_refs = (unsigned int*)metadata;
+    metadata = (void*)(frame_refs + last_frame);
+    memset(bitmaps, 0, (void*)metadata - (void*)bitmaps);
+    first_frame = V2P(align_up(metadata)) / FRAME_SIZE;
+
+    for_each_usable_range(info, first_frame * FRAME_SIZE, add_free_range);
+}
+
+void* buddy_alloc(int order) {
+    if (order < 0 || order > MAX_ORDER) {
+        return 0;
+    }
+
+    // Smallest non-empty order that can hold the request
+    int current = order;
+    while (current <= MAX_ORDER && free_blocks[current] == 0) {
+        current++;
+    }
+    if (current > MAX_ORDER) {
+        return 0;
+    }
+
+    long block = find_free_block(current);
+    set_block_used(block, current);
+
+    // Split : give back the upper halves
+    while (current > order) {
+        current--;
+        block <<= 1;
+        set_block_free(block + 1, current);
+    }
+
+    return P2V((block << order) * FRAME_SIZE);
+}
+
+int buddy_free(void* addr, int order) {
+    long frame = V2P(addr) / FRAME_SIZE;
+
+    if (!is_aligned(addr)
+        || order < 0 || order > MAX_ORDER
+        || frame % (1l << order) != 0
+        || frame < first_frame || frame + (1l << order) > last_frame) {
+        return 1;
+    }
+
+    // Double free : the block, or a block containing it, is already free
+    for (int o=order; o<=MAX_ORDER; o++) {
+        if ((frame >> o) < ((last_frame >> o)) && is_block_free(frame >> o, o)) {
+            return 1;
+        }
+    }
+
+    // Merge with the buddy as long as it is free
+    long block = frame >> order;
+    while (order < MAX_ORDER && (block ^ 1) < (last_frame >> order)
+           && is_block_free(block ^ 1, order)) {
+        set_block_used(block ^ 1, order);
+        block >>= 1;
+        order++;
+    }
+
+    set_block_free(block, order);
+    return 0;
+}
+
+struct Magazine* get_empty_magazine() {
+    /*
+     * Lock held. Magazines are carved out of frames, which are never given
+     * back : there are only as many as CPUs trading them.
+     */
+    if (depot_empty == 0) {
+        struct Magazine* magazines = buddy_alloc(0);
+        if (magazines == 0) {
+            return 0;
+        }
+        for (long i=0; i<FRAME_SIZE/sizeof(struct Magazine); i++) {
+            magazines[i].next = depot_empty;
+            depot_empty = &magazines[i];
+        }
+    }
+
+    struct Magazine* magazine = depot_empty;
+    depot_empty = magazine->next;
+    magazine->count = 0;
+    return magazine;
+}
+
+void flush_depot() {
+    /*
+     * Lock held. Give the frames of full magazines back to the buddy
+     * allocator, so that they can be merged again.
+     */
+    while (depot_full != 0) {
+        struct Magazine* magazine = depot_full;
+        depot_full = magazine->next;
+        for (long i=0; i<magazine->count; i++) {
+            buddy_free(magazine->frames[i], 0);
+        }
+        magazine->next = depot_empty;
+        depot_empty = magazine;
+    }
+}
+
+void* kalloc_pages(int order) {
+    McsNode node;
+    mcs_acquire(&kalloc_lock, &node);
+    void* block = buddy_alloc(order);
+    if (block == 0 && depot_full != 0) {
+        flush_depot();
+        block = buddy_alloc(order);
+    }
+    mcs_release(&kalloc_lock, &node);
+    trace(TRACE_KALLOC, block, order);
+    return block;
+}
+
+int kfree_pages(void* addr, int order) {
+    trace(TRACE_KFREE, addr, order);
+    McsNode node;
+    mcs_acquire(&kalloc_lock, &node);
+    int ret = buddy_free(addr, order);
+    mcs_release(&kalloc_lock, &node);
     return ret;
 }
 
+void* kalloc_refill(struct MagazineCpu* cpu) {
+    /*
+     * Slow path of kalloc : the loaded magazine is empty
+     */
+    struct Magazine* magazine;
+
+    if (cpu->previous != 0 && cpu->previous->count > 0) {
+        magazine = cpu->previous;
+        cpu->previous = cpu->loaded;
+        cpu->loaded = magazine;
+        return magazine->frames[--magazine->count];
+    }
+
+    McsNode node;
+    mcs_acquire(&kalloc_lock, &node);
+    if (depot_full != 0) {
+        // Trade an empty magazine for a full one
+        if (cpu->previous != 0) {
+            cpu->previous->next = depot_empty;
+            depot_empty = cpu->previous;
+        }
+        cpu->previous = cpu->loaded;
+        cpu->loaded = depot_full;
+        depot_full = depot_full->next;
+    } else {
+        if (cpu->loaded == 0) {
+            cpu->loaded = get_empty_magazine();
+        }
+        if (cpu->loaded != 0) {
+            // Half a magazine, so that a few kfree do not drain it right away
+            while (cpu->loaded->count < MAGAZINE_SIZE/2) {
+                void* frame = buddy_alloc(0);
+                if (frame == 0) {
+                    break;
+                }
+                cpu->loaded->frames[cpu->loaded->count++] = frame;
+            }
+        }
+    }
+    mcs_release(&kalloc_lock, &node);
+
+    magazine = cpu->loaded;
+    if (magazine == 0 || magazine->count == 0) {
+        return 0;
+    }
+    return magazine->frames[--magazine->count];
+}
+
+int kfree_drain(struct MagazineCpu* cpu, void* addr) {
+    /*
+     * Slow path of kfree : the loaded magazine is full (or missing)
+     */
+    struct Magazine* magazine;
+
+    if (cpu->previous != 0 && cpu->previous->count < MAGAZINE_SIZE) {
+        magazine = cpu->previous;
+        cpu->previous = cpu->loaded;
+        cpu->loaded = magazine;
+        magazine->frames[magazine->count++] = addr;
+        return 0;
+    }
+
+    McsNode node;
+    mcs_acquire(&kalloc_lock, &node);
+    magazine = get_empty_magazine();
+    if (magazine != 0) {
+        // Trade a full magazine for an empty one
+        if (cpu->previous != 0) {
+            cpu->previous->next = depot_full;
+            depot_full = cpu->previous;
+        }
+        cpu->previous = cpu->loaded;
+        cpu->loaded = magazine;
+    } else if (cpu->loaded == 0) {
+        int ret = buddy_free(addr, 0);
+        mcs_release(&kalloc_lock, &node);
+        return ret;
+    } else {
+        // No frame left for a magazine : drain half of the loaded one
+        while (cpu->loaded->count > MAGAZINE_SIZE/2) {
+            buddy_free(cpu->loaded->frames[--cpu->loaded->count], 0);
+        }
+    }
+    mcs_release(&kalloc_lock, &node);
+
+    magazine = cpu->loaded;
+    magazine->frames[magazine->count++] = addr;
+    return 0;
+}
+
+void* kalloc() {
+    // Fast path : local, no lock
+    struct MagazineCpu* cpu = &magazines[cpu_id()];
+    struct Magazine* magazine = cpu->loaded;
+    void* frame;
+    if (magazine != 0 && magazine->count > 0) {
+        frame = magazine->frames[--magazine->count];
+    } else {
+        frame = kalloc_refill(cpu);
+    }
+
+    trace(TRACE_KALLOC, frame, 0);
+    return frame;
+}
+
 int kfree(void* addr) {
-    if (!is_aligned(addr)) {
+    long frame = V2P(addr) / FRAME_SIZE;
+    if (!is_aligned(addr) || frame < first_frame || frame >= last_frame) {
         return 1;
     }
+    trace(TRACE_KFREE, addr, 0);
 
-    struct FreeFrame* new_top = (struct FreeFrame*) addr;
-    new_top->next = top;
-    top = new_top;
+    // Fast path : local, no lock
+    struct MagazineCpu* cpu = &magazines[cpu_id()];
+    struct Magazine* magazine = cpu->loaded;
+    if (magazine != 0 && magazine->count < MAGAZINE_SIZE) {
+        magazine->frames[magazine->count++] = addr;
+        return 0;
+    }
 
-    return 0;
+    return kfree_drain(cpu, addr);
+}
+
+/*
+ * Per-CPU pools of frames known to be clean (all zeros). They are refilled
+ * off the critical path (kzero_refill, from idle loops) with non-temporal
+ * stores, so that zeroing does not evict hot cache lines. Frames in a pool
+ * are never written to, and tables freed once empty go back to the pool :
+ * a clean frame is never zeroed twice.
+ */
+#define ZERO_POOL_SIZE 64
+
+struct ZeroPool {
+    long count;
+    void* frames[ZERO_POOL_SIZE];
+} __attribute__((aligned(64)));
+
+struct ZeroPool zero_pools[MAX_CPUS];
+
+void* kalloc_zeroed() {
+    struct ZeroPool* pool = &zero_pools[cpu_id()];
+    if (pool->count > 0) {
+        return pool->frames[--pool->count];
+    }
+
+    // Pool is dry : the caller is about to use the frame, zero it in cache
+    void* frame = kalloc();
+    if (frame != 0) {
+        memset(frame, 0, FRAME_SIZE);
+    }
+    return frame;
+}
+
+int kfree_zeroed(void* addr) {
+    struct ZeroPool* pool = &zero_pools[cpu_id()];
+    if (is_aligned(addr) && pool->count < ZERO_POOL_SIZE) {
+        pool->frames[pool->count++] = addr;
+        return 0;
+    }
+    return kfree(addr);
+}
+
+void kzero_refill() {
+    struct ZeroPool* pool = &zero_pools[cpu_id()];
+    while (pool->count < ZERO_POOL_SIZE) {
+        void* frame = kalloc();
+        if (frame == 0) {
+            return;
+        }
+        zero_page_nt(frame);
+        pool->frames[pool->count++] = frame;
+    }
+}
+
+unsigned int* kref_word(void* addr) {
+    return &frame_refs[V2P(addr) / FRAME_SIZE];
+}
+
+void kref_get(void* addr, int order) {
+    if (order == 0) {
+        __atomic_add_fetch(kref_word(addr), 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    acquire(&kref_lock);
+    if (*kref_word(addr) & KREF_SPLIT) {
+        for (long i=0; i<(1l << order); i++)
+            __atomic_add_fetch(kref_word(addr + i * FRAME_SIZE), 1, __ATOMIC_RELAXED);
+    } else {
+        (*kref_word(addr))++;
+    }
+    release(&kref_lock);
+}
+
+int kref_put_frame(void* addr) {
+    /*
+     * Drop a reference on a single frame, freeing it with the last one
+     */
+    unsigned int* word = kref_word(addr);
+    unsigned int refs = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+    while (1) {
+        if ((refs & KREF_COUNT_MASK) == 0) {
+            // Last owner : nobody else can see the word anymore
+            *word = 0;
+            kfree(addr);
+            return 1;
+        }
+        if (__atomic_compare_exchange_n(word, &refs, refs - 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return 0;
+    }
+}
+
+int kref_put(void* addr, int order) {
+    if (order == 0)
+        return kref_put_frame(addr);
+
+    acquire(&kref_lock);
+    unsigned int* word = kref_word(addr);
+    int freed = 0;
+    if (*word & KREF_SPLIT) {
+        for (long i=0; i<(1l << order); i++)
+            freed += kref_put_frame(addr + i * FRAME_SIZE);
+        freed = freed == (1 << order);
+    } else if (*word == 0) {
+        kfree_pages(addr, order);
+        freed = 1;
+    } else {
+        (*word)--;
+    }
+    release(&kref_lock);
+    return freed;
+}
+
+long kref_count(void* addr) {
+    return (__atomic_load_n(kref_word(addr), __ATOMIC_ACQUIRE) & KREF_COUNT_MASK) + 1;
+}
+
+void kref_split(void* addr, int order) {
+    acquire(&kref_lock);
+    unsigned int refs = *kref_word(addr);
+    if (!(refs & KREF_SPLIT)) {
+        for (long i=0; i<(1l << order); i++)
+            *kref_word(addr + i * FRAME_SIZE) = refs | KREF_SPLIT;
+    }
+    release(&kref_lock);
 }
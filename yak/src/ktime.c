@@ -0,0 +1,121 @@
+#include "cpu.h"
+#include "ktime.h"
+#include "lapic.h"
+#include "pit.h"
+#include "trap.h"
+#include "utils.h"
+
+#define CALIBRATION_ROUNDS 3
+#define TIMER_CALIBRATION_NS 10000000l // 10 ms
+
+long tsc_hz;
+long ktime_tsc_base;
+unsigned long ktime_mult;
+unsigned long ktime_tsc_mult;
+
+int timer_mode;
+long lapic_timer_hz;
+unsigned long lapic_timer_mult; // Timer ticks per ns << KTIME_SHIFT
+
+unsigned long per_ns_mult(long hz) {
+    // [hz] / NS_PER_SEC << KTIME_SHIFT, without 128-bit division
+    return ((hz / NS_PER_SEC) << KTIME_SHIFT) + ((hz % NS_PER_SEC) << KTIME_SHIFT) / NS_PER_SEC;
+}
+
+long pit_cycles(unsigned int ticks) {
+    /*
+     * TSC cycles of a PIT countdown (fewest of a few rounds : SMIs or a
+     * preempted vCPU only make it longer)
+     */
+    long best = 0;
+    for (int i=0; i<CALIBRATION_ROUNDS; i++) {
+        pit_start(ticks);
+        long start = rdtsc();
+        pit_wait();
+        long cycles = rdtsc() - start;
+        if (best == 0 || cycles < best)
+            best = cycles;
+    }
+    return best;
+}
+
+void ktime_init() {
+    /*
+     * Two countdown lengths : the difference cancels the fixed cost of
+     * starting and polling the PIT
+     */
+    long ticks = PIT_MAX_TICKS - PIT_MAX_TICKS/2;
+    long cycles = pit_cycles(PIT_MAX_TICKS) - pit_cycles(PIT_MAX_TICKS/2);
+    tsc_hz = cycles * PIT_FREQUENCY / ticks;
+
+    ktime_mult = (NS_PER_SEC << KTIME_SHIFT) / tsc_hz;
+    ktime_tsc_mult = per_ns_mult(tsc_hz);
+    ktime_tsc_base = rdtsc();
+}
+
+long cycles_to_ns(long cycles) {
+    return ((unsigned __int128)cycles * ktime_mult) >> KTIME_SHIFT;
+}
+
+long ns_to_cycles(long ns) {
+    return ((unsigned __int128)ns * ktime_tsc_mult) >> KTIME_SHIFT;
+}
+
+long ktime_ns() {
+    return cycles_to_ns(rdtsc() - ktime_tsc_base);
+}
+
+void timer_init() {
+    if (lapic == 0)
+        return;
+
+    lapic_write(LAPIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+    if (lapic_timer_hz == 0) {
+        /*
+         * Same bus clock on every CPU : calibrated once, against the TSC.
+         * Needed by the one-shot mode and by the profiler (prof.h).
+         */
+        lapic_write(LAPIC_LVT_TIMER, LVT_MASKED | LVT_TIMER_ONESHOT | TRAP_TIMER);
+        lapic_write(LAPIC_TIMER_INITIAL, 0xffffffff);
+        long end = rdtsc() + ns_to_cycles(TIMER_CALIBRATION_NS);
+        while (rdtsc() < end) {
+            asm volatile("pause");
+        }
+        long count = 0xffffffffl - lapic_read(LAPIC_TIMER_CURRENT);
+        lapic_write(LAPIC_TIMER_INITIAL, 0);
+        lapic_timer_hz = count * (NS_PER_SEC / TIMER_CALIBRATION_NS);
+        lapic_timer_mult = per_ns_mult(lapic_timer_hz);
+    }
+
+    if (cpu_features & CPU_TSC_DEADLINE) {
+        timer_mode = TIMER_TSC_DEADLINE;
+        lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_TSC_DEADLINE | TRAP_TIMER);
+        // The LVT write must land before any IA32_TSC_DEADLINE write
+        asm volatile("mfence" ::: "memory");
+        return;
+    }
+
+    timer_mode = TIMER_ONESHOT;
+    lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_ONESHOT | TRAP_TIMER);
+}
+
+void timer_arm(long deadline) {
+    // Periodic NMIs end idle sleeps meanwhile
+    if (this_cpu()->profiling)
+        return;
+    if (timer_mode == TIMER_TSC_DEADLINE) {
+        wrmsr(MSR_TSC_DEADLINE, deadline == 0 ? 0 : ktime_tsc_base + ns_to_cycles(deadline));
+    } else if (timer_mode == TIMER_ONESHOT) {
+        long count = 0;
+        if (deadline != 0) {
+            long delay = deadline - ktime_ns();
+            count = delay <= 0 ? 1 : ((unsigned __int128)delay * lapic_timer_mult) >> KTIME_SHIFT;
+            // 32-bit counter : fires early, the caller arms it again
+            if (count > 0xffffffffl)
+                count = 0xffffffffl;
+            if (count == 0)
+                count = 1;
+        }
+        lapic_write(LAPIC_TIMER_INITIAL, count);
+    }
+}
@@ -1,36 +1,105 @@
+#include "boot.h"
+#include "cow.h"
+#include "cpu.h"
 #include "kalloc.h"
+#include "string_ops.h"
 #include "utils.h"
 #include "kvm.h"
 #include "vm.h"
 
 void* PML4; // Page Map Level 4 address (content of CR3 register)
+char* free_mem_top;
 
-void kvminit() {
+// Stack and guard page
+#define KSTACK_SLOT (KERNEL_STACK_SIZE + PAGE_SIZE)
+
+void map_direct_range(long start, long end) {
+    vmmap_flags(PML4, P2V(start), (void*)start, end-start, KERNEL_FLAGS(PTE_READWRITE, PTE_XD));
+}
+
+void kvminit(struct BootInfo* info) {
     /*
      * Discard paging structure needed for the bootloader
      * and create a new (clean) one
      */
-    PML4 = kalloc();
-    memset(PML4, 0, TABLE_SIZE);
+    vm_gigapages = (cpu_features & CPU_PDPE1GB) != 0;
+    if (!(cpu_features & CPU_NX))
+        vm_entry_mask = ~ENTRY_XD;
+
+    PML4 = kalloc_zeroed();
+
+    // Kernel half : every PDPT exists from the start and is never freed, so
+    // that other address spaces can share them (see cow.h)
+    for (int i=USER_PML4_ENTRIES; i<ENTRIES_PER_TABLE; i++)
+        ((long*)PML4)[i] = MAKE_ENTRY(V2P(kalloc_zeroed()), ENTRY_P | ENTRY_RW);
 
     // Kernel code (.text)
-    vmmap(PML4, KERNEL_BASE, KERNEL_BASE, RODATA_SECTION_START-KERNEL_BASE, PTE_READONLY, PTE_SUPERVISOR, PTE_EXECUTABLE);
+    vmmap_flags(PML4, KERNEL_BASE, (void*)KERNEL_V2P(KERNEL_BASE), RODATA_SECTION_START-KERNEL_BASE, KERNEL_FLAGS(PTE_READONLY, PTE_EXECUTABLE));
     // .rodata : R
-    vmmap(PML4, RODATA_SECTION_START, RODATA_SECTION_START, DATA_SECTION_START-RODATA_SECTION_START, PTE_READONLY, PTE_SUPERVISOR, PTE_XD);
-    // .data : RW
-    vmmap(PML4, DATA_SECTION_START, DATA_SECTION_START, BSS_SECTION_START-DATA_SECTION_START, PTE_READWRITE, PTE_SUPERVISOR, PTE_XD);
-    // .bss : RW
-    vmmap(PML4, BSS_SECTION_START, BSS_SECTION_START, KERNEL_TOP-BSS_SECTION_START, PTE_READWRITE, PTE_SUPERVISOR, PTE_XD);
-
-    // Free memory
-    vmmap(PML4, KERNEL_TOP, KERNEL_TOP, (long)FREE_MEM_TOP-(long)KERNEL_TOP, PTE_READWRITE, PTE_SUPERVISOR, PTE_XD);
-
-    // Trampoline
-    // (for now)
-    void* trampoline = kalloc();
-    memcpy(trampoline, "micronoyau", 10);
-    vmmap(PML4, (void*)(FREE_MEM_TOP), trampoline, PAGE_SIZE, PTE_READONLY, PTE_SUPERVISOR, PTE_EXECUTABLE);
-
-    enable_efer_nxe();
-    set_cr3(PML4);
+    vmmap_flags(PML4, RODATA_SECTION_START, (void*)KERNEL_V2P(RODATA_SECTION_START), DATA_SECTION_START-RODATA_SECTION_START, KERNEL_FLAGS(PTE_READONLY, PTE_XD));
+    // .data and .bss : RW
+    // (mapped at once since .bss is not page-aligned and may share a page with .data)
+    vmmap_flags(PML4, DATA_SECTION_START, (void*)KERNEL_V2P(DATA_SECTION_START), KERNEL_TOP-DATA_SECTION_START, KERNEL_FLAGS(PTE_READWRITE, PTE_XD));
+
+    // Direct map of physical memory (usable E820 ranges only, holes stay
+    // unmapped), with the largest leaves alignment allows
+    for_each_usable_range(info, 0, map_direct_range);
+    free_mem_top = (char*) usable_top(info);
+
+    if (cpu_features & CPU_NX)
+        enable_efer_nxe();
+    set_cr3((void*)V2P(PML4));
+
+    // CR3[11:0] (PCID) is 0 here, as required to set CR4.PCIDE
+    if (cpu_features & CPU_PGE) {
+        set_cr4_bits(CR4_PGE);
+        vm_global = 1;
+    }
+    if (cpu_features & CPU_PCID) {
+        set_cr4_bits(CR4_PCIDE);
+        vm_pcid = 1;
+    }
+}
+
+void kvminit_ap() {
+    /*
+     * EFER.NXE and CR4 (but PCIDE, which needs long mode) are already set
+     * like on the BSP by the AP trampoline (see smp.c)
+     */
+    set_cr3((void*)V2P(PML4));
+    if (vm_pcid)
+        set_cr4_bits(CR4_PCIDE);
+}
+
+void* kvm_map_phys(long pa, long size, long flags) {
+    long start = pa & ~(long)(PAGE_SIZE-1);
+    long end = (long)align_up((void*)(pa + size));
+
+    for (long page=start; page<end; page+=PAGE_SIZE) {
+        if (vmwalk(PML4, P2V(page)) != 0)
+            continue;
+        // Also fails if another CPU mapped the page in the meantime
+        if (vmmap_flags(PML4, P2V(page), (void*)page, PAGE_SIZE, flags) != 0 && vmwalk(PML4, P2V(page)) == 0)
+            return 0;
+    }
+    return P2V(pa);
+}
+
+void* kvm_alloc_stack(int i) {
+    void* bottom = (void*)(KSTACK_BASE + (long)i * KSTACK_SLOT + PAGE_SIZE);
+
+    for (long offset=0; offset<KERNEL_STACK_SIZE; offset+=PAGE_SIZE) {
+        void* frame = kalloc();
+        if (frame == 0)
+            goto fail;
+        if (vmmap_flags(PML4, bottom + offset, (void*)V2P(frame), PAGE_SIZE, KERNEL_FLAGS(PTE_READWRITE, PTE_XD)) != 0) {
+            kfree(frame);
+            goto fail;
+        }
+    }
+    return bottom + KERNEL_STACK_SIZE;
+
+fail:
+    vmunmap_free(PML4, bottom, KERNEL_STACK_SIZE);
+    return 0;
 }
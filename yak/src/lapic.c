@@ -0,0 +1,53 @@
+#include "cpu.h"
+#include "kvm.h"
+#include "lapic.h"
+#include "vm.h"
+
+#define APIC_BASE_ENABLE (1 << 11) // IA32_APIC_BASE : global enable
+#define APIC_BASE_ADDR (~0xfffl) // IA32_APIC_BASE : physical base
+
+void* lapic;
+
+unsigned int lapic_read(int reg) {
+    return *(volatile unsigned int*)(lapic + reg);
+}
+
+void lapic_write(int reg, unsigned int value) {
+    *(volatile unsigned int*)(lapic + reg) = value;
+}
+
+int lapic_id() {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_enable() {
+    wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+void lapic_init() {
+    /*
+     * Reached through the bootloader's alias of its identity mapping until
+     * lapic_map : its MTRRs keep the APIC page uncached anyway
+     */
+    lapic = P2V(rdmsr(MSR_APIC_BASE) & APIC_BASE_ADDR);
+    lapic_enable();
+}
+
+int lapic_map() {
+    // Device registers : uncached. Same address as before kvminit.
+    if (kvm_map_phys(V2P(lapic), PAGE_SIZE, KERNEL_FLAGS(PTE_READWRITE, PTE_XD) | ENTRY_PCD | ENTRY_PWT) == 0) {
+        lapic = 0;
+        return 1;
+    }
+    return 0;
+}
+
+void lapic_send_ipi(int apic_id, unsigned int icr) {
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    // Writing the low half sends the IPI
+    lapic_write(LAPIC_ICR_LOW, icr);
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_DELIVERY_PENDING) {
+        asm volatile("pause");
+    }
+}
@@ -1,12 +1,106 @@
+#include "cpu.h"
+#include "bench.h"
+#include "boot.h"
+#include "string_ops.h"
 #include "utils.h"
 #include "kalloc.h"
+#include "initrd.h"
+#include "ktime.h"
 #include "kvm.h"
+#include "lapic.h"
+#include "prof.h"
+#include "sched.h"
+#include "blk.h"
+#include "slab.h"
+#include "smp.h"
+#include "trace.h"
+#include "trap.h"
 
-// Kernel stack in .bss section, should be NX
+// Kernel stack of the bootstrap processor, in .bss section, should be NX
 char stack[KERNEL_STACK_SIZE];
 
-void kernel_main() {
-    kinit();
-    kvminit();
-    while(1) { }
+void kernel_run() {
+    /*
+     * Common to every CPU, once all of them are up
+     */
+#ifdef BENCH
+    bench_kalloc();
+    bench_string();
+    bench_fault();
+    bench_sched();
+    bench_blk();
+    bench_report();
+#endif
+    sched_run();
+}
+
+void kernel_main(BootInfo* bootloader_info) {
+    long entry_tsc = rdtsc();
+    // Before anything that may use SSE / AVX
+    string_init();
+    cpu_detect();
+    trap_init();
+    // Per-CPU data (cpu_id) from here on
+    percpu_init(0);
+    cpus[0].stack_top = stack + KERNEL_STACK_SIZE;
+    cpus[0].online = 1;
+    ktime_init();
+    lapic_init();
+    timer_init();
+
+    // The bootloader's memory is not mapped anymore once kvminit is done
+    memcpy(&boot_info, bootloader_info, sizeof(BootInfo));
+    boot_info.tsc[BOOT_TSC_KERNEL] = entry_tsc;
+    boot_tsc(BOOT_TSC_EARLY);
+
+#ifdef PROFILE
+    prof_start(PROF_HZ);
+#endif
+    kinit(&boot_info);
+    boot_tsc(BOOT_TSC_KINIT);
+    kvminit(&boot_info);
+    // No local APIC access between kvminit and this
+    if (lapic_map() != 0)
+        timer_mode = TIMER_NONE;
+    boot_tsc(BOOT_TSC_KVMINIT);
+#ifdef PROFILE
+    prof_stop();
+    prof_dump();
+#endif
+    kmem_init();
+    kzero_refill();
+    boot_tsc(BOOT_TSC_KMEM);
+    smp_init();
+    boot_tsc(BOOT_TSC_SMP);
+#ifdef BENCH_BOOT
+    boot_report();
+#endif
+    // Archive the bootloader loaded after the kernel, if any
+    initrd_init(&boot_info);
+    // Disk, if QEMU was given one
+    blk_init();
+#ifdef TRACE
+    if (trace_init() == 0)
+        thread_spawn(trace_drain, 0);
+#endif
+
+    kernel_run();
+}
+
+void ap_main(Cpu* cpu) {
+    // The trampoline page table only maps the kernel half and the trampoline
+    kvminit_ap();
+    string_init();
+    trap_load();
+    percpu_init(cpu->id);
+    lapic_enable();
+    timer_init();
+
+    __atomic_store_n(&cpu->online, 1, __ATOMIC_RELEASE);
+    while (!smp_ready) {
+        asm volatile("pause");
+    }
+    kzero_refill();
+
+    kernel_run();
 }
@@ -0,0 +1,120 @@
+#include "kvm.h"
+#include "pci.h"
+#include "utils.h"
+#include "vm.h"
+
+#define PCI_MMIO_FLAGS (KERNEL_FLAGS(PTE_READWRITE, PTE_XD) | ENTRY_PCD | ENTRY_PWT)
+
+unsigned int pci_address(PciDevice* dev, int reg) {
+    return PCI_CONFIG_ENABLE | (dev->bus << 16) | (dev->device << 11)
+        | (dev->function << 8) | (reg & 0xfc);
+}
+
+unsigned int pci_read32(PciDevice* dev, int reg) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(dev, reg));
+    return inl(PCI_CONFIG_DATA);
+}
+
+unsigned short pci_read16(PciDevice* dev, int reg) {
+    return pci_read32(dev, reg) >> ((reg & 2) * 8);
+}
+
+unsigned char pci_read8(PciDevice* dev, int reg) {
+    return pci_read32(dev, reg) >> ((reg & 3) * 8);
+}
+
+void pci_write32(PciDevice* dev, int reg, unsigned int value) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(dev, reg));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+void pci_write16(PciDevice* dev, int reg, unsigned short value) {
+    /*
+     * Only these 2 bytes : a read-modify-write of the 32-bit register would
+     * write the other half back, e.g. clear the RW1C bits of the Status
+     * register next to Command
+     */
+    outl(PCI_CONFIG_ADDRESS, pci_address(dev, reg));
+    outw(PCI_CONFIG_DATA + (reg & 2), value);
+}
+
+int pci_find(unsigned short vendor_id, unsigned short device_id, PciDevice* dev) {
+    dev->bus = 0;
+    dev->msix_table = 0;
+    for (dev->device=0; dev->device<PCI_DEVICES; dev->device++) {
+        for (dev->function=0; dev->function<PCI_FUNCTIONS; dev->function++) {
+            unsigned int id = pci_read32(dev, PCI_VENDOR_ID);
+            dev->vendor_id = id & 0xffff;
+            dev->device_id = id >> 16;
+            if (dev->vendor_id == vendor_id && dev->device_id == device_id)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+int pci_find_capability(PciDevice* dev, int id, int from) {
+    if (!(pci_read16(dev, PCI_STATUS) & PCI_STATUS_CAPABILITIES))
+        return 0;
+
+    int offset = from ? pci_read8(dev, from + PCI_CAP_NEXT) : pci_read8(dev, PCI_CAPABILITIES);
+    // The low 2 bits are reserved. Bounded, in case the list loops.
+    for (int i=0; i<48 && (offset & ~3) != 0; i++) {
+        offset &= ~3;
+        if (pci_read8(dev, offset + PCI_CAP_ID) == id)
+            return offset;
+        offset = pci_read8(dev, offset + PCI_CAP_NEXT);
+    }
+    return 0;
+}
+
+long pci_bar(PciDevice* dev, int bar) {
+    unsigned int low = pci_read32(dev, PCI_BAR0 + bar * 4);
+    if (low & PCI_BAR_IO)
+        return 0;
+    long base = low & PCI_BAR_ADDR_MASK & 0xffffffffl;
+    if ((low & PCI_BAR_TYPE_MASK) == PCI_BAR_64 && bar < 5)
+        base |= (long)pci_read32(dev, PCI_BAR0 + (bar + 1) * 4) << 32;
+    return base;
+}
+
+void* pci_map_bar(PciDevice* dev, int bar, long offset, long size) {
+    long base = pci_bar(dev, bar);
+    if (base == 0)
+        return 0;
+    return kvm_map_phys(base + offset, size, PCI_MMIO_FLAGS);
+}
+
+void pci_enable(PciDevice* dev) {
+    unsigned short command = pci_read16(dev, PCI_COMMAND);
+    command |= PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER | PCI_COMMAND_INTX_DISABLE;
+    pci_write16(dev, PCI_COMMAND, command);
+}
+
+int pci_msix_route(PciDevice* dev, int entry, int vector, int apic_id) {
+    int cap = pci_find_capability(dev, PCI_CAP_MSIX, 0);
+    if (cap == 0)
+        return 1;
+    unsigned short control = pci_read16(dev, cap + MSIX_CONTROL);
+    if (entry > (control & MSIX_SIZE_MASK))
+        return 1;
+
+    if (dev->msix_table == 0) {
+        unsigned int table = pci_read32(dev, cap + MSIX_TABLE);
+        dev->msix_table = pci_map_bar(dev, table & MSIX_BIR_MASK, table & ~MSIX_BIR_MASK,
+                                      ((control & MSIX_SIZE_MASK) + 1) * MSIX_ENTRY_SIZE);
+        if (dev->msix_table == 0)
+            return 1;
+    }
+
+    volatile unsigned int* e = dev->msix_table + entry * MSIX_ENTRY_SIZE;
+    e[MSIX_ENTRY_CONTROL / 4] = MSIX_ENTRY_MASKED;
+    e[MSIX_ENTRY_ADDR_LOW / 4] = MSI_ADDRESS_BASE | (apic_id << MSI_DESTINATION_SHIFT);
+    e[MSIX_ENTRY_ADDR_HIGH / 4] = 0;
+    e[MSIX_ENTRY_DATA / 4] = vector;
+    e[MSIX_ENTRY_CONTROL / 4] = 0;
+
+    control = (control | MSIX_ENABLE) & ~MSIX_FUNCTION_MASK;
+    pci_write16(dev, cap + MSIX_CONTROL, control);
+    return 0;
+}
@@ -0,0 +1,35 @@
+#include "pit.h"
+#include "utils.h"
+
+void pit_start(unsigned int ticks) {
+    /*
+     * Channel 2, lobyte/hibyte access, mode 0 (interrupt on terminal count) :
+     * the output goes low with the command and high once [ticks] elapsed
+     */
+    outb(PIT_PORT_B, (inb(PIT_PORT_B) & ~0x02) | 0x01);
+    outb(PIT_COMMAND, 0xb0);
+    outb(PIT_CHANNEL2, ticks & 0xff);
+    outb(PIT_CHANNEL2, (ticks >> 8) & 0xff);
+}
+
+void pit_wait() {
+    while (!(inb(PIT_PORT_B) & 0x20)) {
+        asm volatile("pause");
+    }
+}
+
+void pit_countdown(unsigned int ticks) {
+    pit_start(ticks);
+    pit_wait();
+}
+
+void pit_delay_us(long us) {
+    long ticks = (us * PIT_FREQUENCY + 999999) / 1000000;
+
+    while (ticks > PIT_MAX_TICKS) {
+        pit_countdown(PIT_MAX_TICKS);
+        ticks -= PIT_MAX_TICKS;
+    }
+    if (ticks > 0)
+        pit_countdown(ticks);
+}
@@ -0,0 +1,137 @@
+#include "cpu.h"
+#include "kvm.h"
+#include "ktime.h"
+#include "lapic.h"
+#include "prof.h"
+#include "sched.h"
+#include "trap.h"
+#include "uart.h"
+
+struct ProfCpu {
+    volatile int active;
+    unsigned int samples;
+    unsigned int dropped;
+    long hz;
+} __attribute__((aligned(64)));
+
+struct ProfCpu prof_cpus[MAX_CPUS];
+// Static : usable before kinit
+ProfSample prof_samples[PROF_CPUS][PROF_SAMPLES];
+
+int prof_start(long hz) {
+    int id = cpu_id();
+    if (PROF_SAMPLES == 0 || id >= PROF_CPUS || lapic == 0 || lapic_timer_hz == 0 || hz <= 0)
+        return 1;
+
+    long count = lapic_timer_hz / hz;
+    if (count == 0)
+        count = 1;
+    if (count > 0xffffffffl)
+        count = 0xffffffffl;
+
+    prof_cpus[id].hz = lapic_timer_hz / count;
+    prof_cpus[id].active = 1;
+    // From here on, timer_arm leaves the timer alone
+    this_cpu()->profiling = 1;
+    lapic_write(LAPIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_PERIODIC | LVT_DELIVERY_NMI);
+    lapic_write(LAPIC_TIMER_INITIAL, count);
+    return 0;
+}
+
+void prof_stop() {
+    struct ProfCpu* p = &prof_cpus[cpu_id()];
+    // lapic_map failed : the timer is out of reach, its NMIs are still samples
+    if (!p->active || lapic == 0)
+        return;
+
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+    /*
+     * A sample already sent is taken by now (the read waits for the writes,
+     * an NMI is taken at the next instruction boundary) : it must still find
+     * the CPU active, or trap_handler would take it for a real NMI
+     */
+    lapic_read(LAPIC_TIMER_CURRENT);
+    p->active = 0;
+    this_cpu()->profiling = 0;
+    timer_init();
+}
+
+void prof_stack(long rsp, long* low, long* high) {
+    /*
+     * Bounds of the stack [rsp] is on : the running thread's, or the CPU's
+     * own (low == high if neither)
+     */
+    Thread* thread = thread_current();
+    if (thread != 0 && rsp >= (long)thread && rsp < (long)thread + THREAD_STACK_SIZE) {
+        *low = (long)thread;
+        *high = (long)thread + THREAD_STACK_SIZE;
+        return;
+    }
+    long top = (long)this_cpu()->stack_top;
+    if (rsp >= top - KERNEL_STACK_SIZE && rsp < top) {
+        *low = top - KERNEL_STACK_SIZE;
+        *high = top;
+        return;
+    }
+    *low = *high = 0;
+}
+
+int prof_nmi(TrapFrame* frame) {
+    int id = cpu_id();
+    struct ProfCpu* p = &prof_cpus[id];
+    if (!p->active)
+        return 1;
+    if (p->samples >= PROF_SAMPLES) {
+        p->dropped++;
+        return 0;
+    }
+
+    ProfSample* sample = &prof_samples[id][p->samples];
+    sample->pcs[0] = frame->rip;
+    int depth = 1;
+
+    /*
+     * Frame pointer walk : [rbp] is the caller's rbp, [rbp+8] the return
+     * address. Frames only go up the stack, and the walk never leaves it
+     * (rbp may hold anything in code built without frame pointers).
+     */
+    long low, high;
+    prof_stack(frame->rsp, &low, &high);
+    long* fp = (long*)frame->rbp;
+    while (depth < PROF_MAX_DEPTH && (long)fp >= frame->rsp && (long)fp >= low
+           && (long)fp + 16 <= high && ((long)fp & 7) == 0) {
+        if (fp[1] == 0)
+            break;
+        sample->pcs[depth++] = fp[1];
+        long* caller = (long*)fp[0];
+        if (caller <= fp)
+            break;
+        fp = caller;
+    }
+
+    sample->cpu = id;
+    sample->depth = depth;
+    p->samples++;
+    return 0;
+}
+
+void prof_dump() {
+    uart_init();
+    for (int cpu=0; cpu<PROF_CPUS && cpu<ncpus; cpu++) {
+        struct ProfCpu* p = &prof_cpus[cpu];
+        if (p->samples == 0 && p->dropped == 0)
+            continue;
+
+        ProfHeader header = { PROF_MAGIC, cpu, p->samples, p->dropped, p->hz };
+        uart_write(&header, sizeof(header));
+        for (unsigned int i=0; i<p->samples; i++) {
+            // Only the pcs in use
+            ProfSample* sample = &prof_samples[cpu][i];
+            uart_write(sample, __builtin_offsetof(ProfSample, pcs) + sample->depth * sizeof(long));
+        }
+        p->samples = 0;
+        p->dropped = 0;
+    }
+}
@@ -0,0 +1,410 @@
+#include "cpu.h"
+#include "kalloc.h"
+#include "ktime.h"
+#include "lapic.h"
+#include "sched.h"
+#include "blk.h"
+#include "spinlock.h"
+#include "trap.h"
+#include "utils.h"
+
+/*
+ * Per-CPU scheduler state. The deque is a Chase-Lev deque with a fixed
+ * array (Le et al., "Correct and efficient work-stealing for weak memory
+ * models", x86-TSO flavour) : [top, bottom) are runnable threads, bottom is
+ * only written by the owner, top only grows (CAS by thieves, and by the
+ * owner when racing them for the last thread).
+ * Threads that do not fit go to a global overflow list.
+ */
+struct SchedCpu {
+    volatile long top __attribute__((aligned(64))); // Written by thieves
+    volatile long bottom __attribute__((aligned(64)));
+    Thread* threads[DEQUE_SIZE];
+    // Owner only
+    void* rsp; // Context of the scheduler loop
+    Thread* current;
+    Thread* sleepers; // Sorted by wake_at
+    Thread* cache; // Free thread blocks
+    int cached;
+    unsigned long seed; // First victim to steal from
+    // Cleared by the CPU that wakes this one up (monitored by mwait)
+    volatile int sleeping __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+struct SchedCpu scheds[MAX_CPUS];
+
+volatile int sched_cpus = MAX_CPUS;
+// Bit i set : CPU i is about to sleep or sleeps, and needs a wake-up
+volatile unsigned long sched_idle;
+
+Thread* overflow;
+Spinlock overflow_lock;
+
+struct SchedCpu* this_sched() {
+    return &scheds[cpu_id()];
+}
+
+int active_cpus() {
+    return sched_cpus < ncpus ? sched_cpus : ncpus;
+}
+
+int deque_push(struct SchedCpu* s, Thread* thread) {
+    long bottom = s->bottom;
+    long top = __atomic_load_n(&s->top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= DEQUE_SIZE)
+        return 1;
+    s->threads[bottom & (DEQUE_SIZE-1)] = thread;
+    __atomic_store_n(&s->bottom, bottom+1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+Thread* deque_pop(struct SchedCpu* s) {
+    /*
+     * Claim the bottom slot first, then look at top : the fence orders both
+     * against the same accesses of deque_steal
+     */
+    long bottom = s->bottom - 1;
+    s->bottom = bottom;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = s->top;
+
+    if (top > bottom) {
+        s->bottom = bottom+1;
+        return 0;
+    }
+    Thread* thread = s->threads[bottom & (DEQUE_SIZE-1)];
+    if (top == bottom) {
+        // Last thread : thieves may race for it
+        if (!__atomic_compare_exchange_n(&s->top, &top, top+1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            thread = 0;
+        s->bottom = bottom+1;
+    }
+    return thread;
+}
+
+Thread* deque_steal(struct SchedCpu* s) {
+    /*
+     * Returns 0 when empty or when losing a race (caller moves on)
+     */
+    long top = __atomic_load_n(&s->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&s->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom)
+        return 0;
+    Thread* thread = s->threads[top & (DEQUE_SIZE-1)];
+    if (!__atomic_compare_exchange_n(&s->top, &top, top+1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return 0;
+    return thread;
+}
+
+void wake_cpu(int cpu) {
+    if (cpu_features & CPU_MONITOR)
+        __atomic_store_n(&scheds[cpu].sleeping, 0, __ATOMIC_RELEASE);
+    else
+        lapic_send_ipi(cpus[cpu].apic_id, TRAP_WAKEUP);
+}
+
+void wake_idle_cpu() {
+    /*
+     * The new runnable thread must be visible before sched_idle is read :
+     * pairs with the fence of sched_sleep (a CPU either sees the thread or
+     * is seen here)
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int n = active_cpus();
+    unsigned long idle = sched_idle & (n == 64 ? ~0ul : (1ul << n) - 1);
+
+    while (idle != 0) {
+        int cpu = __builtin_ctzl(idle);
+        unsigned long bit = 1ul << cpu;
+        // Whoever clears the bit wakes the CPU up
+        if (__atomic_fetch_and(&sched_idle, ~bit, __ATOMIC_SEQ_CST) & bit) {
+            wake_cpu(cpu);
+            return;
+        }
+        idle &= ~bit;
+    }
+}
+
+void sched_ready(Thread* thread) {
+    if (deque_push(this_sched(), thread) != 0) {
+        acquire(&overflow_lock);
+        thread->next = overflow;
+        overflow = thread;
+        release(&overflow_lock);
+    }
+    wake_idle_cpu();
+}
+
+int sched_has_work(struct SchedCpu* s) {
+    if (overflow != 0 || s->bottom > s->top)
+        return 1;
+    for (int cpu=0; cpu<active_cpus(); cpu++) {
+        if (scheds[cpu].bottom > scheds[cpu].top)
+            return 1;
+    }
+    return 0;
+}
+
+Thread* sched_next(struct SchedCpu* s, int id) {
+    Thread* thread = deque_pop(s);
+    if (thread != 0)
+        return thread;
+
+    if (overflow != 0) {
+        acquire(&overflow_lock);
+        thread = overflow;
+        if (thread != 0)
+            overflow = thread->next;
+        release(&overflow_lock);
+        if (thread != 0)
+            return thread;
+    }
+
+    int n = active_cpus();
+    if (id >= n)
+        return 0;
+
+    // xorshift, so that thieves do not all go for the same victim
+    s->seed ^= s->seed << 13;
+    s->seed ^= s->seed >> 7;
+    s->seed ^= s->seed << 17;
+    int first = s->seed % n;
+    for (int i=0; i<n; i++) {
+        int victim = (first + i) % n;
+        if (victim == id)
+            continue;
+        thread = deque_steal(&scheds[victim]);
+        if (thread != 0)
+            return thread;
+    }
+    return 0;
+}
+
+void sched_wake_sleepers(struct SchedCpu* s) {
+    long now = ktime_ns();
+    while (s->sleepers != 0 && s->sleepers->wake_at <= now) {
+        Thread* thread = s->sleepers;
+        s->sleepers = thread->next;
+        sched_ready(thread);
+    }
+}
+
+void sched_add_sleeper(struct SchedCpu* s, Thread* thread) {
+    Thread** prev = &s->sleepers;
+    while (*prev != 0 && (*prev)->wake_at <= thread->wake_at)
+        prev = &(*prev)->next;
+    thread->next = *prev;
+    *prev = thread;
+}
+
+void sched_sleep(struct SchedCpu* s, int id) {
+    /*
+     * Announce the sleep, then look for work one last time : a thread made
+     * runnable after this check finds the bit and wakes this CPU up.
+     * Interrupts are only enabled by the instruction before hlt / mwait
+     * (STI shadow) : a wake-up IPI or timer interrupt pending since the
+     * check is taken right then and ends the sleep.
+     */
+    unsigned long bit = 1ul << id;
+
+    // Without a timer, sleeping threads are polled
+    if (s->sleepers != 0 && timer_mode == TIMER_NONE)
+        return;
+
+    s->sleeping = 1;
+    __atomic_or_fetch(&sched_idle, bit, __ATOMIC_SEQ_CST);
+
+    if (!sched_has_work(s)) {
+        if (s->sleepers != 0)
+            timer_arm(s->sleepers->wake_at);
+        if (cpu_features & CPU_MONITOR) {
+            asm volatile("monitor" : : "a" (&s->sleeping), "c" (0), "d" (0));
+            if (s->sleeping)
+                asm volatile("sti\n\t"
+                             "mwait\n\t"
+                             "cli"
+                             :
+                             : "a" (0), "c" (0));
+        } else {
+            asm volatile("sti\n\t"
+                         "hlt\n\t"
+                         "cli");
+        }
+    }
+    __atomic_and_fetch(&sched_idle, ~bit, __ATOMIC_SEQ_CST);
+}
+
+Thread* sched_switch(struct SchedCpu* s, int id, Thread* thread) {
+    /*
+     * Run [thread] until it switches back, then finish what it asked for.
+     * Returns a thread to run right away, or 0.
+     */
+    thread->state = THREAD_RUNNING;
+    s->current = thread;
+    context_switch(&s->rsp, thread->rsp);
+    s->current = 0;
+
+    switch (thread->state) {
+    case THREAD_YIELDING: {
+        // Give the others a chance first, and what they wait for (e.g. a
+        // free disk slot) : yields can chain without going back to sched_run
+        blk_poll();
+        Thread* next = sched_next(s, id);
+        sched_ready(thread);
+        return next;
+    }
+    case THREAD_JOINING: {
+        Thread* expected = 0;
+        if (__atomic_compare_exchange_n(&thread->join_target->joiner, &expected, thread, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return 0;
+        // Already exited
+        return thread;
+    }
+    case THREAD_SLEEPING:
+        sched_add_sleeper(s, thread);
+        return 0;
+    case THREAD_WAITING: {
+        Thread* expected = 0;
+        if (__atomic_compare_exchange_n(&thread->completion->waiter, &expected, thread, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return 0;
+        // Already signaled
+        return thread;
+    }
+    case THREAD_EXITED:
+        // [thread] may be freed by its joiner as soon as this is done
+        return __atomic_exchange_n(&thread->joiner, JOIN_DONE, __ATOMIC_ACQ_REL);
+    }
+    return 0;
+}
+
+void sched_run() {
+    int id = cpu_id();
+    struct SchedCpu* s = &scheds[id];
+    s->seed = rdtsc() | 1;
+
+    while (1) {
+        // Disk requests done while this CPU ran threads or slept
+        blk_poll();
+        if (s->sleepers != 0)
+            sched_wake_sleepers(s);
+        Thread* thread = sched_next(s, id);
+        if (thread == 0) {
+            kzero_refill();
+            sched_sleep(s, id);
+            continue;
+        }
+        while (thread != 0)
+            thread = sched_switch(s, id, thread);
+    }
+}
+
+Thread* thread_current() {
+    return this_sched()->current;
+}
+
+void* context_init(void* stack_top, void (*start)()) {
+    // Should be consistent with context_switch (switch.s)
+    long* sp = stack_top;
+    *--sp = 0; // Return address of [start]
+    *--sp = (long)start; // Popped by ret
+    for (int i=0; i<6; i++)
+        *--sp = 0; // rbp, rbx, r12 - r15
+    return sp;
+}
+
+Thread* thread_alloc(struct SchedCpu* s) {
+    Thread* thread = s->cache;
+    if (thread != 0) {
+        s->cache = thread->next;
+        s->cached--;
+        return thread;
+    }
+    return kalloc_pages(THREAD_STACK_ORDER);
+}
+
+void thread_free(struct SchedCpu* s, Thread* thread) {
+    if (s->cached < THREAD_CACHE_SIZE) {
+        thread->next = s->cache;
+        s->cache = thread;
+        s->cached++;
+        return;
+    }
+    kfree_pages(thread, THREAD_STACK_ORDER);
+}
+
+void thread_start() {
+    Thread* self = thread_current();
+    self->entry(self->arg);
+    thread_exit();
+}
+
+Thread* thread_spawn(void (*entry)(void* arg), void* arg) {
+    Thread* thread = thread_alloc(this_sched());
+    if (thread == 0)
+        return 0;
+
+    thread->entry = entry;
+    thread->arg = arg;
+    thread->state = THREAD_RUNNING;
+    thread->join_target = 0;
+    thread->joiner = 0;
+    thread->rsp = context_init((void*)thread + THREAD_STACK_SIZE, thread_start);
+    sched_ready(thread);
+    return thread;
+}
+
+void thread_yield() {
+    Thread* self = thread_current();
+    self->state = THREAD_YIELDING;
+    context_switch(&self->rsp, this_sched()->rsp);
+}
+
+void thread_join(Thread* thread) {
+    if (__atomic_load_n(&thread->joiner, __ATOMIC_ACQUIRE) != JOIN_DONE) {
+        Thread* self = thread_current();
+        self->state = THREAD_JOINING;
+        self->join_target = thread;
+        context_switch(&self->rsp, this_sched()->rsp);
+    }
+    // The scheduler loop that ran [thread] is done with it
+    thread_free(this_sched(), thread);
+}
+
+void thread_sleep_until(long deadline) {
+    Thread* self = thread_current();
+    self->wake_at = deadline;
+    self->state = THREAD_SLEEPING;
+    context_switch(&self->rsp, this_sched()->rsp);
+}
+
+void thread_sleep(long ns) {
+    thread_sleep_until(ktime_ns() + ns);
+}
+
+void completion_init(Completion* completion) {
+    completion->waiter = 0;
+}
+
+void completion_wait(Completion* completion) {
+    if (__atomic_load_n(&completion->waiter, __ATOMIC_ACQUIRE) == COMPLETION_DONE)
+        return;
+    Thread* self = thread_current();
+    self->state = THREAD_WAITING;
+    self->completion = completion;
+    context_switch(&self->rsp, this_sched()->rsp);
+}
+
+void completion_done(Completion* completion) {
+    Thread* waiter = __atomic_exchange_n(&completion->waiter, COMPLETION_DONE, __ATOMIC_ACQ_REL);
+    if (waiter != 0)
+        sched_ready(waiter);
+}
+
+void thread_exit() {
+    Thread* self = thread_current();
+    self->state = THREAD_EXITED;
+    context_switch(&self->rsp, this_sched()->rsp);
+    __builtin_unreachable();
+}
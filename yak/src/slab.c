@@ -0,0 +1,262 @@
+#include "cpu.h"
+#include "spinlock.h"
+#include "kalloc.h"
+#include "slab.h"
+
+/*
+ * Objects move between a CPU and the slabs [batch] at a time. A CPU keeps at
+ * most 2 * [batch] free objects.
+ */
+#define SLAB_BATCH 16
+// Slab order of kmalloc caches, so that kmfree can find the slab of any object
+#define KMALLOC_SLAB_ORDER 2
+#define KMALLOC_CACHES 8 // 16, 32, ..., 2048
+
+struct Slab {
+    KmemCache* cache;
+    struct Slab* next; // In the partial list of the cache
+    struct Slab* prev;
+    void* free; // Free objects of this slab
+    long inuse;
+};
+
+struct KmemCacheCpu {
+    void* free; // Free objects owned by this CPU
+    long count;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct KmemCache {
+    long size; // Object stride
+    long order; // Slab order
+    long first; // Offset of the first object in a slab
+    long objects; // Objects per slab
+    long batch;
+    Spinlock lock;
+    struct Slab* partial; // Slabs with free objects
+    struct Slab* empty; // One cached empty slab
+    struct KmemCacheCpu cpus[MAX_CPUS];
+};
+
+KmemCache* kmalloc_caches[KMALLOC_CACHES];
+
+long round_up(long value, long align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+KmemCache* kmem_cache_create_order(long size, long align, long order) {
+    KmemCache* cache = kalloc_pages(1);
+    if (cache == 0) {
+        return 0;
+    }
+
+    if (align < sizeof(void*)) {
+        align = sizeof(void*);
+    }
+    if (size > CACHE_LINE_SIZE/2 && align < CACHE_LINE_SIZE) {
+        align = CACHE_LINE_SIZE;
+    }
+    if (size < sizeof(void*)) {
+        size = sizeof(void*);
+    }
+
+    cache->size = round_up(size, align);
+    cache->first = round_up(sizeof(struct Slab), align);
+
+    // Smallest slab wasting at most 1/8 of its size
+    if (order < 0) {
+        order = 0;
+        while (order < MEGAPAGE_ORDER) {
+            long slab_size = FRAME_SIZE << order;
+            long waste = (slab_size - cache->first) % cache->size + cache->first;
+            if ((slab_size - cache->first) / cache->size > 0 && waste <= slab_size / 8) {
+                break;
+            }
+            order++;
+        }
+    }
+    cache->order = order;
+    cache->objects = ((FRAME_SIZE << order) - cache->first) / cache->size;
+    cache->batch = cache->objects < SLAB_BATCH ? cache->objects : SLAB_BATCH;
+
+    spinlock_init(&cache->lock);
+    cache->partial = 0;
+    cache->empty = 0;
+    for (int i=0; i<MAX_CPUS; i++) {
+        cache->cpus[i].free = 0;
+        cache->cpus[i].count = 0;
+    }
+
+    return cache;
+}
+
+KmemCache* kmem_cache_create(long size, long align) {
+    return kmem_cache_create_order(size, align, -1);
+}
+
+struct Slab* slab_of(KmemCache* cache, void* obj) {
+    return (struct Slab*) ((long)obj & ~((FRAME_SIZE << cache->order) - 1));
+}
+
+void unlink_slab(KmemCache* cache, struct Slab* slab) {
+    if (slab->prev != 0) {
+        slab->prev->next = slab->next;
+    } else {
+        cache->partial = slab->next;
+    }
+    if (slab->next != 0) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+void link_slab(KmemCache* cache, struct Slab* slab) {
+    slab->prev = 0;
+    slab->next = cache->partial;
+    if (slab->next != 0) {
+        slab->next->prev = slab;
+    }
+    cache->partial = slab;
+}
+
+struct Slab* new_slab(KmemCache* cache) {
+    /*
+     * Lock held
+     */
+    struct Slab* slab = cache->empty;
+    if (slab != 0) {
+        cache->empty = 0;
+        return slab;
+    }
+
+    slab = kalloc_pages(cache->order);
+    if (slab == 0) {
+        return 0;
+    }
+
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free = 0;
+    void* obj = (void*)slab + cache->first + (cache->objects - 1) * cache->size;
+    for (long i=0; i<cache->objects; i++) {
+        *(void**)obj = slab->free;
+        slab->free = obj;
+        obj -= cache->size;
+    }
+    return slab;
+}
+
+void put_object(KmemCache* cache, void* obj) {
+    /*
+     * Lock held. Give [obj] back to its slab.
+     */
+    struct Slab* slab = slab_of(cache, obj);
+
+    if (slab->inuse == cache->objects) {
+        link_slab(cache, slab);
+    }
+    *(void**)obj = slab->free;
+    slab->free = obj;
+    slab->inuse--;
+
+    // Keep a single empty slab around
+    if (slab->inuse == 0) {
+        unlink_slab(cache, slab);
+        if (cache->empty == 0) {
+            cache->empty = slab;
+        } else {
+            kfree_pages(slab, cache->order);
+        }
+    }
+}
+
+void* kmem_cache_refill(KmemCache* cache, struct KmemCacheCpu* cpu) {
+    /*
+     * Slow path of kmem_cache_alloc : move a batch of objects from the slabs
+     * to this CPU, and return one more.
+     */
+    acquire(&cache->lock);
+    for (long i=0; i<=cache->batch; i++) {
+        struct Slab* slab = cache->partial;
+        if (slab == 0) {
+            slab = new_slab(cache);
+            if (slab == 0) {
+                break;
+            }
+            link_slab(cache, slab);
+        }
+
+        void* obj = slab->free;
+        slab->free = *(void**)obj;
+        slab->inuse++;
+        if (slab->inuse == cache->objects) {
+            unlink_slab(cache, slab);
+        }
+
+        *(void**)obj = cpu->free;
+        cpu->free = obj;
+        cpu->count++;
+    }
+    release(&cache->lock);
+
+    void* obj = cpu->free;
+    if (obj != 0) {
+        cpu->free = *(void**)obj;
+        cpu->count--;
+    }
+    return obj;
+}
+
+void* kmem_cache_alloc(KmemCache* cache) {
+    struct KmemCacheCpu* cpu = &cache->cpus[cpu_id()];
+    void* obj = cpu->free;
+    if (obj != 0) {
+        cpu->free = *(void**)obj;
+        cpu->count--;
+        return obj;
+    }
+    return kmem_cache_refill(cache, cpu);
+}
+
+void kmem_cache_free(KmemCache* cache, void* obj) {
+    struct KmemCacheCpu* cpu = &cache->cpus[cpu_id()];
+    *(void**)obj = cpu->free;
+    cpu->free = obj;
+    cpu->count++;
+
+    // Too many free objects on this CPU : give a batch back to the slabs
+    if (cpu->count > 2 * cache->batch) {
+        acquire(&cache->lock);
+        for (long i=0; i<cache->batch; i++) {
+            obj = cpu->free;
+            cpu->free = *(void**)obj;
+            cpu->count--;
+            put_object(cache, obj);
+        }
+        release(&cache->lock);
+    }
+}
+
+void kmem_init() {
+    long size = KMALLOC_MIN;
+    for (int i=0; i<KMALLOC_CACHES; i++) {
+        // Naturally aligned (up to a cache line)
+        kmalloc_caches[i] = kmem_cache_create_order(size, size, KMALLOC_SLAB_ORDER);
+        size <<= 1;
+    }
+}
+
+void* kmalloc(long size) {
+    if (size > KMALLOC_MAX) {
+        return 0;
+    }
+
+    int i = 0;
+    while ((KMALLOC_MIN << i) < size) {
+        i++;
+    }
+    return kmem_cache_alloc(kmalloc_caches[i]);
+}
+
+void kmfree(void* obj) {
+    struct Slab* slab = (struct Slab*) ((long)obj & ~((FRAME_SIZE << KMALLOC_SLAB_ORDER) - 1));
+    kmem_cache_free(slab->cache, obj);
+}
@@ -0,0 +1,112 @@
+#include "acpi.h"
+#include "cow.h"
+#include "cpu.h"
+#include "kvm.h"
+#include "lapic.h"
+#include "pit.h"
+#include "smp.h"
+#include "string_ops.h"
+#include "vm.h"
+
+volatile int smp_ready;
+
+// Trampoline (ap_boot.s)
+extern char ap_boot_start[];
+extern char ap_boot_data[];
+extern char ap_boot_end[];
+
+long get_cr0() {
+    long cr0;
+    asm volatile("mov %%cr0, %0" : "=r" (cr0));
+    return cr0;
+}
+
+ApBootData* setup_trampoline() {
+    /*
+     * Copy the trampoline and build its page table : identity mapping of
+     * the first 2 MiB for the switch to long mode, kernel half shared with
+     * the kernel PML4 (its PDPTs never change, see kvminit)
+     */
+    void* trampoline = kvm_map_phys(AP_BOOT_ADDR, AP_BOOT_SIZE, KERNEL_FLAGS(PTE_READWRITE, PTE_XD));
+    if (trampoline == 0)
+        return 0;
+    memset(trampoline, 0, AP_BOOT_SIZE);
+    memcpy(trampoline, ap_boot_start, ap_boot_end - ap_boot_start);
+
+    long* pml4 = P2V(AP_BOOT_PML4);
+    long* pdpt = P2V(AP_BOOT_PDPT);
+    long* pd = P2V(AP_BOOT_PD);
+    memcpy(pml4 + USER_PML4_ENTRIES, (long*)PML4 + USER_PML4_ENTRIES, (ENTRIES_PER_TABLE - USER_PML4_ENTRIES) * sizeof(long));
+    pml4[0] = MAKE_ENTRY(AP_BOOT_PDPT, ENTRY_P | ENTRY_RW);
+    pdpt[0] = MAKE_ENTRY(AP_BOOT_PD, ENTRY_P | ENTRY_RW);
+    pd[0] = MAKE_ENTRY(0, ENTRY_P | ENTRY_RW | ENTRY_PS);
+
+    ApBootData* data = trampoline + (ap_boot_data - ap_boot_start);
+    data->cr0 = get_cr0();
+    data->cr3 = AP_BOOT_PML4;
+    data->cr4 = CR4_PAE | (vm_global ? CR4_PGE : 0);
+    data->efer = EFER_LME | ((cpu_features & CPU_NX) ? EFER_NXE : 0);
+    data->entry = ap_main;
+    return data;
+}
+
+int start_ap(Cpu* cpu) {
+    /*
+     * INIT, then STARTUP twice (the second one is ignored if the first one
+     * was delivered). Returns 1 if the AP did not come online.
+     */
+    lapic_send_ipi(cpu->apic_id, ICR_INIT | ICR_LEVEL | ICR_ASSERT);
+    lapic_send_ipi(cpu->apic_id, ICR_INIT | ICR_LEVEL);
+    pit_delay_us(AP_INIT_DELAY_US);
+
+    for (int i=0; i<2 && !cpu->online; i++) {
+        lapic_send_ipi(cpu->apic_id, ICR_STARTUP | (AP_BOOT_ADDR >> 12));
+        pit_delay_us(AP_STARTUP_DELAY_US);
+    }
+
+    for (long waited=0; !cpu->online; waited+=AP_STARTUP_DELAY_US) {
+        if (waited >= AP_ONLINE_TIMEOUT_US) {
+            // Back to wait-for-SIPI, so that it cannot show up later
+            lapic_send_ipi(cpu->apic_id, ICR_INIT | ICR_LEVEL | ICR_ASSERT);
+            return 1;
+        }
+        pit_delay_us(AP_STARTUP_DELAY_US);
+    }
+    return 0;
+}
+
+void smp_init() {
+    // No MADT or local APIC : uniprocessor
+    if (acpi_init() != 0 || lapic == 0)
+        goto done;
+    cpus[0].apic_id = lapic_id();
+
+    ApBootData* data = setup_trampoline();
+    if (data == 0)
+        goto done;
+
+    for (int i=0; i<acpi_ncpus && ncpus<MAX_CPUS; i++) {
+        if (acpi_apic_ids[i] == cpus[0].apic_id)
+            continue;
+
+        // CPU ids stay contiguous : [0, ncpus)
+        Cpu* cpu = &cpus[ncpus];
+        cpu->self = cpu;
+        cpu->id = ncpus;
+        cpu->apic_id = acpi_apic_ids[i];
+        cpu->stack_top = kvm_alloc_stack(cpu->id);
+        if (cpu->stack_top == 0)
+            break;
+
+        data->stack = cpu->stack_top;
+        data->cpu = cpu;
+        // Trampoline data visible before the IPI
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (start_ap(cpu) != 0)
+            break;
+        ncpus++;
+    }
+
+done:
+    __atomic_store_n(&smp_ready, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,116 @@
+#include "string_ops.h"
+#include "utils.h"
+#include "spinlock.h"
+
+#ifdef LOCK_STATS
+LockStats* lock_table[LOCK_TABLE_SIZE];
+int lock_count;
+
+void lock_stats_acquired(LockStats* stats, long wait_start) {
+    /*
+     * Lock held : only the registration races with other locks.
+     * [wait_start] is 0 for an uncontended acquisition.
+     */
+    long now = rdtsc();
+    if (!stats->registered) {
+        stats->registered = 1;
+        int i = __atomic_fetch_add(&lock_count, 1, __ATOMIC_RELAXED);
+        if (i < LOCK_TABLE_SIZE)
+            lock_table[i] = stats;
+    }
+    stats->acquisitions++;
+    if (wait_start != 0) {
+        stats->contended++;
+        stats->spin_cycles += now - wait_start;
+    }
+    stats->acquired_at = now;
+}
+
+void lock_stats_released(LockStats* stats) {
+    long hold = rdtsc() - stats->acquired_at;
+    if (hold > stats->max_hold_cycles)
+        stats->max_hold_cycles = hold;
+}
+
+#define lock_wait_start() rdtsc()
+#define lock_acquired(stats, wait_start) lock_stats_acquired(stats, wait_start)
+#define lock_released(stats) lock_stats_released(stats)
+#else
+#define lock_wait_start() 1
+#define lock_acquired(stats, wait_start) ((void)(wait_start))
+#define lock_released(stats) do {} while (0)
+#endif
+
+void spinlock_init(Spinlock* lock) {
+    memset(lock, 0, sizeof(Spinlock));
+}
+
+void acquire(Spinlock* lock) {
+    unsigned int ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    long wait_start = 0;
+    if (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        wait_start = lock_wait_start();
+        while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+            asm volatile("pause");
+        }
+    }
+    lock_acquired(&lock->stats, wait_start);
+}
+
+void release(Spinlock* lock) {
+    lock_released(&lock->stats);
+    // Only the holder writes [owner]
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+long acquire_irqsave(Spinlock* lock) {
+    long rflags = irq_save();
+    acquire(lock);
+    return rflags;
+}
+
+void release_irqrestore(Spinlock* lock, long rflags) {
+    release(lock);
+    irq_restore(rflags);
+}
+
+void mcs_acquire(McsLock* lock, McsNode* node) {
+    node->next = 0;
+    node->locked = 1;
+    long wait_start = 0;
+    McsNode* prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+    if (prev != 0) {
+        wait_start = lock_wait_start();
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+            asm volatile("pause");
+        }
+    }
+    lock_acquired(&lock->stats, wait_start);
+}
+
+void mcs_release(McsLock* lock, McsNode* node) {
+    lock_released(&lock->stats);
+    McsNode* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if (next == 0) {
+        McsNode* expected = node;
+        if (__atomic_compare_exchange_n(&lock->tail, &expected, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+        // A waiter swapped itself in, but has not linked its node yet
+        while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == 0) {
+            asm volatile("pause");
+        }
+    }
+    __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+long mcs_acquire_irqsave(McsLock* lock, McsNode* node) {
+    long rflags = irq_save();
+    mcs_acquire(lock, node);
+    return rflags;
+}
+
+void mcs_release_irqrestore(McsLock* lock, McsNode* node, long rflags) {
+    mcs_release(lock, node);
+    irq_restore(rflags);
+}
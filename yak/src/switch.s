@@ -0,0 +1,24 @@
+global context_switch
+
+section .text
+; rdi : where to save the stack pointer of the current context
+; rsi : stack pointer of the context to resume
+; Only callee-saved registers are switched (System V ABI) : the caller
+; already assumes the others are clobbered. Should be consistent with
+; context_init (sched.c).
+context_switch:
+    push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rdi], rsp
+    mov rsp, rsi
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
+    pop rbp
+    ret
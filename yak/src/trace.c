@@ -0,0 +1,90 @@
+#include "cpu.h"
+#include "kalloc.h"
+#include "ktime.h"
+#include "sched.h"
+#include "trace.h"
+#include "uart.h"
+#include "utils.h"
+
+/*
+ * [tail, head) are records not drained yet. The producer only reads tail
+ * again when the ring looks full.
+ */
+struct TraceRing {
+    TraceRecord* records;
+    unsigned long head;
+    unsigned long tail_cache; // Producer's copy of tail
+    unsigned long dropped;
+    volatile unsigned long tail __attribute__((aligned(64))); // Drainer only
+    unsigned long reported; // Drainer's copy of dropped
+} __attribute__((aligned(64)));
+
+struct TraceRing trace_rings[MAX_CPUS];
+
+void trace_record(int event, long arg0, long arg1) {
+    int cpu = cpu_id();
+    struct TraceRing* ring = &trace_rings[cpu];
+    if (ring->records == 0)
+        return;
+
+    unsigned long head = ring->head;
+    if (head - ring->tail_cache >= TRACE_RING_SIZE) {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - ring->tail_cache >= TRACE_RING_SIZE) {
+            ring->dropped++;
+            return;
+        }
+    }
+
+    TraceRecord* record = &ring->records[head & (TRACE_RING_SIZE-1)];
+    record->tsc = rdtsc();
+    record->event = event;
+    record->cpu = cpu;
+    record->seq = head;
+    record->arg0 = arg0;
+    record->arg1 = arg1;
+    __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+}
+
+int trace_init() {
+    uart_init();
+    for (int cpu=0; cpu<ncpus; cpu++) {
+        TraceRecord* records = kalloc_pages(TRACE_RING_ORDER);
+        if (records == 0)
+            return 1;
+        // Published last : trace_record of that CPU starts from here
+        __atomic_store_n(&trace_rings[cpu].records, records, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+void trace_emit(int cpu, int event, unsigned int seq, long arg0, long arg1) {
+    TraceRecord record = { rdtsc(), event, cpu, seq, arg0, arg1 };
+    uart_write(&record, sizeof(TraceRecord));
+}
+
+void trace_drain_ring(int cpu) {
+    struct TraceRing* ring = &trace_rings[cpu];
+    if (ring->records == 0)
+        return;
+
+    unsigned long dropped = ring->dropped;
+    if (dropped != ring->reported) {
+        trace_emit(cpu, TRACE_LOST, 0, dropped - ring->reported, 0);
+        ring->reported = dropped;
+    }
+
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    for (unsigned long tail=ring->tail; tail!=head; tail++)
+        uart_write(&ring->records[tail & (TRACE_RING_SIZE-1)], sizeof(TraceRecord));
+    __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+}
+
+void trace_drain(void* unused) {
+    trace_emit(cpu_id(), TRACE_HEADER, TRACE_MAGIC, tsc_hz, ktime_tsc_base);
+    while (1) {
+        for (int cpu=0; cpu<ncpus; cpu++)
+            trace_drain_ring(cpu);
+        thread_sleep(TRACE_DRAIN_INTERVAL_NS);
+    }
+}
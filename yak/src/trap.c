@@ -0,0 +1,141 @@
+#include "cow.h"
+#include "cpu.h"
+#include "demand.h"
+#include "lapic.h"
+#include "prof.h"
+#include "string_ops.h"
+#include "trap.h"
+
+#define GATE_INTERRUPT 0x8e // P=1 DPL=00 type=0xe (64-bit interrupt gate)
+
+typedef struct IdtEntry {
+    unsigned short offset_low;
+    unsigned short selector;
+    unsigned char ist;
+    unsigned char flags;
+    unsigned short offset_mid;
+    unsigned int offset_high;
+    unsigned int reserved;
+} IdtEntry;
+
+typedef struct __attribute__((packed)) DescriptorRegister {
+    unsigned short limit;
+    void* base;
+} DescriptorRegister;
+
+long gdt[] = {
+    0, // Null segment descriptor
+    0x00af9b000000ffff, // KERNEL_CS : P=1 DPL=00 code, L=1 D=0
+    0x00cf93000000ffff, // KERNEL_DS : P=1 DPL=00 data, writeable
+};
+
+IdtEntry idt[IDT_ENTRIES] __attribute__((aligned(16)));
+
+// Entry stubs (trap.s)
+extern void* trap_stubs[TRAP_VECTORS];
+extern char trap_wakeup[];
+extern char trap_timer[];
+extern char trap_device[];
+extern char trap_spurious[];
+
+// Read by trap_common (trap.s)
+long trap_xsave_size = 512;
+char trap_use_xsave = 0;
+
+TrapFrame trap_fatal_frame;
+long trap_fatal_cr2;
+
+void load_gdt() {
+    /*
+     * Load the kernel GDT, then reload CS (far return) and data segments
+     */
+    DescriptorRegister gdtr = { sizeof(gdt) - 1, gdt };
+    asm volatile("lgdt %0\n\t"
+                 "lea 1f(%%rip), %%rax\n\t"
+                 "push %1\n\t"
+                 "push %%rax\n\t"
+                 "lretq\n\t"
+                 "1:\n\t"
+                 "mov %2, %%ax\n\t"
+                 "mov %%ax, %%ds\n\t"
+                 "mov %%ax, %%es\n\t"
+                 "mov %%ax, %%ss\n\t"
+                 "mov %%ax, %%fs\n\t"
+                 "mov %%ax, %%gs"
+                 :
+                 : "m" (gdtr), "i" (KERNEL_CS), "i" (KERNEL_DS)
+                 : "rax", "memory");
+}
+
+void set_gate(int vector, void* handler) {
+    long offset = (long)handler;
+    IdtEntry* entry = &idt[vector];
+    entry->offset_low = offset & 0xffff;
+    entry->selector = KERNEL_CS;
+    entry->ist = 0;
+    entry->flags = GATE_INTERRUPT;
+    entry->offset_mid = (offset >> 16) & 0xffff;
+    entry->offset_high = (offset >> 32) & 0xffffffff;
+    entry->reserved = 0;
+}
+
+void trap_init() {
+    /*
+     * Handlers call kernel code that uses SSE / AVX : the stubs save the
+     * whole SIMD state, with XSAVE when AVX is enabled (size of the area
+     * for the components enabled in XCR0 given by CPUID 0xd).
+     */
+    if (string_features & STRING_AVX2) {
+        unsigned int a, b, c, d;
+        cpuid(0xd, 0, &a, &b, &c, &d);
+        trap_xsave_size = b;
+        trap_use_xsave = 1;
+    }
+
+    for (int vector=0; vector<TRAP_VECTORS; vector++)
+        set_gate(vector, trap_stubs[vector]);
+    set_gate(TRAP_WAKEUP, trap_wakeup);
+    set_gate(TRAP_TIMER, trap_timer);
+    set_gate(TRAP_BLK, trap_device);
+    set_gate(LAPIC_SPURIOUS_VECTOR, trap_spurious);
+
+    trap_load();
+}
+
+void trap_load() {
+    load_gdt();
+
+    DescriptorRegister idtr = { sizeof(idt) - 1, idt };
+    asm volatile("lidt %0" : : "m" (idtr));
+}
+
+long get_cr2() {
+    long cr2;
+    asm volatile("mov %%cr2, %0" : "=r" (cr2));
+    return cr2;
+}
+
+int page_fault(TrapFrame* frame) {
+    if (frame->error & PF_P)
+        return cow_fault(frame);
+    return demand_fault(frame);
+}
+
+void trap_handler(TrapFrame* frame) {
+    if (frame->vector == TRAP_PF && page_fault(frame) == 0)
+        return;
+    // Profiler samples (local APIC timer, NMI delivery)
+    if (frame->vector == TRAP_NMI && prof_nmi(frame) == 0)
+        return;
+
+    /*
+     * Unhandled : keep the frame for gdb and stop here rather than
+     * triple-faulting
+     */
+    trap_fatal_cr2 = get_cr2();
+    memcpy(&trap_fatal_frame, frame, sizeof(TrapFrame));
+    while (1) {
+        asm volatile("cli\n\t"
+                     "hlt");
+    }
+}
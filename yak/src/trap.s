@@ -0,0 +1,129 @@
+; Exception entry stubs (see trap.h)
+
+extern trap_handler
+extern trap_xsave_size
+extern trap_use_xsave
+extern lapic
+
+global trap_stubs
+global trap_wakeup
+global trap_timer
+global trap_device
+global trap_spurious
+
+TRAP_VECTORS equ 32
+
+section .text
+
+; One stub per vector : push a dummy error code when the CPU does not push
+; one, then the vector
+%assign i 0
+%rep TRAP_VECTORS
+trap_stub_%[i]:
+%if i == 8 || (i >= 10 && i <= 14) || i == 17 || i == 21 || i == 29 || i == 30
+%else
+    push 0
+%endif
+    push i
+    jmp trap_common
+%assign i i+1
+%endrep
+
+trap_common:
+    push rax
+    push rbx
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push rbp
+    push r8
+    push r9
+    push r10
+    push r11
+    push r12
+    push r13
+    push r14
+    push r15
+    cld
+    mov rbx, rsp ; TrapFrame*, callee-saved
+
+    ; SIMD state below the frame, 64-byte aligned
+    sub rsp, [trap_xsave_size]
+    and rsp, -64
+    cmp byte [trap_use_xsave], 0
+    je .fxsave
+    ; XRSTOR faults on a non-zero XCOMP_BV / reserved header bytes, and
+    ; XSAVE only writes XSTATE_BV
+    xor eax, eax
+    mov [rsp+520], rax
+    mov [rsp+528], rax
+    mov [rsp+536], rax
+    mov [rsp+544], rax
+    mov [rsp+552], rax
+    mov [rsp+560], rax
+    mov [rsp+568], rax
+    mov eax, -1
+    mov edx, -1
+    xsave64 [rsp]
+    jmp .call
+.fxsave:
+    fxsave64 [rsp]
+
+.call:
+    mov rdi, rbx
+    call trap_handler
+
+    cmp byte [trap_use_xsave], 0
+    je .fxrstor
+    mov eax, -1
+    mov edx, -1
+    xrstor64 [rsp]
+    jmp .restore
+.fxrstor:
+    fxrstor64 [rsp]
+
+.restore:
+    mov rsp, rbx
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rbp
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rbx
+    pop rax
+    add rsp, 16 ; Vector and error code
+    iretq
+
+; Wakeup IPI, timer and device interrupts : nothing to do but acknowledge
+; them, the CPU goes on after its hlt / mwait (devices are then polled by the
+; scheduler loop)
+trap_wakeup:
+trap_timer:
+trap_device:
+    push rax
+    mov rax, [lapic]
+    mov dword [rax+0xb0], 0 ; LAPIC_EOI
+    pop rax
+    iretq
+
+; Spurious interrupts from the local APIC must not be acknowledged
+trap_spurious:
+    iretq
+
+section .data
+
+trap_stubs:
+%assign i 0
+%rep TRAP_VECTORS
+    dq trap_stub_%[i]
+%assign i i+1
+%endrep
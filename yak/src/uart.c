@@ -0,0 +1,27 @@
+#include "uart.h"
+#include "utils.h"
+
+void uart_init() {
+    outb(COM1 + UART_IER, 0);
+    // 115200 / 1 baud
+    outb(COM1 + UART_LCR, UART_LCR_DLAB);
+    outb(COM1 + UART_DIVISOR_LOW, 1);
+    outb(COM1 + UART_DIVISOR_HIGH, 0);
+    outb(COM1 + UART_LCR, UART_LCR_8N1);
+    // Enable and clear the FIFOs, 14-byte threshold
+    outb(COM1 + UART_FCR, 0xc7);
+    // DTR, RTS, OUT2
+    outb(COM1 + UART_MCR, 0x0b);
+}
+
+void uart_putc(char c) {
+    while (!(inb(COM1 + UART_LSR) & UART_LSR_THR_EMPTY)) {
+        asm volatile("pause");
+    }
+    outb(COM1 + UART_DATA, c);
+}
+
+void uart_write(void* buffer, long size) {
+    for (long i=0; i<size; i++)
+        uart_putc(((char*)buffer)[i]);
+}
@@ -1,27 +1,19 @@
 #include "kalloc.h"
+#include "utils.h"
 
-void memcpy(void* dst_, void* src_, long sz) {
-    // 64 bit machine : can copy 8 by 8
-    long* src = (long*) src_;
-    long* dst = (long*) dst_;
-    long i;
-    for (i=0; i<sz>>3; i++) {
-        *(dst+i) = *(src+i);
-    }
-    i*=8;
-
-    // Remaining bytes : copy byte per byte
-    char* src2 = (char*) src;
-    char* dst2 = (char*) dst;
-    for (int j=0; j<sz%8; j++) {
-        *(dst2+i+j) = *(src2+i+j);
-    }
-}
-
-void memset(void* dst, char content, long sz) {
-    for (long i=0; i<sz; i++) {
-        *((char*)dst + i) = content;
+void zero_page_nt(void* page) {
+    // movnti works on general purpose registers : no SSE state needed
+    for (long i=0; i<FRAME_SIZE; i+=32) {
+        asm volatile("movnti %1, (%0)\n\t"
+                     "movnti %1, 8(%0)\n\t"
+                     "movnti %1, 16(%0)\n\t"
+                     "movnti %1, 24(%0)"
+                     :
+                     : "r" (page + i), "r" (0l)
+                     : "memory");
     }
+    // Non-temporal stores are weakly ordered
+    asm volatile("sfence" ::: "memory");
 }
 
 int is_aligned(void* addr) {
@@ -34,3 +26,46 @@ void* align_up(void* addr) {
     }
     return (void*)(((long)addr / FRAME_SIZE + 1) * FRAME_SIZE);
 }
+
+long rdtsc() {
+    unsigned int lo, hi;
+    asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((long)hi << 32) | lo;
+}
+
+long irq_save() {
+    long rflags;
+    asm volatile("pushfq\n\t"
+                 "pop %0\n\t"
+                 "cli" : "=r" (rflags) : : "memory");
+    return rflags;
+}
+
+void irq_restore(long rflags) {
+    if (rflags & RFLAGS_IF)
+        asm volatile("sti" : : : "memory");
+}
+
+void outb(unsigned short port, unsigned char value) {
+    asm volatile("outb %0, %1" : : "a" (value), "Nd" (port));
+}
+
+unsigned char inb(unsigned short port) {
+    unsigned char value;
+    asm volatile("inb %1, %0" : "=a" (value) : "Nd" (port));
+    return value;
+}
+
+void outw(unsigned short port, unsigned short value) {
+    asm volatile("outw %0, %1" : : "a" (value), "Nd" (port));
+}
+
+void outl(unsigned short port, unsigned int value) {
+    asm volatile("outl %0, %1" : : "a" (value), "Nd" (port));
+}
+
+unsigned int inl(unsigned short port) {
+    unsigned int value;
+    asm volatile("inl %1, %0" : "=a" (value) : "Nd" (port));
+    return value;
+}
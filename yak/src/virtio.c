@@ -0,0 +1,157 @@
+#include "kalloc.h"
+#include "kvm.h"
+#include "pci.h"
+#include "virtio.h"
+
+void* virtio_map_cap(PciDevice* pci, int cap, long* length) {
+    /*
+     * Configuration structure described by the vendor capability at [cap]
+     */
+    unsigned char bar = pci_read8(pci, cap + __builtin_offsetof(VirtioPciCap, bar));
+    unsigned int offset = pci_read32(pci, cap + __builtin_offsetof(VirtioPciCap, offset));
+    *length = pci_read32(pci, cap + __builtin_offsetof(VirtioPciCap, length));
+    if (bar > 5 || *length == 0)
+        return 0;
+    return pci_map_bar(pci, bar, offset, *length);
+}
+
+int virtio_init(VirtioDevice* dev, PciDevice* pci, unsigned long wanted) {
+    dev->pci = *pci;
+    dev->common = 0;
+    dev->notify = 0;
+    dev->device_config = 0;
+
+    // First capability of each type
+    for (int cap=pci_find_capability(pci, PCI_CAP_VENDOR, 0); cap!=0; cap=pci_find_capability(pci, PCI_CAP_VENDOR, cap)) {
+        int type = pci_read8(pci, cap + __builtin_offsetof(VirtioPciCap, cfg_type));
+        long length;
+        if (type == VIRTIO_PCI_CAP_COMMON && dev->common == 0) {
+            dev->common = virtio_map_cap(pci, cap, &length);
+            if (length < (long)sizeof(VirtioCommonCfg))
+                dev->common = 0;
+        } else if (type == VIRTIO_PCI_CAP_NOTIFY && dev->notify == 0) {
+            dev->notify = virtio_map_cap(pci, cap, &length);
+            dev->notify_multiplier = pci_read32(pci, cap + VIRTIO_NOTIFY_MULTIPLIER);
+        } else if (type == VIRTIO_PCI_CAP_DEVICE && dev->device_config == 0) {
+            dev->device_config = virtio_map_cap(pci, cap, &length);
+        }
+    }
+    // Legacy-only device
+    if (dev->common == 0 || dev->notify == 0)
+        return 1;
+
+    pci_enable(pci);
+    volatile VirtioCommonCfg* common = dev->common;
+    // Reset : reads 0 once done
+    common->device_status = 0;
+    while (common->device_status != 0) {
+        asm volatile("pause");
+    }
+    common->device_status = VIRTIO_STATUS_ACKNOWLEDGE;
+    common->device_status |= VIRTIO_STATUS_DRIVER;
+
+    common->device_feature_select = 0;
+    unsigned long offered = common->device_feature;
+    common->device_feature_select = 1;
+    offered |= (unsigned long)common->device_feature << 32;
+    if (!(offered & VIRTIO_F_VERSION_1)) {
+        virtio_fail(dev);
+        return 1;
+    }
+
+    dev->features = offered & (wanted | VIRTIO_F_VERSION_1);
+    common->driver_feature_select = 0;
+    common->driver_feature = dev->features;
+    common->driver_feature_select = 1;
+    common->driver_feature = dev->features >> 32;
+    common->device_status |= VIRTIO_STATUS_FEATURES_OK;
+    if (!(common->device_status & VIRTIO_STATUS_FEATURES_OK)) {
+        virtio_fail(dev);
+        return 1;
+    }
+
+    common->msix_config = VIRTIO_MSI_NO_VECTOR;
+    return 0;
+}
+
+int virtq_init(VirtioDevice* dev, Virtq* q, int index, int max_size, int msix_entry) {
+    /*
+     * Frame layout : descriptors, then the available ring, then the used
+     * ring (4-byte aligned)
+     */
+    volatile VirtioCommonCfg* common = dev->common;
+    common->queue_select = index;
+    int size = common->queue_size;
+    if (size == 0)
+        return 1;
+    // Sizes are powers of two
+    while (size > max_size)
+        size /= 2;
+
+    long desc_bytes = size * sizeof(VirtqDesc);
+    long avail_bytes = sizeof(VirtqAvail) + size * sizeof(short) + sizeof(short);
+    long used_offset = (desc_bytes + avail_bytes + 3) & ~3l;
+    long used_bytes = sizeof(VirtqUsed) + size * sizeof(VirtqUsedElem) + sizeof(short);
+    if (used_offset + used_bytes > FRAME_SIZE)
+        return 1;
+
+    void* frame = kalloc_zeroed();
+    if (frame == 0)
+        return 1;
+
+    q->size = size;
+    q->desc = frame;
+    q->avail = frame + desc_bytes;
+    q->used = frame + used_offset;
+    q->last_used = 0;
+    q->index = index;
+    q->doorbell = dev->notify + common->queue_notify_off * dev->notify_multiplier;
+
+    common->queue_size = size;
+    long addrs[3] = { V2P(q->desc), V2P(q->avail), V2P(q->used) };
+    volatile unsigned int* regs[3] = { common->queue_desc, common->queue_driver, common->queue_device };
+    for (int i=0; i<3; i++) {
+        regs[i][0] = addrs[i];
+        regs[i][1] = addrs[i] >> 32;
+    }
+    common->queue_msix_vector = msix_entry;
+    // The device may refuse the vector (out of MSI-X entries)
+    if (common->queue_msix_vector != msix_entry) {
+        kfree_zeroed(frame);
+        return 1;
+    }
+    common->queue_enable = 1;
+    return 0;
+}
+
+void virtio_ready(VirtioDevice* dev) {
+    dev->common->device_status |= VIRTIO_STATUS_DRIVER_OK;
+}
+
+void virtio_fail(VirtioDevice* dev) {
+    dev->common->device_status |= VIRTIO_STATUS_FAILED;
+}
+
+void virtq_push(Virtq* q, int head) {
+    unsigned short idx = q->avail->idx;
+    q->avail->ring[idx & (q->size - 1)] = head;
+    // Ring entry before the index (x86 keeps stores in order)
+    __atomic_signal_fence(__ATOMIC_RELEASE);
+    q->avail->idx = idx + 1;
+    // New index visible before reading the flags : a full barrier
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!(q->used->flags & VIRTQ_USED_F_NO_NOTIFY))
+        *q->doorbell = q->index;
+}
+
+int virtq_pop(Virtq* q, unsigned int* len) {
+    if (q->last_used == q->used->idx)
+        return -1;
+    // Entry read after the index
+    __atomic_signal_fence(__ATOMIC_ACQUIRE);
+    volatile VirtqUsedElem* elem = &q->used->ring[q->last_used & (q->size - 1)];
+    *len = elem->len;
+    int head = elem->id;
+    q->last_used++;
+    return head;
+}
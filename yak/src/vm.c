@@ -1,215 +1,479 @@
 #include "vm.h"
+#include "cpu.h"
 #include "kalloc.h"
+#include "kvm.h"
+#include "spinlock.h"
+#include "trace.h"
 #include "utils.h"
 
-#define PML4E_SHIFT 39
-#define PML4E_MASK ((0b111111111l) << PML4E_SHIFT)
-#define PDPTE_SHIFT 30
-#define PDPTE_MASK ((0b111111111l) << PDPTE_SHIFT)
-#define PDE_SHIFT 21
-#define PDE_MASK ((0b111111111l) << PDE_SHIFT)
-#define PTE_SHIFT 12
-#define PTE_MASK ((0b111111111l) << PTE_SHIFT)
+#define TABLE_INDEX_MASK 0b111111111l
+
+#define INVPCID_SINGLE_CONTEXT 1
+#define INVPCID_ALL_GLOBAL 2
+
+int vm_gigapages = 1;
+long vm_entry_mask = ~0l;
+int vm_global = 0;
+int vm_pcid = 0;
+
+/*
+ * Serializes page-table updates (vmmap_flags, vmunmap / vmprotect, clones
+ * and copy-on-write faults in cow.c) : the kernel half is shared by every
+ * address space, and any CPU may map into it (kvm_map_phys, kernel stacks,
+ * demand-zero faults).
+ * Lock order : cow_lock or demand_lock, then vm_lock, then kalloc_lock or
+ * kref_lock (page tables, freed frames).
+ */
+Spinlock vm_lock;
 
 int is_intermediate_entry(void* entry) {
     /*
      * Is this PML4E, PDPTE or PDE an intermediate entry ?
      */
-    // Check PS
-    return (*(long*)entry & 0x100) >> 8 == 0;
+    return (*(long*)entry & ENTRY_PS) == 0;
 }
 
 void* get_next_tba(void* entry) {
     /*
      * Assuming this PML4E, PDPTE or PDE is an intermediate entry,
-     * returns the address of the next table (TBA)
+     * returns the address of the next table (TBA), in the direct map
      */
-    return (void*) (((*(long*)entry >> 12) & 0xffffffff) << 12);
+    return P2V(*(long*)entry & ENTRY_ADDR_MASK);
 }
 
-int get_va_table_index(void* va, long mask, long shift) {
+long get_va_table_index(void* va, long shift) {
     /*
-     * Get index of address [va] in PT / PD / PDPT / PML4 [table].
+     * Get index of address [va] in PT / PD / PDPT / PML4.
      */
-    return 8*(((long)va & mask) >> shift);
+    return ((long)va >> shift) & TABLE_INDEX_MASK;
 }
 
-int check_vmmap(void* pml4, void* va, void* pa, long size) {
+int is_table_empty(long* table) {
+    for (int i=0; i<ENTRIES_PER_TABLE; i++) {
+        if (table[i] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+int fits_leaf(void* va, void* pa, long size, long leaf_size) {
     /*
-     * Check that the asked mapping is valid. 0 on success, -1 on failure.
-     * Assuming we can't address more than 512 GiB of RAM, such that the PML4 entry
-     * is always at index 0 (bits 39 to 47 are always null in virtual address)
+     * Can [va] -> [pa] be mapped with a single leaf of size [leaf_size] ?
      */
-    if (get_va_table_index(va, PML4E_MASK, PML4E_SHIFT) != 0
-        || get_va_table_index(va+size, PML4E_MASK, PML4E_SHIFT) != 0)
-        return -1;
+    return size >= leaf_size
+        && (long)va % leaf_size == 0
+        && (long)pa % leaf_size == 0;
+}
+
+long* get_or_create_table(long* entry, long leaf_flags) {
+    /*
+     * Returns the table referenced by the PML4E / PDPTE / PDE [entry].
+     * If the entry is absent, a clean table is allocated and linked.
+     * [leaf_flags] are the flags of the leaves that will live below it.
+     * Intermediate entries are left permissive (RW, executable) : the
+     * actual permissions are enforced by the leaves.
+     * Returns 0 if [entry] is a leaf (conflict) or if we ran out of frames.
+     */
+    long flags = ENTRY_P | ENTRY_RW | (leaf_flags & ENTRY_US);
+
+    if ((*entry & ENTRY_P) == 0) {
+        void* table = kalloc_zeroed();
+        if (table == 0)
+            return 0;
+        trace(TRACE_PT_ALLOC, V2P(table), 0);
+        *entry = MAKE_ENTRY(V2P(table), flags);
+        return table;
+    }
+
+    if (!is_intermediate_entry(entry))
+        return 0;
+
+    *entry |= flags;
+    return get_next_tba(entry);
+}
+
+long* split_leaf(long* entry, long shift) {
+    /*
+     * Replace the 2 MiB / 1 GiB leaf [entry] (spanning 1 << [shift] bytes) by
+     * a table of 512 leaves one level down, mapping the same range with the
+     * same flags. Returns the new table, or 0 if we ran out of frames.
+     */
+    long* table = kalloc_zeroed();
+    if (table == 0)
+        return 0;
+    trace(TRACE_PT_ALLOC, V2P(table), 1);
+
+    long leaf = *entry;
+    long pa = leaf & ENTRY_ADDR_MASK & ~((1l << shift) - 1);
+    long flags = (leaf & ~ENTRY_ADDR_MASK) | (leaf & ENTRY_PAT_LARGE);
+
+    if (shift == PDE_SHIFT) {
+        // 4 KiB pages : PS goes away, PAT moves back to bit 7
+        flags &= ~(ENTRY_PS | ENTRY_PAT_LARGE);
+        if (leaf & ENTRY_PAT_LARGE)
+            flags |= ENTRY_PAT;
+        fill_PTEs(table, MAKE_ENTRY(pa, flags), ENTRIES_PER_TABLE);
+    } else {
+        for (int i=0; i<ENTRIES_PER_TABLE; i++)
+            table[i] = MAKE_ENTRY(pa + (long)i * MEGAPAGE_SIZE, flags);
+    }
+
+    *entry = MAKE_ENTRY(V2P(table), ENTRY_P | ENTRY_RW | (leaf & ENTRY_US));
+    return table;
+}
+
+int update_level(long* table, long shift, long va, long end, long keep, long set, TlbBatch* batch) {
+    /*
+     * Rewrite every leaf of [table] (whose entries each span 1 << [shift] bytes)
+     * lying in [va] -> [end] as (leaf & [keep]) | [set], keep = set = 0
+     * unmapping it. Large leaves only partly inside the range are split first.
+     * Changed leaves and emptied tables below [table] are queued in [batch].
+     * Returns 1 if [table] itself is now empty, -1 if a split ran out of
+     * frames (leaves before that point are already updated).
+     */
+    long span = 1l << shift;
+
+    for (long i=get_va_table_index((void*)va, shift); i<ENTRIES_PER_TABLE && va<end; i++) {
+        long leaf_va = va & ~(span-1);
+        long next = leaf_va + span;
+        long* entry = table + i;
+
+        if (*entry & ENTRY_P) {
+            if (shift != PTE_SHIFT && !is_intermediate_entry(entry)
+                && (leaf_va != va || next > end)) {
+                if (split_leaf(entry, shift) == 0)
+                    return -1;
+            }
+
+            if (shift == PTE_SHIFT || !is_intermediate_entry(entry)) {
+                // May flush the batch : before this leaf is queued
+                if (batch->free_frames && shift == PTE_SHIFT)
+                    tlb_batch_free_frame(batch, P2V(*entry & ENTRY_ADDR_MASK));
+                tlb_batch_add(batch, (void*)leaf_va, *entry & ENTRY_G);
+                long leaf = (*entry & keep) | set;
+                // Shared leaves only become writeable in cow_fault
+                if (leaf & (ENTRY_COW | ENTRY_SHARED)) {
+                    leaf &= ~(ENTRY_RW | ENTRY_COW | ENTRY_SHARED);
+                    leaf |= (set & ENTRY_RW) ? ENTRY_COW : ENTRY_SHARED;
+                }
+                *entry = leaf;
+            } else {
+                long* child = get_next_tba(entry);
+                *entry |= set & ENTRY_US;
+                int ret = update_level(child, shift-9, va, next < end ? next : end, keep, set, batch);
+                if (ret < 0)
+                    return ret;
+                // PDPTs are kept : kernel ones are shared (see kvminit)
+                if (ret == 1 && shift != PML4E_SHIFT) {
+                    *entry = 0;
+                    tlb_batch_free_table(batch, child);
+                }
+            }
+        }
 
-    void* pml4e = pml4;
+        va = next;
+    }
 
-    // Is the PML4 entry not present ? -> The whole paging structure is ours !
-    if ((*(long*)pml4e & 1) == 0)
+    // Only unmapping can empty a table
+    return set == 0 && is_table_empty(table);
+}
+
+void prune_path(void* pml4, void* va, TlbBatch* batch) {
+    /*
+     * Unlink the tables on the path to [va] that hold no entry anymore
+     * (e.g. a table we just created before running out of frames).
+     */
+    long* entries[3];
+    long* table = pml4;
+    int depth = 0;
+
+    for (long shift=PML4E_SHIFT; shift>PTE_SHIFT; shift-=9) {
+        long* entry = table + get_va_table_index(va, shift);
+        if ((*entry & ENTRY_P) == 0 || !is_intermediate_entry(entry))
+            break;
+        entries[depth++] = entry;
+        table = get_next_tba(entry);
+    }
+
+    // PDPTs are kept (see update_level)
+    while (depth > 1) {
+        long* entry = entries[--depth];
+        long* child = get_next_tba(entry);
+        if (!is_table_empty(child))
+            return;
+        *entry = 0;
+        tlb_batch_free_table(batch, child);
+    }
+}
+
+int is_canonical_range(void* va, long size) {
+    /*
+     * Bits 63 to 47 must all be copies of bit 47, at both ends of the range
+     */
+    long first = (long)va >> 47;
+    long last = ((long)va + size - 1) >> 47;
+    return first == last && (first == 0 || first == -1);
+}
+
+int vmmap_locked(void* pml4, void* va, void* pa, long size, long flags) {
+    /*
+     * Single pass over the range : we keep our position inside the current
+     * PDPT / PD / PT and fill runs of entries, checking each entry before
+     * writing it. On conflict, everything mapped so far is rolled back.
+     */
+    flags &= vm_entry_mask;
+    long large_flags = ENTRY_LARGE_FLAGS(flags);
+
+    long offset = (long)va % PAGE_SIZE;
+    if (offset != (long)pa % PAGE_SIZE)
+        return -1;
+    va -= offset;
+    pa -= offset;
+    size = (long)align_up((void*)(size + offset));
+
+    if (size == 0)
         return 0;
+    if (size < 0 || !is_canonical_range(va, size))
+        return -1;
 
-    while (size != 0) {
-        void* pdpt = get_next_tba(pml4e);
-        void* pdpte = pdpt + get_va_table_index(va, PDPTE_MASK, PDPTE_SHIFT);
+    void* start = va;
 
-        // Is this PDPT entry absent ?
-        if ((*(long*)pdpte & 1) == 0) {
-            // Do we need a gigapage ?
-            if (size >= GIGAPAGE_SIZE
-                && (long)va % GIGAPAGE_SIZE == 0
-                && (long)pa % GIGAPAGE_SIZE == 0) {
+    while (size > 0) {
+        long* pml4e = (long*)pml4 + get_va_table_index(va, PML4E_SHIFT);
+        long* pdpt = get_or_create_table(pml4e, flags);
+        if (pdpt == 0)
+            goto rollback;
+
+        for (long i=get_va_table_index(va, PDPTE_SHIFT); i<ENTRIES_PER_TABLE && size>0; i++) {
+            long* pdpte = pdpt + i;
+
+            // Absent PDPT entry and enough room for a gigapage
+            if (vm_gigapages && (*pdpte & ENTRY_P) == 0
+                && fits_leaf(va, pa, size, GIGAPAGE_SIZE)) {
+                *pdpte = MAKE_ENTRY(pa, large_flags);
                 va += GIGAPAGE_SIZE;
                 pa += GIGAPAGE_SIZE;
                 size -= GIGAPAGE_SIZE;
                 continue;
             }
 
-            // Else, we need less, so it should be enough
-            return 0;
+            long* pd = get_or_create_table(pdpte, flags);
+            if (pd == 0)
+                goto rollback;
+
+            for (long j=get_va_table_index(va, PDE_SHIFT); j<ENTRIES_PER_TABLE && size>0; j++) {
+                long* pde = pd + j;
+
+                // Absent PD entry and enough room for a megapage
+                if ((*pde & ENTRY_P) == 0 && fits_leaf(va, pa, size, MEGAPAGE_SIZE)) {
+                    *pde = MAKE_ENTRY(pa, large_flags);
+                    va += MEGAPAGE_SIZE;
+                    pa += MEGAPAGE_SIZE;
+                    size -= MEGAPAGE_SIZE;
+                    continue;
+                }
+
+                long* pt = get_or_create_table(pde, flags);
+                if (pt == 0)
+                    goto rollback;
+
+                // Fill the run of 4 KiB pages that lives in this PT
+                long first = get_va_table_index(va, PTE_SHIFT);
+                long count = ENTRIES_PER_TABLE - first;
+                if (count > size / PAGE_SIZE)
+                    count = size / PAGE_SIZE;
+
+                for (long k=first; k<first+count; k++) {
+                    if (pt[k] & ENTRY_P)
+                        goto rollback;
+                }
+
+                fill_PTEs(pt + first, MAKE_ENTRY(pa, flags), count);
+
+                va += count * PAGE_SIZE;
+                pa += count * PAGE_SIZE;
+                size -= count * PAGE_SIZE;
+            }
+        }
+    }
 
-        // We need a gigapage but the matching PDPT entry already exists
-        } else if (size >= GIGAPAGE_SIZE
-                   && (long)va % GIGAPAGE_SIZE == 0
-                   && (long)pa % GIGAPAGE_SIZE == 0) {
-            return -1;
+    return 0;
 
-        // We need smaller than a gigapage but the matching PDPT entry points to a gigapage
-        } else if (!is_intermediate_entry(pdpte)) {
-            return -1;
-        }
+rollback:
+    // The new entries may already sit in the TLB / paging-structure caches
+    TlbBatch batch;
+    tlb_batch_init(&batch, pml4);
+    update_level(pml4, PML4E_SHIFT, (long)start, (long)va, 0, 0, &batch);
+    prune_path(pml4, va, &batch);
+    tlb_batch_flush(&batch);
+    return -1;
+}
 
-        void* pd = get_next_tba(pdpte);
-        void* pde = pd + get_va_table_index(va, PDE_MASK, PDE_SHIFT);
-
-        // Is this PD entry absent ?
-        if ((*(long*)pde & 1) == 0) {
-            // Do we need a megapage ?
-            if (size >= MEGAPAGE_SIZE
-                && (long)va % MEGAPAGE_SIZE == 0
-                && (long)pa % MEGAPAGE_SIZE == 0) {
-                va += MEGAPAGE_SIZE;
-                pa += MEGAPAGE_SIZE;
-                size -= MEGAPAGE_SIZE;
-                continue;
-            }
+int vmmap_flags(void* pml4, void* va, void* pa, long size, long flags) {
+    trace(TRACE_VMMAP, va, size);
+    acquire(&vm_lock);
+    int ret = vmmap_locked(pml4, va, pa, size, flags);
+    release(&vm_lock);
+    return ret;
+}
 
-            // Else, we need less, so it should be enough
+int vmmap(void* pml4, void* va, void* pa, long size, char rw, char us, long xd) {
+    return vmmap_flags(pml4, va, pa, size, ENTRY_FLAGS(rw, us, xd));
+}
+
+long* vmwalk(void* pml4, void* va) {
+    long* table = pml4;
+    for (long shift=PML4E_SHIFT; ; shift-=9) {
+        long* entry = table + get_va_table_index(va, shift);
+        if ((*entry & ENTRY_P) == 0)
             return 0;
+        if (shift == PTE_SHIFT || !is_intermediate_entry(entry))
+            return entry;
+        table = get_next_tba(entry);
+    }
+}
 
-        // We need a megapage but the matching PD entry already exists
-        } else if (size >= MEGAPAGE_SIZE
-                   && (long)va % MEGAPAGE_SIZE == 0
-                   && (long)pa % MEGAPAGE_SIZE == 0) {
-            return -1;
+int vmupdate(void* pml4, void* va, long size, long keep, long set, int free_frames) {
+    /*
+     * Common part of vmunmap and vmprotect
+     */
+    long offset = (long)va % PAGE_SIZE;
+    va -= offset;
+    size = (long)align_up((void*)(size + offset));
 
-        // We need smaller than a megapage but the matching PD entry points to a megapage
-        } else if (!is_intermediate_entry(pde)) {
-            return -1;
-        }
+    if (size == 0)
+        return 0;
+    if (size < 0 || !is_canonical_range(va, size))
+        return -1;
 
-        void* pt = get_next_tba(pde);
-        void* pte = pt + get_va_table_index(va, PTE_MASK, PTE_SHIFT);
+    TlbBatch batch;
+    tlb_batch_init(&batch, pml4);
+    batch.free_frames = free_frames;
+    acquire(&vm_lock);
+    int ret = update_level(pml4, PML4E_SHIFT, (long)va, (long)va + size, keep, set, &batch);
+    tlb_batch_flush(&batch);
+    release(&vm_lock);
+    return ret < 0 ? -1 : 0;
+}
 
-        // Is this PT entry already present ?
-        if ((*(long*)pte & 1) == 1)
-            return -1;
+int vmunmap(void* pml4, void* va, long size) {
+    return vmupdate(pml4, va, size, 0, 0, 0);
+}
 
-        va += PAGE_SIZE;
-        pa += PAGE_SIZE;
-        size -= PAGE_SIZE;
-    }
+int vmunmap_free(void* pml4, void* va, long size) {
+    return vmupdate(pml4, va, size, 0, 0, 1);
+}
 
-    return 0;
+int vmprotect(void* pml4, void* va, long size, char rw, char us, long xd) {
+    long set = ENTRY_FLAGS(rw, us, xd) & vm_entry_mask;
+    return vmupdate(pml4, va, size, ~(ENTRY_RW | ENTRY_US | ENTRY_XD), set, 0);
+}
+
+void tlb_batch_init(TlbBatch* batch, void* pml4) {
+    batch->pml4 = pml4;
+    batch->count = 0;
+    batch->global = 0;
+    batch->tables = 0;
+    batch->free_frames = 0;
+    batch->frame_count = 0;
 }
 
-int vmmap_core(void* pml4, void* va, void* pa, long size, char rw, char us, long xd) {
+void tlb_batch_add(TlbBatch* batch, void* va, long global) {
+    if (batch->count < TLB_BATCH_MAX)
+        batch->pages[batch->count] = va;
+    batch->count++;
+    batch->global |= global;
+}
+
+void tlb_batch_free_table(TlbBatch* batch, long* table) {
     /*
-     * Core of vmmap function (this is vmmap without the preliminary test)
+     * The table may still be cached in the paging-structure caches : it
+     * is only given back after the flush. Queued tables are linked through
+     * their first entry (a kernel address, hence not present).
      */
-    if (size == 0) {
-        return 0;
-    }
-
-    void* pml4e = pml4; // We use only the first entry
+    table[0] = (long)batch->tables;
+    batch->tables = table;
+}
 
-    // Is this PML4 entry absent ? If yes, create it.
-    if ((*(long*)pml4e & 1) == 0) {
-        void* pdpt = kalloc();
-        memset(pdpt, 0, TABLE_SIZE);
-        new_PML4E(pml4e, rw, us, xd, (TBA)pdpt);
-    }
+void tlb_batch_free_frame(TlbBatch* batch, void* frame) {
+    /*
+     * Same as tables, for the frames behind unmapped leaves. They cannot
+     * be linked through their content : another address space may still
+     * map them.
+     */
+    if (batch->frame_count == TLB_BATCH_MAX)
+        tlb_batch_flush(batch);
+    batch->frames[batch->frame_count++] = frame;
+}
 
-    void* pdpt = get_next_tba(pml4e);
-    void* pdpte = pdpt + get_va_table_index(va, PDPTE_MASK, PDPTE_SHIFT);
-
-    // Is this PDPT entry absent ? If yes, create it
-    if ((*(long*)pdpte & 1) == 0) {
-        // We dont need a gigapage
-        if (size < GIGAPAGE_SIZE
-            || (long)va % GIGAPAGE_SIZE != 0
-            || (long)pa % GIGAPAGE_SIZE != 0) {
-            void* pd = kalloc();
-            memset(pd, 0, TABLE_SIZE);
-            new_PDPTE_PD(pdpte, rw, us, xd, (TBA)pd);
-        // Allocate gigapage and map the remaining size
-        } else {
-            new_PDPTE_GP(pdpte, rw, us, xd, pa);
-            return vmmap_core(pml4,
-                              (void*)((long)va+GIGAPAGE_SIZE),
-                              (void*)((long)pa+GIGAPAGE_SIZE),
-                              size-GIGAPAGE_SIZE, rw, us, xd);
+void tlb_batch_flush(TlbBatch* batch) {
+    /*
+     * Few pages : one invlpg each (which also drops global translations and
+     * the paging-structure caches of the current PCID). Many pages : one
+     * full flush, keeping global entries unless a global leaf changed.
+     * Without PCID, a PML4 that is not loaded has no cached non-global
+     * entries. With PCID, they may be tagged with its PCID : everything goes.
+     */
+    if (batch->count > 0 || batch->tables != 0) {
+        int current = (get_cr3() & ENTRY_ADDR_MASK) == V2P(batch->pml4);
+
+        if (!current && vm_pcid) {
+            tlb_flush_global();
+        } else if (current || batch->global) {
+            if (batch->count > TLB_BATCH_MAX) {
+                if (batch->global)
+                    tlb_flush_global();
+                else
+                    tlb_flush_local();
+            } else if (batch->count == 0) {
+                // Only tables were unlinked
+                tlb_flush_local();
+            } else {
+                for (long i=0; i<batch->count; i++)
+                    invlpg(batch->pages[i]);
+            }
         }
     }
 
-    void* pd = get_next_tba(pdpte);
-    void* pde = pd + get_va_table_index(va, PDE_MASK, PDE_SHIFT);
-
-    // Is this PD entry absent ? If yes, create it
-    if ((*(long*)pde & 1) == 0) {
-        if (size < MEGAPAGE_SIZE
-            || (long)va % MEGAPAGE_SIZE != 0
-            || (long)pa % MEGAPAGE_SIZE != 0) {
-            void* pt = kalloc();
-            memset(pt, 0, TABLE_SIZE);
-            new_PDE_PT(pde, rw, us, xd, (TBA)pt);
-        // Allocate megapage and map the remaining size
-        } else {
-            new_PDE_MP(pde, rw, us, xd, pa);
-            return vmmap_core(pml4,
-                              (void*)((long)va+MEGAPAGE_SIZE),
-                              (void*)((long)pa+MEGAPAGE_SIZE),
-                              size-MEGAPAGE_SIZE, rw, us, xd);
-        }
+    while (batch->tables != 0) {
+        long* table = batch->tables;
+        batch->tables = (long*)table[0];
+        table[0] = 0;
+        kfree_zeroed(table);
     }
 
-    void* pt = get_next_tba(pde);
-    void* pte = pt + get_va_table_index(va, PTE_MASK, PTE_SHIFT);
-
-    // At this point, the PT entry should not be present
-    if ((*(long*)pte & 1) == 0) {
-        // Add a new 4 KiB page
-        new_PTE(pte, rw, us, xd, (long)pa);
-        return vmmap_core(pml4,
-                          (void*)((long)va+PAGE_SIZE),
-                          (void*)((long)pa+PAGE_SIZE),
-                          size-PAGE_SIZE, rw, us, xd);
-    // Should not happen
-    } else {
-        return -1;
-    }
+    for (int i=0; i<batch->frame_count; i++)
+        kref_put(batch->frames[i], 0);
+    batch->frame_count = 0;
 
-    return 0;
+    batch->count = 0;
+    batch->global = 0;
 }
 
-int vmmap(void* pml4, void* va, void* pa, long size, char rw, char us, long xd) {
-    if (check_vmmap(pml4, va, pa, size) != 0)
-        return -1;
-
-    return vmmap_core(pml4, va, pa, size, rw, us, xd);
+void fill_PTEs(long* pt, long entry, long count) {
+    /*
+     * Entries only differ by their physical address, so we just add the
+     * page stride. Unrolled by 4 : the 4 stores are independent.
+     */
+    long i = 0;
+    for (; i+4<=count; i+=4) {
+        pt[i] = entry;
+        pt[i+1] = entry + PAGE_SIZE;
+        pt[i+2] = entry + 2*PAGE_SIZE;
+        pt[i+3] = entry + 3*PAGE_SIZE;
+        entry += 4*PAGE_SIZE;
+    }
+    for (; i<count; i++) {
+        pt[i] = entry;
+        entry += PAGE_SIZE;
+    }
 }
 
+/*
+ * Privileged instructions. The hosted build (hosted/) runs this file as
+ * user code and brings its own versions (hosted/shim.c).
+ */
+#ifndef HOSTED
 void set_cr3(void* addr) {
     asm volatile("mfence\n\t"
                  "mov %0, %%rax\n\t"
@@ -219,47 +483,83 @@ void set_cr3(void* addr) {
                  : "r" (addr));
 }
 
+long get_cr3() {
+    long cr3;
+    asm volatile("mov %%cr3, %0" : "=r" (cr3));
+    return cr3;
+}
+
+void set_cr4_bits(long bits) {
+    asm volatile("mov %%cr4, %%rax\n\t"
+                 "or %0, %%rax\n\t"
+                 "mov %%rax, %%cr4"
+                 :
+                 : "r" (bits)
+                 : "rax");
+}
+
+void invlpg(void* va) {
+    asm volatile("invlpg (%0)" : : "r" (va) : "memory");
+}
+
+void invpcid(long type, long pcid, void* va) {
+    struct { long pcid; void* va; } descriptor = { pcid, va };
+    asm volatile("invpcid %0, %1" : : "m" (descriptor), "r" (type) : "memory");
+}
+
 void enable_efer_nxe() {
     asm volatile("mov $0xc0000080, %rcx\n\t"
                  "rdmsr\n\t"
                  "or $0x800, %rax\n\t"
                  "wrmsr\n\t");
 }
+#endif
+
+void load_cr3(void* addr, long pcid) {
+    if (vm_pcid)
+        set_cr3((void*)((long)addr | pcid | CR3_NOFLUSH));
+    else
+        set_cr3(addr);
+}
+
+void tlb_flush_local() {
+    /*
+     * Reloading CR3 (no-flush bit clear) drops the non-global entries of
+     * the current PCID
+     */
+    set_cr3((void*)(get_cr3() & ~CR3_NOFLUSH));
+}
+
+void tlb_flush_global() {
+    /*
+     * Drop every entry, global ones and other PCIDs included. Without
+     * INVPCID, toggling CR4.PGE does the same.
+     */
+    if (cpu_features & CPU_INVPCID) {
+        invpcid(INVPCID_ALL_GLOBAL, 0, 0);
+    } else if (vm_global) {
+        asm volatile("mov %%cr4, %%rax\n\t"
+                     "mov %%rax, %%rcx\n\t"
+                     "xor %0, %%rcx\n\t"
+                     "mov %%rcx, %%cr4\n\t"
+                     "mov %%rax, %%cr4"
+                     :
+                     : "i" (CR4_PGE)
+                     : "rax", "rcx", "memory");
+    } else {
+        tlb_flush_local();
+    }
+}
+
+void tlb_flush_pcid(long pcid) {
+    if (cpu_features & CPU_INVPCID)
+        invpcid(INVPCID_SINGLE_CONTEXT, pcid, 0);
+    else
+        tlb_flush_global();
+}
 
 void new_PTE(void* addr, char rw, char us, long xd, PPN ppn) {
-    ppn >>= 12; // Write only bits 51 to 12 of physical address
-
-    *((long*)addr) = 0; // Set PTE to 0
-    char* addr_ = (char*) addr;
-
-    // Hardcoded values : P = 1, PWT = 0, PCD = 0, A = 0, D = 0, PAT = 0, G = 0
-    (*addr_) |= (1<<0);
-    (*addr_) |= (rw<<1);
-    (*addr_) |= (us<<2);
-
-    // First 4 bits (bits 12 to 15)
-    addr_ += 1;
-    (*addr_) |= (ppn & 0xf) << 4;
-    ppn >>= 4;
-
-    // Remaining 36 bits
-    addr_ += 1;
-    (*addr_) |= (ppn & 0xff);
-    ppn >>= 8;
-    addr_ += 1;
-    (*addr_) |= (ppn & 0xff);
-    ppn >>= 8;
-    addr_ += 1;
-    (*addr_) |= (ppn & 0xff);
-    ppn >>= 8;
-    addr_ += 1;
-    (*addr_) |= (ppn & 0xff);
-    ppn >>= 8;
-    addr_ += 1;
-    (*addr_) |= (ppn & 0xf);
-
-    // Last bit : execute disable
-    *(long*)addr |= (xd<<63);
+    *(long*)addr = MAKE_ENTRY(ppn, ENTRY_FLAGS(rw, us, xd));
 }
 
 void new_PDE_PT(void* addr, char rw, char us, long xd, TBA tba) {
@@ -275,19 +575,9 @@ void new_PML4E(void* addr, char rw, char us, long xd, TBA tba) {
 }
 
 void new_PDE_MP(void* addr, char rw, char us, long xd, void* pa) {
-    long pa_ = (long)pa;
-    // Clear lsb
-    pa_ >>= 21;
-    pa_ <<= 21;
-    new_PTE(addr, rw, us, xd, pa_);
-    *(long*)addr ^= 0b10000000;
+    *(long*)addr = MAKE_ENTRY((long)pa & ~(MEGAPAGE_SIZE-1), ENTRY_FLAGS(rw, us, xd) | ENTRY_PS);
 }
 
 void new_PDPTE_GP(void* addr, char rw, char us, long xd, void* pa) {
-    long pa_ = (long)pa;
-    // Clear lsb
-    pa_ >>= 30;
-    pa_ <<= 30;
-    new_PTE(addr, rw, us, xd, pa_);
-    *(long*)addr ^= 0b10000000;
+    *(long*)addr = MAKE_ENTRY((long)pa & ~(GIGAPAGE_SIZE-1), ENTRY_FLAGS(rw, us, xd) | ENTRY_PS);
 }